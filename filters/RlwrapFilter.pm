@@ -100,7 +100,7 @@ sub new {
 		   output_handler prompt_handler echo_handler
 		   message_handler history_handler hotkey_handler completion_handler signal_handler
 		   echo_handler message_handler cloak_and_dagger_verbose
-		   cumulative_output prompts_are_never_empty
+		   cumulative_output prompts_are_never_empty prompts_are_dynamic
 		   minimal_rlwrap_version);
   foreach my $acc (@accessors) {
     $self->{$acc} = "";
@@ -193,12 +193,17 @@ sub when_defined($@) {
 # When the filter starts, it tells rlwrap its interests as a string 'yyny..' (1 + TAG_MAX chars, 1 for each tag)
 # when receiving a message 'nnynn...' the follwoing function changes 'n' to 'y' for those message types that the
 # filter handles,so that at the end of the pipeline the message reflects the interests of all filters in the
-# pipeline
+# pipeline. A 'd' for TAG_PROMPT means: interested, but don't cache the results, as the prompt handler doesn't always
+# change the same prompt in the same way
 sub add_interests {
   my ($self, $message) = @_;
   my @interested = split //, $message;
   for (my $tag = 0; $tag < @interested; $tag++) {
-    next if $interested[$tag] eq 'y'; # a preceding filter in the pipeline has already shown interest
+    if ($tag == TAG_PROMPT and $self -> prompt_handler and $self -> prompts_are_dynamic) {
+      $interested[$tag] = 'd';
+      next;
+    }
+    next if $interested[$tag] ne 'n'; # a preceding filter in the pipeline has already shown interest
     $interested[$tag] = 'y'
       if ($tag == TAG_INPUT      and $self -> input_handler)
       or ($tag == TAG_OUTPUT     and ($self -> output_handler or $self -> echo_handler)) # echo is the first OUTPUT after INPUT
@@ -871,6 +876,15 @@ will not be touched.
 
 If $val evaluates to a true value, automatically reject empty prompts.
 
+=item $f -> prompts_are_dynamic($val)
+
+rlwrap remembers how the prompt handler changed a prompt, and won't
+ask again when the same prompt comes along. If $val evaluates to a
+true value, the prompt handler will be called for every prompt, as it
+should be when it doesn't always return the same result for the same
+prompt (e.g. when it puts a counter or the time in the prompt) or has
+side effects (like logging)
+
 =item $f -> command_line
 
 In scalar context: the rlwrapped command and its arguments as a string ("command -v blah")
@@ -37,6 +37,7 @@ filter.help_text = '\n'.join(
 )
 
 filter.prompt_handler = munge_prompt
+filter.prompts_are_dynamic = True # the prompt changes every time
 
 # This handler doesn't do anything, but it ensures that output is regeitered in $filter -> preious_tag:
 filter.output_handler = lambda output: output
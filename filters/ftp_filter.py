@@ -151,6 +151,7 @@ if __name__ == '__main__':
         "run plain Netkit ftp with completion for commands, local and remote files",
         "(demo filter to show the use of the cloak_and_dagger method)"])
     filter.prompt_handler = prompt_handler
+    filter.prompts_are_dynamic = True # the prompt shows the current directories
     filter.completion_handler = complete_handler
     filter.cloak_and_dagger_verbose = False # set to True to spy on cloak_and_dagger dialogue
     
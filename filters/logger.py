@@ -65,6 +65,7 @@ def just_copy_completions(*arg):
 
 if args.log_all:
     filter.prompt_handler = just_copy
+    filter.prompts_are_dynamic = True # log every prompt
     filter.completion_handler = just_copy_completions
     filter.history_handler = just_copy
     filter.input_handler = just_copy
@@ -26,5 +26,6 @@ def handle_prompt(last_line):
     
 
 filter.prompt_handler = handle_prompt
+filter.prompts_are_dynamic = True # the prompt handler prints the last line of output
 filter.run()
 
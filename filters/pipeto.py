@@ -70,6 +70,7 @@ filter.prompts_are_never_empty = True
 filter.input_handler = input
 filter.output_handler = output
 filter.prompt_handler = prompt_handler
+filter.prompts_are_dynamic = True # the prompt handler runs the pipeline
 filter.echo_handler = (lambda x: raw_input)
 
 filter.run()
@@ -423,6 +423,7 @@ class RlwrapFilter:
             'cloak_and_dagger_verbose':is_boolean,
             'cumulative_output':is_string,
             'prompts_are_never_empty':is_boolean,
+            'prompts_are_dynamic':is_boolean,
             'previous_tag':is_integer,
             'previous_message':is_string,
             'echo_has_been_handled':is_boolean,
@@ -532,7 +533,10 @@ class RlwrapFilter:
                        TAG_SIGNAL      : self.signal_handler}
 
         for tag in range(0, len(message)):
-            if interested[tag] == 'y':
+            if tag == TAG_PROMPT and self.prompt_handler is not None and self.prompts_are_dynamic:
+                interested[tag] = 'd'  # interested, but rlwrap shouldn't re-use earlier results of the prompt handler
+                continue
+            if interested[tag] != 'n':
                 continue   # a preceding filter in the pipeline has already shown interest
             if tag2handler[tag] is not None:
                 interested[tag] = 'y'
@@ -0,0 +1,306 @@
+/*  bktree.c: a BK-tree of completion words, to find "did you mean ...?" corrections for mistyped words
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License , or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; see the file COPYING.  If not, write to
+    the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+
+    You may contact the author by:
+       e-mail:  hanslub42@gmail.com
+*/
+
+
+/* When TAB finds no completions for a word, rlwrap offers the words on the completion list that are
+   within a small edit (Levenshtein) distance from it instead: "slect<TAB>" will become "select"
+
+   Comparing the word with every word on the list would be too slow for huge lists, so we keep the
+   words in a BK-tree (Burkhard & Keller, 1973): every child of a node is labeled with its distance to
+   that node. Because the edit distance is a metric, a word within distance n from the query can only be
+   found under children whose label differs at most n from the query's distance to their parent, which
+   prunes most of the tree.
+
+   Nodes cannot easily be removed from a BK-tree, so words that are removed from the completion
+   list are merely marked as dead (and revived when they are added again)                             */
+
+
+#include "rlwrap.h"
+
+#define MAX_WORD_LENGTH 255  /* longer words are not worth correcting */
+
+struct bknode {
+  char *word;
+  bool dead;
+  int nchildren;
+  struct bkchild {
+    int distance;
+    struct bknode *node;
+  } *children;
+};
+
+static struct bknode *root = NULL;
+static long nnodes = 0, ndead = 0;
+
+
+static inline unsigned char
+fold(unsigned char c)
+{
+  return completion_is_case_sensitive ? c : tolower(c);
+}
+
+
+/* Myers' bit-parallel algorithm (in Hyyro's formulation for edit distance): one column of the dynamic programming
+   matrix (for a pattern of at most 64 characters) is kept as bit vectors of +1/-1 vertical differences, and a whole
+   column is computed with a handful of 64-bit operations. This is many times faster than edit_distance() below,
+   and as building the BK-tree means computing (exact, unbounded) distances for every word, it matters */
+static int
+bit_parallel_distance(const char *pattern, int pattern_length, const char *text, int text_length, int max_distance)
+{
+  static uint64_t peq[256];   /* peq[c]: bit i is set if pattern[i] == c (all zeroes between calls) */
+  uint64_t positive = ~(uint64_t) 0, negative = 0, last = (uint64_t) 1 << (pattern_length - 1);
+  int distance = pattern_length, i, j;
+
+  for (i = 0; i < pattern_length; i++)
+    peq[fold(pattern[i])] |= (uint64_t) 1 << i;
+  for (j = 0; j < text_length; j++) {
+    uint64_t equal = peq[fold(text[j])];
+    uint64_t vertical = equal | negative;
+    uint64_t horizontal = (((equal & positive) + positive) ^ positive) | equal;
+    uint64_t horizontal_positive = negative | ~(horizontal | positive);
+    uint64_t horizontal_negative = positive & horizontal;
+    if (horizontal_positive & last)
+      distance++;
+    else if (horizontal_negative & last)
+      distance--;
+    if (distance - (text_length - j - 1) > max_distance) /* even if all remaining characters match, we'll be too far off */
+      break;
+    horizontal_positive = (horizontal_positive << 1) | 1;
+    horizontal_negative <<= 1;
+    positive = horizontal_negative | ~(vertical | horizontal_positive);
+    negative = horizontal_positive & vertical;
+  }
+  for (i = 0; i < pattern_length; i++)  /* clearing only what we have set is a lot cheaper than a memset() of peq */
+    peq[fold(pattern[i])] = 0;
+  return (j < text_length ? max_distance + 1 : min(distance, max_distance + 1));
+}
+
+
+/* Levenshtein distance between word1 and word2 (compared case-insensitively with --case-insensitive), or
+   max_distance + 1 if it is larger than max_distance (which we notice early, that's what makes this fast) */
+int
+edit_distance(const char *word1, const char *word2, int max_distance)
+{
+  int row1[MAX_WORD_LENGTH + 1], row2[MAX_WORD_LENGTH + 1];
+  int *previous = row1, *current = row2, *swap;
+  int length1 = strlen(word1), length2 = strlen(word2);
+  int i, j;
+
+  if (length1 > MAX_WORD_LENGTH || length2 > MAX_WORD_LENGTH || abs(length1 - length2) > max_distance)
+    return max_distance + 1;
+  if (length1 == 0 || length2 == 0)
+    return min(max(length1, length2), max_distance + 1);
+  if (length1 <= 64)
+    return bit_parallel_distance(word1, length1, word2, length2, max_distance);
+  if (length2 <= 64)
+    return bit_parallel_distance(word2, length2, word1, length1, max_distance);
+  for (j = 0; j <= length2; j++)
+    previous[j] = j;
+  for (i = 1; i <= length1; i++) {
+    int row_minimum = current[0] = i;
+    for (j = 1; j <= length2; j++) {
+      int substitution = previous[j - 1] + (fold(word1[i - 1]) != fold(word2[j - 1]));
+      int deletion = previous[j] + 1, insertion = current[j - 1] + 1;
+      current[j] = min(substitution, min(deletion, insertion));
+      row_minimum = min(row_minimum, current[j]);
+    }
+    if (row_minimum > max_distance)
+      return max_distance + 1;
+    swap = previous, previous = current, current = swap;
+  }
+  return min(previous[length2], max_distance + 1);
+}
+
+
+static struct bknode *
+new_node(const char *word)
+{
+  struct bknode *node = mymalloc(sizeof(struct bknode));
+  node->word = mysavestring(word);
+  node->dead = FALSE;
+  node->nchildren = 0;
+  node->children = NULL;
+  nnodes++;
+  return node;
+}
+
+
+void
+bktree_add(const char *word)
+{
+  struct bknode *node;
+
+  if (strlen(word) > MAX_WORD_LENGTH)
+    return;
+  if (!root) {
+    root = new_node(word);
+    return;
+  }
+  for (node = root; ; ) {
+    int distance = edit_distance(word, node->word, MAX_WORD_LENGTH), i;
+    if (distance == 0) {
+      if (node->dead) { /* with --case-insensitive, "foo" may revive "Foo" (just like it would replace it on the completion list) */
+        free(node->word);
+        node->word = mysavestring(word);
+        node->dead = FALSE;
+        ndead--;
+      }
+      return;
+    }
+    for (i = 0; i < node->nchildren; i++)
+      if (node->children[i].distance == distance)
+        break;
+    if (i == node->nchildren) {
+      node->children = myrealloc(node->children, node->nchildren * sizeof(struct bkchild), (node->nchildren + 1) * sizeof(struct bkchild));
+      node->children[i].distance = distance;
+      node->children[i].node = new_node(word);
+      node->nchildren++;
+      return;
+    }
+    node = node->children[i].node;
+  }
+}
+
+
+void
+bktree_remove(const char *word)
+{
+  struct bknode *node = root;
+
+  while (node) {
+    int distance = edit_distance(word, node->word, MAX_WORD_LENGTH), i;
+    struct bknode *next = NULL;
+    if (distance == 0) {
+      if (!node->dead) {
+        node->dead = TRUE;
+        ndead++;
+      }
+      return;
+    }
+    for (i = 0; i < node->nchildren; i++)
+      if (node->children[i].distance == distance)
+        next = node->children[i].node;
+    node = next;
+  }
+}
+
+
+struct correction {
+  const char *word;
+  int distance;
+};
+
+
+static int
+better_correction(const void *a, const void *b)
+{
+  const struct correction *c1 = a, *c2 = b;
+  return c1->distance != c2->distance ? c1->distance - c2->distance : compare(c1->word, c2->word);
+}
+
+
+static void
+append_correction(struct correction **corrections, int *count, int *allocated, const char *word, int distance)
+{
+  if (*count >= *allocated) {
+    int new_allocated = max(2 * *allocated, 16);
+    *corrections = myrealloc(*corrections, *allocated * sizeof(struct correction), new_allocated * sizeof(struct correction));
+    *allocated = new_allocated;
+  }
+  (*corrections)[*count].word = word;
+  (*corrections)[*count].distance = distance;
+  (*count)++;
+}
+
+
+/* All live words within max_distance from word, closest first, as a NULL-terminated list of pointers into the tree
+   (so the caller should only free() the list itself). Walks the tree with an explicit stack, as it may be deep */
+const char **
+bktree_lookup(const char *word, int max_distance)
+{
+  struct correction *corrections = NULL;
+  struct bknode **stack = NULL;
+  int ncorrections = 0, corrections_allocated = 0, depth = 0, stack_allocated = 0, i;
+  long visited = 0;
+  const char **result;
+
+  if (root) {
+    stack = mymalloc((stack_allocated = 64) * sizeof(struct bknode *));
+    stack[depth++] = root;
+  }
+  while (depth > 0) {
+    struct bknode *node = stack[--depth];
+    int bound = max_distance, distance;
+    for (i = 0; i < node->nchildren; i++)   /* if word is farther than this from node, none of node's children can be close enough */
+      bound = max(bound, node->children[i].distance + max_distance);
+    distance = edit_distance(word, node->word, bound);
+    visited++;
+    if (distance <= max_distance && !node->dead)
+      append_correction(&corrections, &ncorrections, &corrections_allocated, node->word, distance);
+    for (i = 0; i < node->nchildren; i++) {
+      if (abs(node->children[i].distance - distance) > max_distance)
+        continue;
+      if (depth >= stack_allocated) {
+        stack = myrealloc(stack, stack_allocated * sizeof(struct bknode *), 2 * stack_allocated * sizeof(struct bknode *));
+        stack_allocated *= 2;
+      }
+      stack[depth++] = node->children[i].node;
+    }
+  }
+  if (ncorrections > 1)
+    qsort(corrections, ncorrections, sizeof(struct correction), &better_correction);
+  result = mymalloc((ncorrections + 1) * sizeof(char *));
+  for (i = 0; i < ncorrections; i++)
+    result[i] = corrections[i].word;
+  result[ncorrections] = NULL;
+  DPRINTF5(DEBUG_COMPLETION, "<%s>: %d corrections within distance %d (visited %ld of %ld words)",
+           word, ncorrections, max_distance, visited, nnodes - ndead);
+  if (corrections)
+    free(corrections);
+  if (stack)
+    free(stack);
+  return result;
+}
+
+
+/* Like bktree_lookup, but for the count (malloc'ed) words[] instead of the tree: keep only those within max_distance
+   (closest first), free the others, and return their number (words[] gets NULL-terminated). Used for small lists */
+int
+keep_words_within_edit_distance(const char *word, int max_distance, char **words, int count)
+{
+  struct correction *corrections = NULL;
+  int ncorrections = 0, corrections_allocated = 0, i;
+
+  for (i = 0; i < count; i++) {
+    int distance = edit_distance(word, words[i], max_distance);
+    if (distance <= max_distance)
+      append_correction(&corrections, &ncorrections, &corrections_allocated, words[i], distance);
+    else
+      free(words[i]);
+  }
+  if (ncorrections > 1)
+    qsort(corrections, ncorrections, sizeof(struct correction), &better_correction);
+  for (i = 0; i < ncorrections; i++)
+    words[i] = (char *) corrections[i].word;
+  words[ncorrections] = NULL;
+  if (corrections)
+    free(corrections);
+  return ncorrections;
+}
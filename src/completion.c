@@ -33,6 +33,7 @@
 
 
 #include "rlwrap.h"
+#include <limits.h>
 
 #ifdef assert
 #undef assert
@@ -1413,6 +1414,7 @@ RB_ENTRY(dumptree)(struct RB_ENTRY(node) *x, int n)
 
 /* forward declarations */
 static struct rbtree *completion_tree;
+static void forget_cached_candidates_if_affected_by(const char *word);
 
 
 static void
@@ -1468,32 +1470,195 @@ init_completer(void)
 void
 add_word_to_completions(const char *word)
 {
-  rbsearch(mysavestring(word), completion_tree);	/* the tree stores *pointers* to the words, we have to allocate copies of them ourselves
-							   freeing the tree will call free on the pointers to the words
-							   valgrind reports the copies as lost, I don't understand this.' */
+  char *copy;
+  if (word_is_indexed(word)) /* already on a compiled completion list */
+    return;
+  copy = mysavestring(word);
+  if (rbsearch(copy, completion_tree) != copy) { /* the tree stores *pointers* to the words, we have to allocate copies of them ourselves
+						    freeing the tree will call free on the pointers to the words. If word was already
+						    in the tree, rbsearch() returns the old copy, and we can throw away the new one */
+    free(copy);
+    return;
+  }
+  if (fuzzy_completion)
+    fuzzy_add_word(word);
+  bktree_add(word); /* cf. bktree.c */
+  forget_cached_candidates_if_affected_by(word);
 }
 
 
 void
 remove_word_from_completions(const char *word)
 {
-  free((char *) rbdelete(word, completion_tree));  /* why does rbdelete return a const *? I want to be able to free it! */	
+  const char *deleted = rbdelete(word, completion_tree);
+  if (deleted && fuzzy_completion)
+    fuzzy_remove_word(deleted);
+  if (deleted || unindex_word(word)) {
+    bktree_remove(word);
+    forget_cached_candidates_if_affected_by(word);
+  }
+  free((char *) deleted);  /* why does rbdelete return a const *? I want to be able to free it! */	
 }
 
+/* Split line into words (like split_with(line, rl_basic_word_break_characters) would) and add them to the completion list.
+   This happens for every line of input and output, and of every completion file (or, with -f ., history file), so we
+   split a single copy of line in place, instead of making a list of copies of its words                                */
 void
 feed_line_into_completion_list(const char *line)
 {
-  
-  char **words = split_with(line, rl_basic_word_break_characters);
-  char **plist, *word;
-  for(plist = words;(word = *plist); plist++) {
+  static char *breaks_are_for = NULL;  /* the word-breaking characters that breaks[] was made for */
+  static bool breaks[256];
+  char buffer[BUFFSIZE], *copy, *word, *p;
+  const char *c;
+
+  if (!breaks_are_for || strcmp(breaks_are_for, rl_basic_word_break_characters)) {
+    if (breaks_are_for)
+      free(breaks_are_for);
+    breaks_are_for = mysavestring(rl_basic_word_break_characters);
+    memset(breaks, 0, sizeof(breaks));
+    for (c = breaks_are_for; *c; c++)
+      breaks[(unsigned char) *c] = TRUE;
+  }
+  copy = strlen(line) < sizeof(buffer) ? strcpy(buffer, line) : mysavestring(line);
+  for (p = copy; *p; ) {
+    while (breaks[(unsigned char) *p])
+      p++;
+    if (!*p)
+      break;
+    for (word = p; *p && !breaks[(unsigned char) *p]; p++)
+      ;
+    if (*p)
+      *p++ = '\0';
     add_word_to_completions(word);
   }
-  free_splitlist(words);
+  if (copy != buffer)
+    free(copy);
 }
 
+
+/* Completion files may be divided into sections, each introduced by a line like "%after FROM JOIN INTO",
+   and (optionally) ended by a line "%end". The words in such a section are kept in a separate list, and
+   will only (and exclusively) be offered when completing a word that follows one of the section's keywords,
+   e.g. "SELECT * FROM cust<TAB>". Keywords are separated by whitespace and matched case-insensitively.
+   Words outside any section (and words remembered from in- and output) end up on the global completion list */
+#define SECTION_START "%after"
+#define SECTION_END   "%end"
+
+struct completion_section {
+  char *keyword;
+  struct rbtree *tree;
+  struct completion_section *next;
+};
+
+static struct completion_section *sections = NULL;
+static struct completion_section **sections_being_fed = NULL; /* NULL-terminated, or NULL outside any section */
+
+
+static struct completion_section *
+find_section(const char *keyword)
+{
+  struct completion_section *section;
+  for (section = sections; section; section = section->next)
+    if (strcasecmp(section->keyword, keyword) == 0)
+      return section;
+  return NULL;
+}
+
+
+static struct completion_section *
+find_or_create_section(const char *keyword)
+{
+  struct completion_section *section = find_section(keyword);
+  if (!section) {
+    section = mymalloc(sizeof(struct completion_section));
+    section->keyword = mysavestring(keyword);
+    section->tree    = rbinit();
+    section->next    = sections;
+    sections = section;
+    DPRINTF1(DEBUG_COMPLETION, "new completion section for words after <%s>", keyword);
+  }
+  return section;
+}
+
+
+static bool
+is_directive(const char *line, const char *directive)
+{
+  size_t length = strlen(directive);
+  return strncmp(line, directive, length) == 0 && (line[length] == '\0' || isspace((unsigned char) line[length]));
+}
+
+
+/* feed a line from a completion file (not from the history, or from in- or output, which cannot contain sections) */
 void
-feed_file_into_completion_list(const char *completions_file, bool warn_if_unreadable)
+feed_completion_file_line(const char *line)
+{
+  if (is_directive(line, SECTION_START) || is_directive(line, SECTION_END)) {
+    char **keywords = split_with(line, " \t\n\r"), **plist;
+    int i;
+    free(sections_being_fed);
+    sections_being_fed = NULL;
+    if (is_directive(line, SECTION_START) && keywords[1]) {
+      for (i = 1; keywords[i]; i++)
+        ;
+      sections_being_fed = mymalloc(i * sizeof(struct completion_section *));
+      for (i = 0, plist = keywords + 1; *plist; plist++)
+        sections_being_fed[i++] = find_or_create_section(*plist);
+      sections_being_fed[i] = NULL;
+    }
+    free_splitlist(keywords);
+  } else if (sections_being_fed) {
+    char **words = split_with(line, rl_basic_word_break_characters), **plist;
+    struct completion_section **section;
+    for (plist = words; *plist; plist++)
+      for (section = sections_being_fed; *section; section++) {
+        char *copy = mysavestring(*plist);
+        if (rbsearch(copy, (*section)->tree) != copy)
+          free(copy);
+      }
+    free_splitlist(words);
+  } else {
+    feed_line_into_completion_list(line);
+  }
+}
+
+
+/* a new completion file starts outside any section */
+void
+end_of_completion_file(void)
+{
+  free(sections_being_fed);
+  sections_being_fed = NULL;
+}
+
+
+/* the section (if any) for the word preceding the one that starts at position start in rl_line_buffer */
+static struct completion_section *
+section_for_preceding_word(int start)
+{
+  struct completion_section *section;
+  char *keyword;
+  int end;
+
+  if (!sections)
+    return NULL;
+  for (end = min(start, (int) strlen(rl_line_buffer)); end > 0 && isspace((unsigned char) rl_line_buffer[end - 1]); end--)
+    ;
+  for (start = end; start > 0 && !isspace((unsigned char) rl_line_buffer[start - 1]); start--)
+    ;
+  if (start == end)
+    return NULL;
+  keyword = mysavestring(rl_line_buffer + start);
+  keyword[end - start] = '\0';
+  section = find_section(keyword);
+  DPRINTF2(DEBUG_COMPLETION, "preceding word: <%s>%s", keyword, section ? " (has its own completion section)" : "");
+  free(keyword);
+  return section;
+}
+
+
+static void
+parse_completions_file(const char *completions_file, bool warn_if_unreadable)
 {
   FILE *compl_fp;
   char buffer[BUFFSIZE];
@@ -1505,8 +1670,9 @@ feed_file_into_completion_list(const char *completions_file, bool warn_if_unread
   }
   while (fgets(buffer, BUFFSIZE - 1, compl_fp) != NULL) {
     buffer[BUFFSIZE - 1] = '\0';	/* make sure buffer is properly terminated (it should be anyway, according to ANSI) */
-    feed_line_into_completion_list(buffer);
+    feed_completion_file_line(buffer);
   }
+  end_of_completion_file();
   if (! feof(compl_fp) && ferror(compl_fp) && warn_if_unreadable)   /* at least in GNU libc, errno will be set in this case. If not, no harm is done */
     myerror(WARNING|USE_ERRNO, "Couldn't read completions from %s", completions_file);
    
@@ -1515,19 +1681,65 @@ feed_file_into_completion_list(const char *completions_file, bool warn_if_unread
 }
 
 
+void
+feed_file_into_completion_list(const char *completions_file, bool warn_if_unreadable)
+{
+  if (!load_word_index(completions_file, warn_if_unreadable)) /* use <completions_file>.compiled if it is there, and up to date */
+    load_completions_lazily(completions_file, warn_if_unreadable, TRUE); /* cf. lazyload.c */
+}
+
+
+/* rlwrap --compile-completions: parse completions_file into a fresh completion tree and write
+   its (sorted, de-duplicated) contents to <completions_file>.compiled (cf. wordindex.c) */
+void
+compile_completions_file(const char *completions_file)
+{
+  struct rbtree *saved_completion_tree = completion_tree;
+  const char **words, *word;
+  long nwords, i;
+  RBLIST *list;
+
+  completion_tree = rbinit();
+  parse_completions_file(completions_file, TRUE);
+  if (sections)
+    myerror(FATAL|NOERRNO, "%s contains %s sections, which cannot be compiled", completions_file, SECTION_START);
+
+  for (nwords = 0, list = rbopenlist(completion_tree); rbreadlist(list); nwords++)
+    ;
+  rbcloselist(list);
+  words = mymalloc(max(nwords, 1) * sizeof(char *));
+  for (i = 0, list = rbopenlist(completion_tree); (word = rbreadlist(list)); i++)
+    words[i] = word;
+  rbcloselist(list);
+
+  write_word_index(completions_file, words, nwords);
+  free(words);
+  my_rbdestroy(completion_tree);
+  completion_tree = saved_completion_tree;
+}
+
+
 #define COMPLETE_FILENAMES 1
 #define COMPLETE_FROM_LIST 2
 #define COMPLETE_USERNAMES 4
 #define FILTER_COMPLETIONS 8
 #define COMPLETE_PARANORMALLY 16 /* read user's thoughts */
+#define COMPLETE_FUZZY 32        /* match words from the list by subsequence instead of prefix, best matches first */
+#define COMPLETE_FROM_SECTION 64 /* complete from the section for the preceding word instead of from the global list */
+
+static int completion_start = 0;                         /* where the word we're completing starts in rl_line_buffer */
+static struct completion_section *completion_section;   /* if COMPLETE_FROM_SECTION: the section for the word preceding it */
+static int offering_corrections = FALSE;                /* whether the last completion found only corrections */
+static int page_was_listed = FALSE;                     /* whether the user has seen the current page of a long list of completions ... */
+static int want_next_page = FALSE;                      /* ... and has pressed TAB again to see the next one */
 
-                                                         
 
 int
 get_completion_type(void)
-{				/* some day, this function will inspect the current line and make rlwrap complete
-				   differently according to the word *preceding* the one we're completing ' */
-  return (COMPLETE_FROM_LIST | (complete_filenames ? COMPLETE_FILENAMES : 0) | (filter_pid ? FILTER_COMPLETIONS : 0));
+{
+  completion_section = section_for_preceding_word(completion_start);
+  return (COMPLETE_FROM_LIST | (complete_filenames ? COMPLETE_FILENAMES : 0) | (filter_pid ? FILTER_COMPLETIONS : 0)
+          | (fuzzy_completion ? COMPLETE_FUZZY : 0) | (completion_section ? COMPLETE_FROM_SECTION : 0));
 }
 
 
@@ -1548,6 +1760,383 @@ is_prefix(const char *s0, const char *s1)
   return TRUE;
 }
 
+/* helper functions for my_completion_function: a candidate list is a NULL-terminated list of malloc'ed words (NULL
+   if empty) that keeps track of its own size, so that we can append to it, and narrow it down in place */
+struct candidates {
+  char **words;
+  int count, allocated;
+};
+
+
+static void
+append_to_candidates(struct candidates *candidates, char *word)
+{
+  if (candidates->count + 1 >= candidates->allocated) {
+    int new_allocated = max(2 * candidates->allocated, 64);
+    candidates->words = myrealloc(candidates->words, candidates->allocated * sizeof(char *), new_allocated * sizeof(char *));
+    candidates->allocated = new_allocated;
+  }
+  candidates->words[candidates->count++] = word;
+  candidates->words[candidates->count] = NULL;
+}
+
+
+static void
+clear_candidates(struct candidates *candidates)
+{
+  if (candidates->words)
+    free_splitlist(candidates->words);
+  candidates->words = NULL;
+  candidates->count = candidates->allocated = 0;
+}
+
+
+/* remove (and free) all candidates that don't start with prefix. If exact, compare case-sensitively (as readline does for filenames) */
+static void
+keep_candidates_with_prefix(struct candidates *candidates, const char *prefix, int exact)
+{
+  int i, j;
+  size_t length = strlen(prefix);
+
+  for (i = j = 0; i < candidates->count; i++) {
+    char *word = candidates->words[i];
+    if (exact ? strncmp(prefix, word, length) == 0 : is_prefix(prefix, word))
+      candidates->words[j++] = word;
+    else
+      free(word);
+  }
+  candidates->count = j;
+  if (candidates->words)
+    candidates->words[j] = NULL;
+}
+
+
+/* Pressing TAB, typing a few more characters and pressing TAB again is a common pattern. The second time,
+   all possible completions will be among those of the first, so we keep the (unfiltered) candidates of the
+   last completion in a cache, and narrow them down whenever the new prefix extends the old one.
+   The cache has to be forgotten when the completion list changes in a way that affects it, while the
+   cached filenames have to be looked up again when the directory listing they came from (cf. dircache.c) has
+   been re-read, or when they came from a different directory (e.g. because <command> changed its working
+   directory). The filter isn't involved at all: it always gets to see (only) the narrowed-down candidates.
+
+   With a huge completion list, a short prefix may have hundreds of thousands of candidates. We never collect more than
+   completion_limit (-L) of them at a time: the cache then holds one "page" of candidates, and pressing TAB again
+   after it has been listed fetches the next page (starting after the last word of the current one)           */
+static struct {
+  char *prefix;                   /* NULL when the cache is empty */
+  int completion_type;
+  struct completion_section *section; /* if the words came from a section instead of the global list */
+  int fuzzy;                      /* whether cached words were fuzzily matched */
+  int page;                       /* which page (of completion_limit words) we have, counting from 0 */
+  int more;                       /* whether there are more pages after this one */
+  struct candidates words;        /* candidates from the completion list (alphabetical, or best first when fuzzy) */
+  struct candidates filenames;    /* candidates from the file system (alphabetical, unless they came from readline) */
+  unsigned long listing_version;  /* version of the directory listing the filenames came from (0 if they came from readline) */
+} cache;
+
+
+static void
+forget_cached_candidates(void)
+{
+  free(cache.prefix);
+  cache.prefix = NULL;
+  clear_candidates(&cache.words);
+  clear_candidates(&cache.filenames);
+}
+
+
+/* called whenever word is added to or removed from the completion list */
+static void
+forget_cached_candidates_if_affected_by(const char *word)
+{
+  if (cache.prefix && (cache.fuzzy ? fuzzy_is_match(cache.prefix, word) : is_prefix(cache.prefix, word))) {
+    DPRINTF2(DEBUG_COMPLETION, "<%s> changed the completion list: forgetting cached candidates for <%s>", word, cache.prefix);
+    forget_cached_candidates();
+  }
+}
+
+
+static void
+milk_filename_completions(const char *prefix, struct candidates *candidates)
+{
+  int count;
+  char *word, **cached, **plist;
+
+  if ((cached = cached_filename_completions(prefix))) { /* cf. dircache.c */
+    for (plist = cached; *plist; plist++)
+      append_to_candidates(candidates, *plist);
+    free(cached);
+    return;
+  }
+  DPRINTF1(DEBUG_COMPLETION, "Starting milking of rl_filename_completion_function, prefix = <%s> ", prefix);
+  for (count = 0;
+       (word = copy_and_free_string_for_malloc_debug(rl_filename_completion_function(prefix, count)));
+       count++) {	/* using rl_filename_completion_function means
+			   that completing filenames will always be case-sensitive */
+    DPRINTF1(DEBUG_COMPLETION, "Adding <%s> to completion list ", word);
+    append_to_candidates(candidates, word);
+  }
+}
+
+
+static int
+compare_candidates(const void *a, const void *b)
+{
+  return compare(*(const char **) a, *(const char **) b);
+}
+
+
+/* sort candidates, removing duplicates */
+static void
+sort_candidates(struct candidates *candidates)
+{
+  int i, j;
+
+  if (candidates->count < 2)
+    return;
+  qsort(candidates->words, candidates->count, sizeof(char *), &compare_candidates);
+  for (i = j = 1; i < candidates->count; i++) {
+    if (compare(candidates->words[i], candidates->words[j-1]) == 0)
+      free(candidates->words[i]);
+    else
+      candidates->words[j++] = candidates->words[i];
+  }
+  candidates->count = j;
+  candidates->words[j] = NULL;
+}
+
+
+/* remove (and free) the candidates after the first skip + limit, and then the first skip (if limit > 0).
+   Returns TRUE if any candidates after the first skip + limit were removed */
+static int
+keep_page_of_candidates(struct candidates *candidates, int skip, int limit)
+{
+  int i, more = FALSE;
+
+  if (limit <= 0)
+    return FALSE;
+  for (i = skip + limit; i < candidates->count; i++, more = TRUE)
+    free(candidates->words[i]);
+  skip = min(skip, candidates->count);
+  for (i = 0; i < skip; i++)
+    free(candidates->words[i]);
+  candidates->count = max(min(candidates->count, skip + limit) - skip, 0);
+  if (candidates->words) {
+    memmove(candidates->words, candidates->words + skip, candidates->count * sizeof(char *));
+    candidates->words[candidates->count] = NULL;
+  }
+  return more;
+}
+
+
+/* The first completion_limit (or, if that is 0, all) words in the completion list (and in the compiled completion lists)
+   that start with prefix, in alphabetical order. If section is not NULL, use its list instead. If after is not NULL, start
+   after that word: this is the "cursor" that lets us fetch the next page of a long list without ever collecting all of it.
+   Returns TRUE if there are more words than we collected                                                                 */
+static int
+find_prefix_candidates(const char *prefix, const char *after, struct completion_section *section, struct candidates *candidates)
+{
+  const char *word, **indexed_words, **p;
+  struct rbtree *tree = section ? section->tree : completion_tree;
+  int wanted = completion_limit > 0 ? completion_limit + 1 : 0; /* one more than we need tells us whether there are more */
+
+  for (word = (after ? rblookup(RB_LUGREAT, after, tree) : rblookup(RB_LUGTEQ, prefix, tree)); /* start with first word > after or >= prefix */
+       word && is_prefix(prefix, word) && (!wanted || candidates->count < wanted);	/* as long as prefix is really prefix of word */
+       word = rblookup(RB_LUGREAT, word, tree)) {	/* find next word in list */
+    append_to_candidates(candidates, mysavestring(word));	/* insert fresh copy of the word */
+    /* DPRINTF1(DEBUG_COMPLETION, "Adding %s to completion list ", word); */
+  }
+  if (!section) {
+    indexed_words = indexed_words_with_prefix(prefix, after, wanted);
+    if (*indexed_words) {
+      for (p = indexed_words; *p; p++)
+        append_to_candidates(candidates, mysavestring(*p));
+      sort_candidates(candidates);
+    }
+    free(indexed_words);
+  }
+  return keep_page_of_candidates(candidates, 0, completion_limit);
+}
+
+
+/* all words in the completion list that contain the characters of query in the same order, best matches first, except for the
+   best skip. Only completion_limit of them are collected (returns TRUE if there are more). Sections are small enough to just
+   rank all of their words */
+static int
+find_fuzzy_candidates(const char *query, int skip, struct completion_section *section, struct candidates *candidates)
+{
+  const char **matches, **p;
+  bool more = FALSE;
+
+  if (section) {
+    RBLIST *list = rbopenlist(section->tree);
+    const char *word;
+    while ((word = rbreadlist(list)))
+      append_to_candidates(candidates, mysavestring(word));
+    rbcloselist(list);
+    if (candidates->words)
+      candidates->count = fuzzy_rank(query, candidates->words, candidates->count);
+    return keep_page_of_candidates(candidates, skip, completion_limit);
+  }
+  matches = fuzzy_matches(query, skip, completion_limit, &more);
+  for (p = matches; *p; p++)
+    append_to_candidates(candidates, mysavestring(*p));
+  free(matches);
+  return more;
+}
+
+
+/* Words on the completion list that are only a few typos away from word, closest first (cf. bktree.c). The BK-tree
+   is kept up to date by add_word_to_completions() and remove_word_from_completions(), while the words on compiled
+   lists are added to it while rlwrap is idle (cf. lazyload.c). Sections are small enough to just compare word with
+   every one of their words */
+static void
+find_corrections(const char *word, struct completion_section *section, struct candidates *candidates)
+{
+  size_t length = strlen(word);
+  int max_distance = (length < 3 ? 0 : length < 6 ? 1 : 2); /* 2 typos in a 3-letter word leave too many candidates */
+  const char **corrections, **p, *listed;
+
+  if (max_distance == 0)
+    return;
+  if (section) {
+    RBLIST *list = rbopenlist(section->tree);
+    while ((listed = rbreadlist(list)))
+      append_to_candidates(candidates, mysavestring(listed));
+    rbcloselist(list);
+    if (candidates->words)
+      candidates->count = keep_words_within_edit_distance(word, max_distance, candidates->words, candidates->count);
+    return;
+  }
+  add_indexed_words_to_bktree(INT_MAX); /* normally, there'll be nothing left to do */
+  corrections = bktree_lookup(word, max_distance);
+  for (p = corrections; *p && (completion_limit <= 0 || candidates->count < completion_limit); p++) /* only the closest, if there are very many */
+    append_to_candidates(candidates, mysavestring(*p));
+  free(corrections);
+}
+
+
+/* fill the cache with the candidates for prefix, re-using (and narrowing down) what is already there if possible.
+   If next_page, and the cache holds a page of candidates for the same prefix, fetch the next page (or, after the last one,
+   the first page again) */
+static void
+update_cache(const char *prefix, int completion_type, int next_page)
+{
+  int fuzzy = (completion_type & COMPLETE_FUZZY) && *prefix;
+  struct completion_section *section = (completion_type & COMPLETE_FROM_SECTION) ? completion_section : NULL;
+  int same_kind = cache.prefix && cache.completion_type == completion_type && cache.section == section && cache.fuzzy == fuzzy;
+  int page = (next_page && same_kind && cache.more && strcmp(cache.prefix, prefix) == 0) ? cache.page + 1 : 0;
+  int can_narrow = same_kind && page == 0 && cache.page == 0 && !cache.more && is_prefix(cache.prefix, prefix); /* a page cannot be narrowed down */
+  int more = FALSE;
+
+  if (completion_type & COMPLETE_FROM_LIST) {
+    if (page > 0) {
+      char *after = fuzzy || cache.words.count == 0 ? NULL : mysavestring(cache.words.words[cache.words.count - 1]);
+      clear_candidates(&cache.words);
+      if (fuzzy)
+        more = find_fuzzy_candidates(prefix, page * completion_limit, section, &cache.words);
+      else
+        more = find_prefix_candidates(prefix, after, section, &cache.words);
+      if (after)
+        free(after);
+    } else if (!can_narrow) {
+      clear_candidates(&cache.words);
+      if (fuzzy)
+        more = find_fuzzy_candidates(prefix, 0, section, &cache.words);
+      else
+        more = find_prefix_candidates(prefix, NULL, section, &cache.words);
+    } else if (fuzzy) {
+      cache.words.count = fuzzy_rank(prefix, cache.words.words, cache.words.count);
+    } else {
+      keep_candidates_with_prefix(&cache.words, prefix, FALSE);
+    }
+  }
+  
+  if ((completion_type & COMPLETE_FILENAMES) && page == 0) {
+    unsigned long version;
+    change_working_directory();
+    version = directory_listing_version(prefix); /* cf. dircache.c */
+    if (!can_narrow || !version || version != cache.listing_version
+        || strncmp(cache.prefix, prefix, strlen(cache.prefix)) /* (case-)insensitive narrowing is OK for words, not for filenames */
+        || strchr(prefix + strlen(cache.prefix), '/')) {         /* "dir" -> "dir/": we'll have to look inside dir */
+      clear_candidates(&cache.filenames);
+      milk_filename_completions(prefix, &cache.filenames);
+      cache.listing_version = version;
+    } else {
+      keep_candidates_with_prefix(&cache.filenames, prefix, TRUE);
+    }
+  } else {
+    clear_candidates(&cache.filenames);
+  }
+  DPRINTF5(DEBUG_COMPLETION, "%s cache for <%s>: %d words (page %d), %d filenames", (can_narrow ? "narrowed": "filled"), prefix,
+           cache.words.count, page, cache.filenames.count);
+  free(cache.prefix);
+  cache.prefix = mysavestring(prefix);
+  cache.completion_type = completion_type;
+  cache.section = section;
+  cache.fuzzy = fuzzy;
+  cache.page = page;
+  cache.more = more;
+}
+
+
+/* combine (copies of) the cached words and filenames into one list. Filenames that are on the completion list 
+   already are skipped. If not fuzzy, sort the result (fuzzy matches are already ranked, filenames come last) */
+static struct candidates
+combine_cached_candidates(void)
+{
+  struct candidates combined = {NULL, 0, 0};
+  char **plist;
+
+  for (plist = cache.words.words; plist && *plist; plist++)
+    append_to_candidates(&combined, mysavestring(*plist));
+  for (plist = cache.filenames.words; plist && *plist; plist++)
+    if (!((cache.completion_type & COMPLETE_FROM_LIST) &&
+          (cache.section ? rblookup(RB_LUEQUAL, *plist, cache.section->tree) != NULL
+                         : (rblookup(RB_LUEQUAL, *plist, completion_tree) || word_is_indexed(*plist)))))
+      append_to_candidates(&combined, mysavestring(*plist));
+  if (!cache.fuzzy && cache.filenames.count && combined.count > 1)
+    qsort(combined.words, combined.count, sizeof(char *), &compare_candidates);
+  return combined;
+}
+
+
+/* pass the candidates through the filter, which may add, remove or re-order them */
+static void
+filter_candidates(const char *prefix, struct candidates *candidates)
+{
+  char *filter_food = NULL;
+  char *filtered, **filtered_components, **plist;
+  int count;
+
+  /* build the "filter food" (input for the filter) as a field list
+     <rl_line_buffer><prefix><completion1><completion2>....                    */
+  filter_food = append_field_and_free_old(filter_food, rl_line_buffer);
+  filter_food = append_field_and_free_old(filter_food, prefix); 
+  for (plist = candidates->words; plist && *plist; plist++) 
+    filter_food = append_field_and_free_old(filter_food, *plist);
+  clear_candidates(candidates);
+      
+  filtered = pass_through_filter(TAG_COMPLETION, filter_food);
+  free(filter_food);
+  DPRINTF1(DEBUG_ALL, "Filtered: %s", mangle_string_for_debug_log(filtered, 40));
+
+  filtered_components = split_filter_message(filtered, &count);
+  free(filtered);
+      
+  if ( count <2 || strcmp(filtered_components[0], rl_line_buffer) ||  strcmp(filtered_components[1], prefix)) 
+    myerror(FATAL|NOERRNO, "filter has illegally messed with completion message\n"); /* it should ONLY have changed the completion word list  */
+
+  for(plist = filtered_components + 2; *plist; plist++) {
+    if (!**plist)
+      continue; /* empty space at beginning or end of the word list results in an empty word, ignore those now */	
+    append_to_candidates(candidates, mysavestring(*plist)); /* keep the filter's order */
+    DPRINTF1(DEBUG_COMPLETION, "Adding %s to completion list ", *plist); 
+  }
+  free_splitlist(filtered_components);
+}
+
+
 /* See readline doumentation: this function is called by readline whenever a completion is needed. The first time state == 0,
    whwnever the user presses TAB to cycle through the list, my_completion_function() is called again, but then with state != 0
    It should return the completion, which then will be freed by readline (so we'll hand back a copy instead of the real thing) ' */
@@ -1556,10 +2145,9 @@ is_prefix(const char *s0, const char *s1)
 char *
 my_completion_function(char *prefix, int state)
 {
-  static struct rbtree *scratch_tree = NULL;
-  static RBLIST *scratch_list = NULL;	/* should remain unchanged between invocations */
-  int completion_type, count;
-  const char *word;
+  static struct candidates candidates;  /* should remain unchanged between invocations */
+  static int next_candidate;
+  int completion_type;
   const char *completion;
   
   rl_completion_append_character = *extra_char_after_completion;
@@ -1569,84 +2157,36 @@ my_completion_function(char *prefix, int state)
 
   if (state == 0) {		/* first time we're called for this prefix ' */
 
-    if (scratch_list)
-      rbcloselist(scratch_list);
-    if (scratch_tree)
-      my_rbdestroy(scratch_tree);
-    scratch_tree = rbinit();	/* allocate scratch_tree. We will use this to get a sorted list of completions */
+    clear_candidates(&candidates);
     /* now find all possible completions: */
     completion_type = get_completion_type();
     DPRINTF2(DEBUG_ALL, "completion_type: %d, filter_pid: %d", completion_type, filter_pid);
-    if (completion_type & COMPLETE_FROM_LIST) {
-      for (word = rblookup(RB_LUGTEQ, prefix, completion_tree);	/* start with first word >= prefix */
-	   word && is_prefix(prefix, word);	/* as long as prefix is really prefix of word */
-	   word = rblookup(RB_LUGREAT, word, completion_tree)) {	/* find next word in list */
-	rbsearch(mysavestring(word), scratch_tree);	/* insert fresh copy of the word */
-	/* DPRINTF1(DEBUG_COMPLETION, "Adding %s to completion list ", word); */
-      }
+    update_cache(prefix, completion_type, want_next_page);
+    candidates = combine_cached_candidates();
+    offering_corrections = FALSE;
+    if (candidates.count == 0 && (completion_type & COMPLETE_FROM_LIST)) { /* did the user mean something else? */
+      find_corrections(prefix, (completion_type & COMPLETE_FROM_SECTION) ? completion_section : NULL, &candidates);
+      offering_corrections = candidates.count > 0;
     }
-    if (completion_type & COMPLETE_FILENAMES) {
-      change_working_directory();
-      DPRINTF1(DEBUG_COMPLETION, "Starting milking of rl_filename_completion_function, prefix = <%s> ", prefix);
-      for (count = 0;
-	   (word = copy_and_free_string_for_malloc_debug(rl_filename_completion_function(prefix, count)));
-	   count++) {	/* using rl_filename_completion_function means
-			   that completing filenames will always be case-sensitive */
-        DPRINTF1(DEBUG_COMPLETION, "Adding <%s> to completion list ", word);
-	rbsearch(word, scratch_tree);
-      }
-    }
-
-    scratch_list = rbopenlist(scratch_tree); /* OK, we now have our list with completions. We may have to filter it ... */
-    if (completion_type & FILTER_COMPLETIONS) {  
-      char *filter_food = NULL;
-      char *filtered, **filtered_components, **plist;
-      int count;
-
-      /* build the "filter food" (input for the filter) as a field list
-         <rl_line_buffer><prefix><completion1><completion2>....                    */
-      filter_food = append_field_and_free_old(filter_food, rl_line_buffer);
-      filter_food = append_field_and_free_old(filter_food, prefix); 
-      while((completion = rbreadlist(scratch_list))) 
-        filter_food = append_field_and_free_old(filter_food, completion);
-      
-      filtered = pass_through_filter(TAG_COMPLETION, filter_food);
-      free(filter_food);
-      rbcloselist(scratch_list);  
-      DPRINTF1(DEBUG_ALL, "Filtered: %s", mangle_string_for_debug_log(filtered, 40));
-
-      filtered_components = split_filter_message(filtered, &count);
-      free(filtered);
-      
-      if ( count <2 || strcmp(filtered_components[0], rl_line_buffer) ||  strcmp(filtered_components[1], prefix)) 
-	  myerror(FATAL|NOERRNO, "filter has illegally messed with completion message\n"); /* it should ONLY have changed the completion word list  */
-    
-
-      my_rbdestroy(scratch_tree); /* burn the old scratch tree (but leave the completion tree alone)  */
-      scratch_tree = rbinit();    /* now grow a new one */
-
-      for(plist = filtered_components + 2; *plist; plist++) {
-        if (!**plist)
-          continue; /* empty space at beginning or end of the word list results in an empty word, ignore those now */	
-        rbsearch(mysavestring(*plist), scratch_tree); /* add the filtered completions to the new scratch tree */
-        DPRINTF1(DEBUG_COMPLETION, "Adding %s to completion list ", *plist); 
-      }
-      free_splitlist(filtered_components);
-      scratch_list = rbopenlist(scratch_tree);      /* flatten the tree into a new list */	    
-      DPRINTF1(DEBUG_COMPLETION, "scratch list: %s", rbtree_to_string(scratch_tree, 6));
-    } /* if (completion_type & FILTER_COMPLETIONS) */
+    /* OK, we now have our list with completions. We may have to filter it ... */
+    if (completion_type & FILTER_COMPLETIONS) 
+      filter_candidates(prefix, &candidates);
+    next_candidate = 0;
   } /* if state ==  0 */
 
   /* we get here each time the user presses TAB to cycle through the list */
-  assert(scratch_tree != NULL);
-  assert(scratch_list != NULL);
-  if ((completion = rbreadlist(scratch_list))) {	/* read next possible completion */
+  if (next_candidate < candidates.count) {	/* read next possible completion */
     struct stat buf; 
-    char *copy_for_readline = malloc_foreign(strlen(completion)+1);
+    char *copy_for_readline;
+    int is_file;
+
+    completion = candidates.words[next_candidate++];
+    copy_for_readline = malloc_foreign(strlen(completion)+1);
     strcpy(copy_for_readline, completion);
-    
   
-    rl_filename_completion_desired = rl_filename_quoting_desired = (stat(completion, &buf) ? FALSE : TRUE); 
+    if ((is_file = filename_is_cached(completion)) < 0) /* most filenames will be in dircache.c's listings, no need to stat() them */
+      is_file = stat(completion, &buf) == 0;
+    rl_filename_completion_desired = rl_filename_quoting_desired = is_file; 
 
     DPRINTF1(DEBUG_COMPLETION, "Returning completion to readline: <%s>", copy_for_readline);
     return copy_for_readline;	/* we cannot just return the original as  readline will free it (and make rlwrap explode) */
@@ -1656,6 +2196,100 @@ my_completion_function(char *prefix, int state)
 }
 
 
+/* Used as rl_completion_display_matches_hook when we have only a page of a long list of completions: list them like readline
+   would (but without first asking "Display all ... possibilities?": a page is never that long) and tell the user how to get
+   the next page */
+static void
+list_page_of_matches(char **matches, int count, int max_length)
+{
+  rl_display_match_list(matches, count, max_length);
+  fprintf(rl_outstream, cache.more ? "-- press TAB again for more --" : "-- press TAB again to start over --");
+  rl_crlf();
+  rl_forced_update_display();
+  page_was_listed = TRUE;
+}
+
+
+/* readline stat()s a single filename match to decide whether to give it a trailing '/' (or else the usual space). If
+   dircache.c already knows whether it is a directory, we add the '/' ourselves, and let readline treat the match as
+   an ordinary word. We don't when readline would quote the match (or close an opening quote after it)                */
+static void
+mark_directory_match(char **matches, int end)
+{
+  const char *mark_directories = rl_variable_value("mark-directories");
+  int is_directory;
+  size_t length;
+
+  if (rl_completion_quote_character ||
+      (rl_completer_quote_characters && rl_filename_quote_characters && strpbrk(matches[0], rl_filename_quote_characters)))
+    return;
+  if ((is_directory = filename_is_directory(matches[0])) < 0) /* cf. dircache.c */
+    return;
+  rl_filename_completion_desired = FALSE;
+  if (!is_directory)
+    return;
+  rl_completion_suppress_append = TRUE;
+  length = strlen(matches[0]);
+  if ((!mark_directories || strcmp(mark_directories, "on") == 0) && rl_line_buffer[end] != '/') {
+    char *marked = malloc_foreign(length + 2);
+    strcpy(marked, matches[0]);
+    strcpy(marked + length, "/");
+    free_foreign(matches[0]);
+    matches[0] = marked;
+  }
+}
+
+
+/* Called by readline before it tries my_completion_function(). We build the match list ourselves, because fuzzy matches and
+   corrections don't necessarily share a common prefix with the word we're completing. readline would replace this word with the
+   (possibly shorter) longest common prefix of all matches, so, if necessary, we keep the word as it is.
+   Those matches are already sorted (best first), and we don't want readline to sort them alphabetically.
+   The same goes for a page of a long list: its common prefix may well be longer than that of the whole list, and even a page with
+   only one match should be listed rather than inserted. Pressing TAB again after a page has been listed (when readline
+   sets rl_completion_type to '?') shows the next page. When there are no matches, we tell readline not to try
+   my_completion_function() itself: that would only search (and consult the filter) a second time.
+   We also note where the word starts: get_completion_type() needs to know which word precedes it */
+char **
+my_attempted_completion_function(const char *text, int start, int end)
+{
+  char **matches;
+  int fuzzy, paged;
+
+  finish_loading_lists(); /* normally, this will already have happened when TAB was pressed */
+  completion_start = start;
+  fuzzy = (get_completion_type() & COMPLETE_FUZZY) && *text;
+  want_next_page = page_was_listed && rl_completion_type && strchr("?!@", rl_completion_type);
+  page_was_listed = FALSE;
+
+  matches = rl_completion_matches(text, (rl_compentry_func_t *) &my_completion_function);
+  paged = cache.more || cache.page > 0;
+  rl_completion_display_matches_hook = paged ? &list_page_of_matches : NULL;
+#ifdef HAVE_RL_SORT_COMPLETION_MATCHES
+  rl_sort_completion_matches = !(fuzzy || offering_corrections);
+#endif
+  if (!matches) {
+    rl_attempted_completion_over = TRUE;
+    return NULL;
+  }
+  if (!paged && !matches[1] && rl_filename_completion_desired)
+    mark_directory_match(matches, end);
+  if (paged && !matches[1]) { /* [match, NULL] becomes [text, match, NULL] */
+    char **longer = malloc_foreign(3 * sizeof(char *));
+    longer[1] = matches[0];
+    longer[2] = NULL;
+    free_foreign(matches);
+    matches = longer;
+  } else if (paged || ((fuzzy || offering_corrections) && matches[1] && !is_prefix(text, matches[0]))) {
+    free_foreign(matches[0]);
+  } else {
+    return matches;
+  }
+  matches[0] = malloc_foreign(strlen(text) + 1);
+  strcpy(matches[0], text);
+  return matches;
+}
+
+
 
 
 
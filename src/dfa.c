@@ -0,0 +1,754 @@
+/*  dfa.c: incremental regexp matching with a lazily built DFA
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License , or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; see the file COPYING.  If not, write to
+    the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+
+    You may contact the author by:
+       e-mail:  hanslub42@gmail.com
+*/
+
+
+/* With -O '!regexp', rlwrap has to decide, whenever output arrives, whether the text after the last newline (the
+   "raw prompt") matches the regexp. regexec() cannot be told to continue where it left off, so a command that
+   writes a long line in many small chunks would make rlwrap rescan the ever-growing line for every chunk.
+
+   Here we translate the regexp into an NFA (Thompson's construction) that, as it is fed the text, byte by byte,
+   looks for a match anywhere in it. The sets of NFA states that it can be in are the states of a DFA, which we
+   only construct when we need them: every DFA state remembers its successors, so a prompt that has been seen
+   before is matched with one table lookup per byte.
+
+   Only the (large) part of the POSIX extended regexp syntax that translates easily is understood:
+   literals, ., [...] (with ranges and [:classes:]), ^, $, (...), |, *, +, ? and {m,n}. For anything else (GNU
+   extensions like \w or \<, back-references, [=e=] ...) compile_dfa() returns NULL, and the caller should use
+   regexec() instead.
+
+   In a multi-byte locale (which we assume to use UTF-8) a multi-byte character counts as one "letter" for
+   ., [^...] and the operators that follow it, as it does for regexec()                                          */
+
+
+#include "rlwrap.h"
+
+#define MAX_DFA_STATES 512      /* when we need more, we throw all of them away and start again */
+#define MAX_NFA_STATES 10000    /* refuse regexps that would need more (e.g. "(x{100}){100}") */
+#define MAX_REPEAT 255          /* RE_DUP_MAX */
+
+enum nfa_type {
+  NFA_CHARSET,                  /* consume a byte from charsets[charset], go to out */
+  NFA_SPLIT,                    /* go to out and out1 (without consuming anything) */
+  NFA_EMPTY,                    /* go to out */
+  NFA_BOL,                      /* go to out, but only at the start of the text (^) */
+  NFA_EOL,                      /* go to out, but only at the end of the text ($) */
+  NFA_MATCH
+};
+
+struct nfa_state {
+  enum nfa_type type;
+  int out, out1;
+  int charset;
+};
+
+typedef unsigned char charset[32];      /* a bitmap of 256 bytes */
+
+struct dfa_state {
+  int *members, nmembers;       /* the NFA states that we can be in (only CHARSET, EOL and MATCH states, sorted) */
+  bool at_start;                /* ^ can still match */
+  bool matches;                 /* a match ends here */
+  bool matches_at_end;          /* a match ends here, if this is the end of the text */
+  int next[256];                /* successor for every byte (-1: not known yet) */
+};
+
+struct dfa {
+  struct nfa_state *nfa;
+  int nnfa, nfa_allocated, start;
+  charset *charsets;
+  int ncharsets, charsets_allocated;
+  struct dfa_state *states;
+  int nstates, initial, current;
+  int nforgotten;               /* how often we have thrown all DFA states away */
+  bool has_matched;
+  int *scratch, *stack;         /* scratch space for closure() */
+  unsigned int *visited, generation;
+};
+
+
+/* Fragments of the NFA that is being built have a start state and a list of "holes": out or out1 fields that
+   still have to be pointed at the next fragment. A hole is encoded as 2 * state + (0 for out, 1 for out1), and the
+   list is threaded through the holes themselves (-1 ends it)                                                    */
+
+struct fragment {
+  int start, holes;
+};
+
+struct parser {
+  struct dfa *dfa;
+  const char *p;
+  bool case_insensitive, utf8, failed;
+};
+
+
+static int *
+hole(struct dfa *dfa, int h)
+{
+  struct nfa_state *state = &dfa->nfa[h / 2];
+  return (h % 2) ? &state->out1 : &state->out;
+}
+
+
+static void
+patch(struct dfa *dfa, int holes, int target)
+{
+  while (holes >= 0) {
+    int *field = hole(dfa, holes);
+    holes = *field;
+    *field = target;
+  }
+}
+
+
+static int
+append_holes(struct dfa *dfa, int holes1, int holes2)
+{
+  int h = holes1, *field;
+
+  if (holes1 < 0)
+    return holes2;
+  while (*(field = hole(dfa, h)) >= 0)
+    h = *field;
+  *field = holes2;
+  return holes1;
+}
+
+
+static int
+new_nfa_state(struct parser *parser, enum nfa_type type, int out, int out1, int charset)
+{
+  struct dfa *dfa = parser->dfa;
+  struct nfa_state *state;
+
+  if (dfa->nnfa >= MAX_NFA_STATES)
+    parser->failed = TRUE; /* (but go on, so that the fragments stay consistent until we give up) */
+  if (dfa->nnfa >= dfa->nfa_allocated) {
+    dfa->nfa = myrealloc(dfa->nfa, dfa->nfa_allocated * sizeof(struct nfa_state), 2 * dfa->nfa_allocated * sizeof(struct nfa_state));
+    dfa->nfa_allocated *= 2;
+  }
+  state = &dfa->nfa[dfa->nnfa];
+  state->type = type;
+  state->out = out;
+  state->out1 = out1;
+  state->charset = charset;
+  return dfa->nnfa++;
+}
+
+
+/* a fragment consisting of a single state, with its out as the only hole */
+static struct fragment
+single_state(struct parser *parser, enum nfa_type type, int charset)
+{
+  struct fragment fragment;
+  fragment.start = new_nfa_state(parser, type, -1, -1, charset);
+  fragment.holes = 2 * fragment.start;
+  return fragment;
+}
+
+
+static int
+new_charset(struct parser *parser, const charset bytes)
+{
+  struct dfa *dfa = parser->dfa;
+  if (dfa->ncharsets >= dfa->charsets_allocated) {
+    dfa->charsets = myrealloc(dfa->charsets, dfa->charsets_allocated * sizeof(charset), 2 * dfa->charsets_allocated * sizeof(charset));
+    dfa->charsets_allocated *= 2;
+  }
+  memcpy(dfa->charsets[dfa->ncharsets], bytes, sizeof(charset));
+  return dfa->ncharsets++;
+}
+
+
+static inline void
+add_byte(charset bytes, int c)
+{
+  bytes[c / 8] |= 1 << (c % 8);
+}
+
+
+static inline bool
+has_byte(const charset bytes, int c)
+{
+  return bytes[c / 8] & (1 << (c % 8));
+}
+
+
+static void
+add_range(struct parser *parser, charset bytes, int from, int to)
+{
+  int c;
+  for (c = from; c <= to; c++) {
+    add_byte(bytes, c);
+    if (parser->case_insensitive && c < 128 && isalpha(c)) {
+      add_byte(bytes, tolower(c));
+      add_byte(bytes, toupper(c));
+    }
+  }
+}
+
+
+static struct fragment
+concatenate(struct parser *parser, struct fragment first, struct fragment second)
+{
+  patch(parser->dfa, first.holes, second.start);
+  first.holes = second.holes;
+  return first;
+}
+
+
+static struct fragment
+alternate(struct parser *parser, struct fragment first, struct fragment second)
+{
+  struct fragment result;
+  result.start = new_nfa_state(parser, NFA_SPLIT, first.start, second.start, 0);
+  result.holes = append_holes(parser->dfa, first.holes, second.holes);
+  return result;
+}
+
+
+/* A single character from ascii, or (if negated, in a multi-byte locale) any multi-byte character: a lead byte
+   followed by one or more continuation bytes */
+static struct fragment
+one_character(struct parser *parser, const charset ascii, bool and_any_multibyte)
+{
+  charset lead_bytes, continuation_bytes;
+  struct fragment character, lead, continuation;
+  int loop;
+
+  character = single_state(parser, NFA_CHARSET, new_charset(parser, ascii));
+  if (!and_any_multibyte)
+    return character;
+  memset(lead_bytes, 0, sizeof(charset));
+  memset(continuation_bytes, 0, sizeof(charset));
+  add_range(parser, lead_bytes, 0xC0, 0xFF);
+  add_range(parser, continuation_bytes, 0x80, 0xBF);
+  lead = single_state(parser, NFA_CHARSET, new_charset(parser, lead_bytes));
+  continuation = single_state(parser, NFA_CHARSET, new_charset(parser, continuation_bytes));
+  loop = new_nfa_state(parser, NFA_SPLIT, continuation.start, -1, 0);
+  patch(parser->dfa, lead.holes, continuation.start);
+  patch(parser->dfa, continuation.holes, loop);
+  lead.holes = 2 * loop + 1;
+  return alternate(parser, character, lead);
+}
+
+
+static struct fragment
+empty_fragment(struct parser *parser)
+{
+  return single_state(parser, NFA_EMPTY, 0);
+}
+
+
+/* is c in the class [:name:]? (-1 if there is no such class) */
+static int
+in_class(const char *name, int length, int c)
+{
+  static const struct { const char *name; int (*is)(int); } classes[] = {
+    {"alpha", isalpha}, {"digit", isdigit}, {"alnum", isalnum}, {"upper", isupper}, {"lower", islower},
+    {"space", isspace}, {"blank", isblank}, {"punct", ispunct}, {"print", isprint}, {"graph", isgraph},
+    {"cntrl", iscntrl}, {"xdigit", isxdigit}, {NULL, NULL}
+  };
+  int i;
+  for (i = 0; classes[i].name; i++)
+    if ((int) strlen(classes[i].name) == length && strncmp(classes[i].name, name, length) == 0)
+      return classes[i].is(c) != 0;
+  return -1;
+}
+
+
+/* [...]: p points just after the [ */
+static struct fragment
+bracket_expression(struct parser *parser)
+{
+  charset bytes;
+  bool negated = FALSE;
+  const char *p = parser->p;
+  int c, limit = parser->utf8 ? 128 : 256;
+
+  memset(bytes, 0, sizeof(charset));
+  if (*p == '^') {
+    negated = TRUE;
+    p++;
+  }
+  if (*p == ']') {
+    add_range(parser, bytes, ']', ']');
+    p++;
+  }
+  while (*p != ']') {
+    unsigned char from = *p, to;
+    if (!*p || (p[0] == '[' && (p[1] == '=' || p[1] == '.'))) {
+      parser->failed = TRUE;  /* unterminated, or collating symbols and equivalence classes */
+      return empty_fragment(parser);
+    }
+    if (p[0] == '[' && p[1] == ':') {
+      const char *name = p + 2, *end = strstr(name, ":]");
+      if (!end || in_class(name, end - name, 'a') < 0) {
+        parser->failed = TRUE;
+        return empty_fragment(parser);
+      }
+      for (c = 1; c < limit; c++)
+        if (in_class(name, end - name, c))
+          add_range(parser, bytes, c, c);
+      p = end + 2;
+      continue;
+    }
+    to = from;
+    if (p[1] == '-' && p[2] && p[2] != ']') {
+      to = p[2];
+      if (p[2] == '[')
+        parser->failed = TRUE;
+      p += 2;
+    }
+    if (from >= limit || to >= limit || from > to) /* multi-byte characters, or an invalid range */
+      parser->failed = TRUE;
+    add_range(parser, bytes, from, to);
+    p++;
+  }
+  parser->p = p + 1;
+  if (negated) {
+    for (c = 0; c < 32; c++)
+      bytes[c] = ~bytes[c];
+    for (c = limit; c < 256; c++)
+      bytes[c / 8] &= ~(1 << (c % 8));
+  }
+  return one_character(parser, bytes, negated && parser->utf8);
+}
+
+
+static struct fragment alternatives(struct parser *parser);
+
+
+static struct fragment
+atom(struct parser *parser)
+{
+  struct fragment fragment;
+  charset bytes;
+  unsigned char c = *parser->p++;
+
+  memset(bytes, 0, sizeof(charset));
+  switch (c) {
+  case '(':
+    fragment = alternatives(parser);
+    if (*parser->p++ != ')')
+      parser->failed = TRUE;
+    return fragment;
+  case '.':
+    add_range(parser, bytes, 1, parser->utf8 ? 127 : 255);
+    return one_character(parser, bytes, parser->utf8);
+  case '[':
+    return bracket_expression(parser);
+  case '^':
+    return single_state(parser, NFA_BOL, 0);
+  case '$':
+    return single_state(parser, NFA_EOL, 0);
+  case '\\':
+    c = *parser->p++;
+    if (!c || isalnum(c) || strchr("<>`'", c)) /* back-references and GNU extensions */
+      parser->failed = TRUE;
+    break;
+  case '*': case '+': case '?': case '{': case ')': case '\0':
+    parser->failed = TRUE;
+    return empty_fragment(parser);
+  }
+  if (c >= 0x80 && parser->utf8) { /* a multi-byte character is one atom */
+    if (parser->case_insensitive)
+      parser->failed = TRUE;
+    add_range(parser, bytes, c, c);
+    fragment = single_state(parser, NFA_CHARSET, new_charset(parser, bytes));
+    while ((*parser->p & 0xC0) == 0x80) {
+      memset(bytes, 0, sizeof(charset));
+      c = *parser->p++;
+      add_range(parser, bytes, c, c);
+      fragment = concatenate(parser, fragment, single_state(parser, NFA_CHARSET, new_charset(parser, bytes)));
+    }
+    return fragment;
+  }
+  add_range(parser, bytes, c, c);
+  return single_state(parser, NFA_CHARSET, new_charset(parser, bytes));
+}
+
+
+static struct fragment
+star(struct parser *parser, struct fragment fragment)
+{
+  int split = new_nfa_state(parser, NFA_SPLIT, fragment.start, -1, 0);
+  patch(parser->dfa, fragment.holes, split);
+  fragment.start = split;
+  fragment.holes = 2 * split + 1;
+  return fragment;
+}
+
+
+static struct fragment
+plus(struct parser *parser, struct fragment fragment)
+{
+  int split = new_nfa_state(parser, NFA_SPLIT, fragment.start, -1, 0);
+  patch(parser->dfa, fragment.holes, split);
+  fragment.holes = 2 * split + 1;
+  return fragment;
+}
+
+
+static struct fragment
+optional(struct parser *parser, struct fragment fragment)
+{
+  int split = new_nfa_state(parser, NFA_SPLIT, fragment.start, -1, 0);
+  fragment.start = split;
+  fragment.holes = append_holes(parser->dfa, fragment.holes, 2 * split + 1);
+  return fragment;
+}
+
+
+/* atom{at_least,at_most} (at_most < 0: no maximum). Every copy of the atom is made by parsing it again */
+static struct fragment
+repeat(struct parser *parser, const char *atom_start, int at_least, int at_most)
+{
+  struct fragment result = empty_fragment(parser), copy;
+  const char *after_atom = parser->p;
+  int i, ncopies = at_most < 0 ? max(at_least, 1) : at_most;
+
+  for (i = 0; i < ncopies && !parser->failed; i++) {
+    parser->p = atom_start;
+    copy = atom(parser);
+    if (at_most < 0 && i == ncopies - 1)
+      copy = at_least == 0 ? star(parser, copy) : plus(parser, copy);
+    else if (i >= at_least)
+      copy = optional(parser, copy);
+    result = concatenate(parser, result, copy);
+  }
+  parser->p = after_atom;
+  return result;
+}
+
+
+/* does the NFA have ^ or $ among states from ... to - 1 ? */
+static bool
+has_anchors(struct dfa *dfa, int from, int to)
+{
+  int i;
+  for (i = from; i < to; i++)
+    if (dfa->nfa[i].type == NFA_BOL || dfa->nfa[i].type == NFA_EOL)
+      return TRUE;
+  return FALSE;
+}
+
+
+static struct fragment
+piece(struct parser *parser)
+{
+  const char *atom_start = parser->p;
+  int first_state = parser->dfa->nnfa;
+  struct fragment fragment = atom(parser);
+  bool repeated = FALSE;
+
+  while (!parser->failed) {
+    if (strchr("*+?{", *parser->p) && *parser->p && has_anchors(parser->dfa, first_state, parser->dfa->nnfa)) {
+      parser->failed = TRUE; /* e.g. (a$)* - glibc's regexec() has its own ideas about those */
+      break;
+    }
+    switch (*parser->p) {
+    case '*':
+      fragment = star(parser, fragment);
+      break;
+    case '+':
+      fragment = plus(parser, fragment);
+      break;
+    case '?':
+      fragment = optional(parser, fragment);
+      break;
+    case '{': {
+      char *end;
+      long at_least, at_most;
+      if (repeated || !isdigit((unsigned char) parser->p[1])) { /* e.g. x*{2} */
+        parser->failed = TRUE;
+        break;
+      }
+      at_least = at_most = strtol(parser->p + 1, &end, 10);
+      if (*end == ',')
+        at_most = isdigit((unsigned char) end[1]) ? strtol(end + 1, &end, 10) : (end++, -1);
+      if (*end != '}' || at_least > MAX_REPEAT || at_most > MAX_REPEAT || (at_most >= 0 && at_most < at_least)) {
+        parser->failed = TRUE;
+        break;
+      }
+      parser->p = end;
+      fragment = repeat(parser, atom_start, at_least, at_most);
+      break;
+    }
+    default:
+      return fragment;
+    }
+    parser->p++;
+    repeated = TRUE;
+  }
+  return fragment;
+}
+
+
+static struct fragment
+branch(struct parser *parser)
+{
+  struct fragment fragment = empty_fragment(parser);
+  while (*parser->p && *parser->p != '|' && *parser->p != ')' && !parser->failed)
+    fragment = concatenate(parser, fragment, piece(parser));
+  return fragment;
+}
+
+
+static struct fragment
+alternatives(struct parser *parser)
+{
+  struct fragment fragment = branch(parser);
+  while (*parser->p == '|' && !parser->failed) {
+    parser->p++;
+    fragment = alternate(parser, fragment, branch(parser));
+  }
+  return fragment;
+}
+
+
+/* add the NFA states that can be reached from the seeds without consuming anything to members (which then has
+   *nmembers elements). Returns TRUE if MATCH can be reached */
+static bool
+closure(struct dfa *dfa, const int *seeds, int nseeds, bool at_start, bool at_end, int *members, int *nmembers)
+{
+  int sp = 0, i;
+  bool match = FALSE;
+
+  if (++dfa->generation == 0) {
+    memset(dfa->visited, 0, dfa->nnfa * sizeof(unsigned int));
+    dfa->generation = 1;
+  }
+  for (i = 0; i < nseeds; i++)
+    dfa->stack[sp++] = seeds[i];
+  while (sp > 0) {
+    int s = dfa->stack[--sp];
+    struct nfa_state *state = &dfa->nfa[s];
+    if (dfa->visited[s] == dfa->generation)
+      continue;
+    dfa->visited[s] = dfa->generation;
+    switch (state->type) {
+    case NFA_SPLIT:
+      dfa->stack[sp++] = state->out1;
+      /* fall through */
+    case NFA_EMPTY:
+      dfa->stack[sp++] = state->out;
+      break;
+    case NFA_BOL:
+      if (at_start)
+        dfa->stack[sp++] = state->out;
+      break;
+    case NFA_EOL:
+      if (at_end) {
+        dfa->stack[sp++] = state->out;
+        break;
+      }
+      members[(*nmembers)++] = s;
+      break;
+    case NFA_MATCH:
+      match = TRUE;
+      /* fall through */
+    case NFA_CHARSET:
+      members[(*nmembers)++] = s;
+      break;
+    }
+  }
+  return match;
+}
+
+
+static int
+compare_ints(const void *a, const void *b)
+{
+  return *(const int *) a - *(const int *) b;
+}
+
+
+static void
+forget_dfa_states(struct dfa *dfa)
+{
+  int i;
+  for (i = 0; i < dfa->nstates; i++)
+    free(dfa->states[i].members);
+  dfa->nstates = 0;
+  dfa->initial = -1;
+  dfa->nforgotten++;
+}
+
+
+/* the DFA state for the NFA states in members (which will be sorted) */
+static int
+dfa_state(struct dfa *dfa, int *members, int nmembers, bool at_start)
+{
+  struct dfa_state *state;
+  int i, *eol_outs, neol_outs = 0, nreachable = 0;
+
+  qsort(members, nmembers, sizeof(int), compare_ints);
+  for (i = 0; i < dfa->nstates; i++) {
+    state = &dfa->states[i];
+    if (state->at_start == at_start && state->nmembers == nmembers && memcmp(state->members, members, nmembers * sizeof(int)) == 0)
+      return i;
+  }
+  if (dfa->nstates >= MAX_DFA_STATES)
+    forget_dfa_states(dfa);
+  state = &dfa->states[dfa->nstates];
+  state->members = mymalloc(max(nmembers, 1) * sizeof(int));
+  memcpy(state->members, members, nmembers * sizeof(int));
+  state->nmembers = nmembers;
+  state->at_start = at_start;
+  state->matches = FALSE;
+  eol_outs = mymalloc(max(nmembers, 1) * sizeof(int));
+  for (i = 0; i < nmembers; i++) {
+    struct nfa_state *member = &dfa->nfa[state->members[i]];
+    if (member->type == NFA_MATCH)
+      state->matches = TRUE;
+    else if (member->type == NFA_EOL)
+      eol_outs[neol_outs++] = member->out;
+  }
+  state->matches_at_end = state->matches || closure(dfa, eol_outs, neol_outs, at_start, TRUE, dfa->scratch, &nreachable);
+  free(eol_outs);
+  for (i = 0; i < 256; i++)
+    state->next[i] = -1;
+  return dfa->nstates++;
+}
+
+
+/* the DFA state after consuming c in state from */
+static int
+successor(struct dfa *dfa, int from, unsigned char c)
+{
+  struct dfa_state *state = &dfa->states[from];
+  int i, nseeds = 0, nmembers = 0, next, nforgotten = dfa->nforgotten, *seeds = mymalloc((state->nmembers + 1) * sizeof(int));
+
+  for (i = 0; i < state->nmembers; i++) {
+    struct nfa_state *member = &dfa->nfa[state->members[i]];
+    if (member->type == NFA_CHARSET && has_byte(dfa->charsets[member->charset], c))
+      seeds[nseeds++] = member->out;
+  }
+  seeds[nseeds++] = dfa->start; /* a match may start anywhere */
+  closure(dfa, seeds, nseeds, FALSE, FALSE, dfa->scratch, &nmembers);
+  free(seeds);
+  next = dfa_state(dfa, dfa->scratch, nmembers, FALSE);
+  if (dfa->nforgotten == nforgotten) /* from hasn't been thrown away by dfa_state() */
+    dfa->states[from].next[c] = next;
+  return next;
+}
+
+
+void
+dfa_restart(struct dfa *dfa)
+{
+  int nmembers = 0;
+
+  if (dfa->initial < 0) {
+    closure(dfa, &dfa->start, 1, TRUE, FALSE, dfa->scratch, &nmembers);
+    dfa->initial = dfa_state(dfa, dfa->scratch, nmembers, TRUE);
+  }
+  dfa->current = dfa->initial;
+  dfa->has_matched = dfa->states[dfa->current].matches;
+}
+
+
+/* feed the next length bytes of the text to dfa */
+void
+dfa_feed(struct dfa *dfa, const char *text, size_t length)
+{
+  size_t i;
+
+  for (i = 0; i < length && !dfa->has_matched; i++) {  /* once we have a match, we don't need to look any further */
+    unsigned char c = text[i];
+    int next = dfa->states[dfa->current].next[c];
+    dfa->current = next >= 0 ? next : successor(dfa, dfa->current, c);
+    dfa->has_matched = dfa->states[dfa->current].matches;
+  }
+}
+
+
+/* does the text fed since the last dfa_restart() match? */
+bool
+dfa_has_matched(struct dfa *dfa)
+{
+  return dfa->has_matched || dfa->states[dfa->current].matches_at_end;
+}
+
+
+/* a DFA for regexp (or NULL if regexp uses anything that we don't understand), ready to be fed */
+struct dfa *
+compile_dfa(const char *regexp, bool case_insensitive)
+{
+  struct dfa *dfa = mymalloc(sizeof(struct dfa));
+  struct parser parser;
+  struct fragment fragment;
+
+  memset(dfa, 0, sizeof(struct dfa));
+  dfa->nfa_allocated = dfa->charsets_allocated = 16;
+  dfa->nfa = mymalloc(dfa->nfa_allocated * sizeof(struct nfa_state));
+  dfa->charsets = mymalloc(dfa->charsets_allocated * sizeof(charset));
+  parser.dfa = dfa;
+  parser.p = regexp;
+  parser.case_insensitive = case_insensitive;
+  parser.utf8 = MB_CUR_MAX > 1;
+  parser.failed = FALSE;
+
+  fragment = alternatives(&parser);
+  if (*parser.p) /* an unmatched ')' */
+    parser.failed = TRUE;
+  patch(dfa, fragment.holes, new_nfa_state(&parser, NFA_MATCH, -1, -1, 0));
+  dfa->start = fragment.start;
+  DPRINTF3(DEBUG_READLINE, "regexp %s: %d NFA states%s", M(regexp), dfa->nnfa, parser.failed ? " (but we cannot handle it)" : "");
+  if (parser.failed) {
+    free(dfa->nfa);
+    free(dfa->charsets);
+    free(dfa);
+    return NULL;
+  }
+  dfa->states = mymalloc(MAX_DFA_STATES * sizeof(struct dfa_state));
+  dfa->scratch = mymalloc(dfa->nnfa * sizeof(int));
+  dfa->stack = mymalloc((3 * dfa->nnfa + 2) * sizeof(int)); /* all seeds, and then at most two pushes per state */
+  dfa->visited = mymalloc(dfa->nnfa * sizeof(unsigned int));
+  memset(dfa->visited, 0, dfa->nnfa * sizeof(unsigned int));
+  dfa->initial = -1;
+  dfa_restart(dfa);
+  return dfa;
+}
+
+
+
+#ifdef UNIT_TEST
+
+/* compare with regexec(): make clean; make CFLAGS='-g -DUNIT_TEST=test_dfa'; ./rlwrap <regexp> <text> <text> ... */
+TESTFUNC(test_dfa, argc, argv, stage) {
+  struct dfa *dfa;
+  char **text;
+
+  ONLY_AT_STAGE(TEST_AFTER_OPTION_PARSING);
+  if (argc < 2)
+    myerror(FATAL|NOERRNO, "usage: make CFLAGS='-g -DUNIT_TEST=test_dfa'; ./rlwrap <regexp> <text> <text> ...");
+  if (!(dfa = compile_dfa(argv[0], FALSE)))
+    myerror(FATAL|NOERRNO, "cannot make a DFA for %s", argv[0]);
+  for (text = argv + 1; *text; text++) {
+    size_t i;
+    dfa_restart(dfa);
+    for (i = 0; (*text)[i]; i++) /* feed it one byte at a time */
+      dfa_feed(dfa, *text + i, 1);
+    printf("%-20s dfa: %d  regexec: %d\n", *text, dfa_has_matched(dfa), match_regexp(*text, argv[0], FALSE));
+  }
+  exit(0);
+}
+
+#endif /* UNIT_TEST */
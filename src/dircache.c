@@ -0,0 +1,478 @@
+/*  dircache.c: cached directory listings for filename completion
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License , or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; see the file COPYING.  If not, write to
+    the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+
+    You may contact the author by:
+       e-mail:  hanslub42@gmail.com
+*/
+
+
+/* readline's rl_filename_completion_function() reads the whole directory every time it is called, and
+   rlwrap used to stat() every candidate it got back. In big directories (especially on NFS) that made
+   every TAB noticeably slow. Here we keep (sorted) listings of the most recently used directories, keyed
+   by their absolute path. After the first TAB, completing in such a directory only touches memory.
+
+   A listing is read again only when the directory has changed. Where we have inotify(7) we get told so,
+   otherwise (or if we cannot watch the directory, or if it is on a network file system, where inotify won't
+   tell us about changes made by other clients) we compare the directory's mtime with the one we saw when we read it (which costs a stat(), but still no readdir()). Where mtimes have only a resolution of
+   one second, a file created in the same second as the listing was read doesn't change the mtime, so we
+   don't trust such a listing (i.e. we read it again, until its mtime is in the past)
+
+   We also remember which names are directories (as told by readdir(), or else by a lstat() the first time
+   we need to know), so that readline needn't stat() a directory to know that it should get a trailing '/'  */
+
+
+#include "rlwrap.h"
+
+#define MAX_CACHED_DIRECTORIES 32
+#define NO_WATCH (-1)
+
+enum { TYPE_UNKNOWN, TYPE_DIRECTORY, TYPE_SYMLINK, TYPE_OTHER };
+
+struct directory_entry {
+  char *name;
+  int type;            /* TYPE_UNKNOWN until we know better */
+};
+
+struct directory_listing {
+  char *path;          /* absolute path, NULL if this slot is unused */
+  struct directory_entry *entries; /* sorted by name (using strcmp()) */
+  int nnames;
+  int watch;           /* inotify watch descriptor, or NO_WATCH */
+  bool remote;         /* on a network file system (where watching doesn't see every change) */
+  struct timespec mtime; /* mtime of the directory when it was read (used if NO_WATCH or remote) ... */
+  bool racy;           /* ... which was no earlier than the second in which we read it */
+  bool stale;          /* set when inotify tells us the directory has changed */
+  unsigned long version; /* different every time a listing is (re-)read */
+  unsigned long last_used;
+};
+
+static struct directory_listing listings[MAX_CACHED_DIRECTORIES];
+static unsigned long uses = 0, reads = 0;
+
+#ifdef HAVE_SYS_INOTIFY_H
+static int inotify_fd = -1;
+#define WATCHED_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+#endif
+
+
+static int
+compare_entries(const void *a, const void *b)
+{
+  return strcmp(((const struct directory_entry *) a)->name, ((const struct directory_entry *) b)->name);
+}
+
+
+static void
+forget_names(struct directory_listing *listing)
+{
+  int i;
+  for (i = 0; i < listing->nnames; i++)
+    free(listing->entries[i].name);
+  if (listing->entries)
+    free(listing->entries);
+  listing->entries = NULL;
+  listing->nnames = 0;
+}
+
+
+static int
+type_from_dirent(const struct dirent *entry)
+{
+#ifdef HAVE_STRUCT_DIRENT_D_TYPE
+  switch (entry->d_type) {
+  case DT_UNKNOWN: return TYPE_UNKNOWN;  /* some file systems don't tell */
+  case DT_DIR:     return TYPE_DIRECTORY;
+  case DT_LNK:     return TYPE_SYMLINK;
+  default:         return TYPE_OTHER;
+  }
+#else
+  MAYBE_UNUSED(entry);
+  return TYPE_UNKNOWN;
+#endif
+}
+
+
+static void
+forget_listing(struct directory_listing *listing)
+{
+  DPRINTF1(DEBUG_COMPLETION, "forgetting cached listing of %s", listing->path);
+  forget_names(listing);
+#ifdef HAVE_SYS_INOTIFY_H
+  if (listing->watch != NO_WATCH)
+    inotify_rm_watch(inotify_fd, listing->watch);
+#endif
+  free(listing->path);
+  listing->path = NULL;
+}
+
+
+/* read all pending inotify events (without blocking), and mark the listings they refer to as stale */
+static void
+process_inotify_events(void)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+  char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  const struct inotify_event *event;
+  ssize_t nread;
+  int i;
+
+  if (inotify_fd < 0)
+    return;
+  while ((nread = read(inotify_fd, buffer, sizeof(buffer))) > 0) {
+    for (event = (const struct inotify_event *) buffer;
+         (const char *) event < buffer + nread;
+         event = (const struct inotify_event *) ((const char *) event + sizeof(struct inotify_event) + event->len)) {
+      for (i = 0; i < MAX_CACHED_DIRECTORIES; i++) {
+        struct directory_listing *listing = &listings[i];
+        if (listing->path && ((event->mask & IN_Q_OVERFLOW) || listing->watch == event->wd)) {
+          listing->stale = TRUE;
+          if (event->mask & IN_IGNORED) /* watch has been removed, e.g. because the directory has gone */
+            listing->watch = NO_WATCH;
+        }
+      }
+    }
+  }
+#endif
+}
+
+
+static struct timespec
+mtime_of(const struct stat *buf)
+{
+  struct timespec mtime;
+
+  mtime.tv_sec = buf->st_mtime;
+#if defined(HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC)
+  mtime.tv_nsec = buf->st_mtim.tv_nsec;
+#elif defined(HAVE_STRUCT_STAT_ST_MTIMESPEC_TV_NSEC)
+  mtime.tv_nsec = buf->st_mtimespec.tv_nsec;
+#else
+  mtime.tv_nsec = 0;
+#endif
+  return mtime;
+}
+
+
+/* remember the directory's mtime, just before (re-)reading it */
+static void
+note_mtime(struct directory_listing *listing)
+{
+  time_t now = time(NULL);
+  struct stat buf;
+
+  if (stat(listing->path, &buf) == 0) {
+    listing->mtime = mtime_of(&buf);
+    listing->racy = listing->mtime.tv_sec >= now;
+  } else {
+    listing->mtime.tv_sec = listing->mtime.tv_nsec = 0;
+    listing->racy = TRUE;
+  }
+}
+
+
+#ifdef HAVE_SYS_INOTIFY_H
+/* inotify only sees changes made through the local kernel, not those made by other NFS (or SMB, ...) clients */
+static bool
+is_on_network_file_system(const char *path)
+{
+  static const unsigned long network_file_systems[] = { /* f_type magic numbers, cf. statfs(2) */
+    0x6969 /* NFS */, 0x517B /* SMB */, 0xFF534D42 /* CIFS */, 0xFE534D42 /* SMB2 */, 0x73757245 /* CODA */,
+    0x5346414F /* AFS */, 0x01021997 /* 9P */, 0x00C36400 /* CEPH */, 0x65735546 /* FUSE (sshfs, ...) */
+  };
+  struct statfs buf;
+  unsigned int i;
+
+  if (statfs(path, &buf))
+    return TRUE; /* we cannot tell, so better be careful */
+  for (i = 0; i < sizeof(network_file_systems) / sizeof(network_file_systems[0]); i++)
+    if ((unsigned long) buf.f_type == network_file_systems[i])
+      return TRUE;
+  return FALSE;
+}
+#endif
+
+
+static void
+start_watching(struct directory_listing *listing)
+{
+  listing->watch = NO_WATCH;
+  listing->remote = FALSE;
+#ifdef HAVE_SYS_INOTIFY_H
+  if (inotify_fd < 0)
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (inotify_fd >= 0)
+    listing->watch = inotify_add_watch(inotify_fd, listing->path, WATCHED_EVENTS | IN_ONLYDIR);
+  if (listing->watch < 0) {
+    DPRINTF2(DEBUG_COMPLETION, "cannot watch %s: %s", listing->path, strerror(errno));
+    listing->watch = NO_WATCH;
+  } else {
+    listing->remote = is_on_network_file_system(listing->path);
+  }
+#endif
+}
+
+
+/* (re-)read the directory. The watch is started before reading, so that no change will go unnoticed */
+static bool
+read_listing(struct directory_listing *listing)
+{
+  DIR *dir;
+  struct dirent *entry;
+  int allocated = 0;
+
+  forget_names(listing);
+  note_mtime(listing);
+  if (!(dir = opendir(listing->path)))
+    return FALSE;
+  while ((entry = readdir(dir))) {
+    if (listing->nnames + 1 >= allocated) {
+      int new_allocated = max(2 * allocated, 64);
+      listing->entries = myrealloc(listing->entries, allocated * sizeof(struct directory_entry), new_allocated * sizeof(struct directory_entry));
+      allocated = new_allocated;
+    }
+    listing->entries[listing->nnames].name = mysavestring(entry->d_name);
+    listing->entries[listing->nnames++].type = type_from_dirent(entry);
+  }
+  closedir(dir);
+  if (listing->nnames > 1)
+    qsort(listing->entries, listing->nnames, sizeof(struct directory_entry), &compare_entries);
+  listing->stale = FALSE;
+  listing->version = ++reads;
+  DPRINTF3(DEBUG_COMPLETION, "read %s: %d names%s", listing->path, listing->nnames,
+           listing->watch == NO_WATCH ? " (unwatched)" : listing->remote ? " (watched, but on a network file system)" : "");
+  return TRUE;
+}
+
+
+static bool
+is_up_to_date(const struct directory_listing *listing)
+{
+  struct stat buf;
+  struct timespec mtime;
+
+  if (listing->stale)
+    return FALSE;
+  if (listing->watch != NO_WATCH && !listing->remote)
+    return TRUE; /* inotify would have told us */
+  if (listing->racy || stat(listing->path, &buf) != 0)
+    return FALSE;
+  mtime = mtime_of(&buf);
+  return mtime.tv_sec == listing->mtime.tv_sec && mtime.tv_nsec == listing->mtime.tv_nsec;
+}
+
+
+/* absolute version of directory (which is "" for the current directory) */
+static char *
+absolute_path(const char *directory)
+{
+  char cwd[MAXPATHLEN+1];
+
+  if (*directory == '/')
+    return mysavestring(directory);
+  if (!getcwd(cwd, sizeof(cwd)))
+    return NULL;
+  return add3strings(cwd, "/", directory);
+}
+
+
+/* find the cached listing for path (which may be stale), or NULL if there is none */
+static struct directory_listing *
+find_listing(const char *path)
+{
+  int i;
+
+  process_inotify_events();
+  for (i = 0; i < MAX_CACHED_DIRECTORIES; i++) {
+    struct directory_listing *listing = &listings[i];
+    if (listing->path && strcmp(listing->path, path) == 0) {
+      listing->last_used = ++uses;
+      return listing;
+    }
+  }
+  return NULL;
+}
+
+
+/* return an up-to-date listing for path, reading it if necessary (NULL if it cannot be read) */
+static struct directory_listing *
+get_listing(const char *path)
+{
+  struct directory_listing *listing = find_listing(path);
+  int i;
+
+  if (listing) {
+    if (is_up_to_date(listing))
+      return listing;
+    if (listing->watch == NO_WATCH)
+      start_watching(listing); /* maybe the directory has re-appeared and we can watch it again */
+  } else {
+    for (listing = &listings[0], i = 1; i < MAX_CACHED_DIRECTORIES && listing->path; i++) /* find a free, or else the least recently used, slot */
+      if (!listings[i].path || listings[i].last_used < listing->last_used)
+        listing = &listings[i];
+    if (listing->path)
+      forget_listing(listing);
+    listing->path = mysavestring(path);
+    listing->last_used = ++uses;
+    start_watching(listing);
+  }
+  if (!read_listing(listing)) {
+    forget_listing(listing);
+    return NULL;
+  }
+  return listing;
+}
+
+
+/* first name in listing that is >= prefix */
+static int
+first_name_with_prefix(const struct directory_listing *listing, const char *prefix)
+{
+  int low = 0, high = listing->nnames;
+  while (low < high) {
+    int middle = low + (high - low) / 2;
+    if (strcmp(listing->entries[middle].name, prefix) < 0)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  return low;
+}
+
+
+/* The same completions that (repeatedly calling) rl_filename_completion_function(prefix, ...) would give, as a
+   NULL-terminated list of malloc()ed strings. Returns NULL if prefix is something (like ~user/...) that
+   we'd better leave to readline                                                                               */
+char **
+cached_filename_completions(const char *prefix)
+{
+  const char *slash = strrchr(prefix, '/');
+  const char *basename = slash ? slash + 1 : prefix;
+  char *directory, *path, **result;
+  struct directory_listing *listing;
+  size_t baselength = strlen(basename);
+  int match_hidden_files, i, count = 0;
+
+  if (*prefix == '~')
+    return NULL;
+  directory = mysavestring(prefix);
+  directory[basename - prefix] = '\0';       /* "dir/sub/" or "" */
+  path = absolute_path(directory);
+  listing = path ? get_listing(path) : NULL;
+  result = mymalloc(((listing ? listing->nnames : 0) + 1) * sizeof(char *));
+  if (listing) {
+    const char *setting = rl_variable_value("match-hidden-files");
+    match_hidden_files = !setting || strcmp(setting, "on") == 0;
+    for (i = first_name_with_prefix(listing, basename); i < listing->nnames; i++) {
+      const char *name = listing->entries[i].name;
+      if (strncmp(name, basename, baselength))
+        break;
+      if (baselength == 0 && *name == '.' && (!match_hidden_files || strcmp(name, ".") == 0 || strcmp(name, "..") == 0))
+        continue; /* readline only offers "." and ".." when asked for (and hidden files when match-hidden-files is set) */
+      result[count++] = add2strings(directory, name);
+    }
+  }
+  result[count] = NULL;
+  free(directory);
+  if (path)
+    free(path);
+  return result;
+}
+
+
+/* Look filename up in the cached listings. Returns its entry (NULL if it doesn't exist), and sets *plisting to the
+   listing it should be in, or to NULL if the listings cannot tell                                              */
+static struct directory_entry *
+lookup_filename(const char *filename, struct directory_listing **plisting)
+{
+  const char *slash = strrchr(filename, '/');
+  const char *basename = slash ? slash + 1 : filename;
+  char *directory, *path;
+  struct directory_listing *listing = NULL;
+  struct directory_entry *entry = NULL;
+  int i;
+
+  *plisting = NULL;
+  if (*filename == '~' || !*basename)
+    return NULL;
+  directory = mysavestring(filename);
+  directory[basename - filename] = '\0';
+  if ((path = absolute_path(directory)))
+    listing = find_listing(path);
+  if (listing && !listing->stale && listing->watch != NO_WATCH) { /* don't bother stat()ing unwatched directories: we might as well stat() filename */
+    *plisting = listing;
+    i = first_name_with_prefix(listing, basename);
+    if (i < listing->nnames && strcmp(listing->entries[i].name, basename) == 0)
+      entry = &listing->entries[i];
+  }
+  free(directory);
+  if (path)
+    free(path);
+  return entry;
+}
+
+
+/* Whether filename exists, as far as the cached listings know: TRUE or FALSE, or -1 if they cannot tell */
+int
+filename_is_cached(const char *filename)
+{
+  struct directory_listing *listing;
+  struct directory_entry *entry = lookup_filename(filename, &listing);
+
+  return listing ? entry != NULL : -1;
+}
+
+
+/* Whether filename is a directory: TRUE or FALSE, or -1 if the cached listings cannot tell. Symlinks are left to readline
+   (which, depending on mark-symlinked-directories, may or may not give a symlink to a directory a trailing '/')          */
+int
+filename_is_directory(const char *filename)
+{
+  struct directory_listing *listing;
+  struct directory_entry *entry = lookup_filename(filename, &listing);
+
+  if (!entry)
+    return -1;
+  if (entry->type == TYPE_UNKNOWN) { /* readdir() didn't tell, find out (only once) */
+    struct stat buf;
+    char *path = add2strings(listing->path, entry->name); /* listing->path ends in '/' */
+    if (lstat(path, &buf) == 0)
+      entry->type = S_ISDIR(buf.st_mode) ? TYPE_DIRECTORY : S_ISLNK(buf.st_mode) ? TYPE_SYMLINK : TYPE_OTHER;
+    free(path);
+  }
+  return entry->type == TYPE_DIRECTORY ? TRUE : entry->type == TYPE_OTHER ? FALSE : -1;
+}
+
+
+/* The version of the (up-to-date) listing that cached_filename_completions(prefix) would use, or 0 if it wouldn't use one.
+   As long as this doesn't change, completions of a longer prefix will be among those of prefix */
+unsigned long
+directory_listing_version(const char *prefix)
+{
+  const char *slash = strrchr(prefix, '/');
+  char *directory, *path;
+  struct directory_listing *listing = NULL;
+
+  if (*prefix == '~')
+    return 0;
+  directory = mysavestring(prefix);
+  directory[slash ? slash + 1 - prefix : 0] = '\0';
+  if ((path = absolute_path(directory)))
+    listing = get_listing(path);
+  free(directory);
+  if (path)
+    free(path);
+  return listing ? listing->version : 0;
+}
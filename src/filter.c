@@ -192,9 +192,12 @@ char *filters_last_words(void) {
   return read_from_filter(TAG_OUTPUT);
 }       
     
-int filter_is_interested_in(int tag) {
-  static char *interests = NULL;
-  assert(tag <= MAX_INTERESTING_TAG);
+/* The filter tells us its interests as a string like "nnnnyny", with one letter for every tag up to MAX_INTERESTING_TAG.
+   At the TAG_PROMPT position, a 'd' (instead of 'y') means that the filter is interested, and that its prompts are
+   dynamic, i.e. that it may change the same prompt in different ways (so we should never re-use an earlier result) */
+static char *interests = NULL;
+
+static void ask_for_interests(void) {
   if (!interests) {
     char message[MAX_INTERESTING_TAG + 2];
     int i;
@@ -208,7 +211,19 @@ int filter_is_interested_in(int tag) {
               "if the filter hangs, you won't be able to interrupt with e.g. CTRL-C (use kill -9 %d instead)  ", getpid());
 
   }
-  return (interests[tag] == 'y');
+}
+
+int filter_is_interested_in(int tag) {
+  assert(tag <= MAX_INTERESTING_TAG);
+  ask_for_interests();
+  return (interests[tag] == 'y' || (tag == TAG_PROMPT && interests[tag] == 'd'));
+}
+
+bool filter_prompts_are_dynamic(void) {
+  if (!filter_pid)
+    return FALSE;
+  ask_for_interests();
+  return interests[TAG_PROMPT] == 'd';
 }
  
 static int user_frustration_signals[] = {SIGHUP, SIGINT, SIGQUIT, SIGTERM, SIGALRM};
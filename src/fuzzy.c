@@ -0,0 +1,434 @@
+/*  fuzzy.c: fuzzy (subsequence) matching and ranking of completion candidates
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License , or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; see the file COPYING.  If not, write to
+    the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+
+    You may contact the author by:
+       e-mail:  hanslub42@gmail.com
+*/
+
+
+/* With --fuzzy-completion, a word on the completion list is a candidate whenever the characters of the
+   prefix typed by the user occur in it in the same order (but not necessarily contiguously): "fb" will
+   match "foobar" and "fizz_buzz". Candidates are then ranked (more or less like fzf does it) by how
+   "natural" the match is: contiguous runs of matching characters and matches at the start of words
+   (after a '_', '-', '.', or at a lowercase->Uppercase transition) score higher, gaps cost points.
+
+   As this has to be done on every TAB, even with huge completion lists, we keep our own copy of the
+   completion list, packed back-to-back in one big arena, together with a 64-bit mask per word that tells
+   which characters occur in it. Most candidates can then be rejected by a single AND, and only the
+   survivors get scored. The mask loop is written so that the compiler can vectorise it.
+
+   The arena is only appended to. Words that are removed from the completion list are marked as
+   "dead" (by setting their mask to 0, a mask that no non-empty word can have), and the arena gets
+   compacted when more than half of it is dead.
+
+   Compiled completion lists (cf. wordindex.c) already contain masks and offsets in the same format.
+   They are scanned in place, as extra "segments" next to the arena                                     */
+
+
+#include "rlwrap.h"
+
+#define SCORE_MATCH              16
+#define BONUS_BOUNDARY           8   /* match at start of word, or after a non-alphanumeric character */
+#define BONUS_CAMEL              7   /* match at a lowercase -> Uppercase transition */
+#define BONUS_CONSECUTIVE        4   /* minimum bonus for a match immediately following another match */
+#define BONUS_FIRST_CHAR_FACTOR  2   /* the bonus of the first matched character counts double */
+#define PENALTY_GAP_START        3
+#define PENALTY_GAP_EXTENSION    1
+
+#define MASK_BLOCK               64  /* number of masks we AND in one (vectorisable) go */
+
+
+static char     *arena = NULL;       /* all words back to back, each terminated by a '\0' */
+static size_t    arena_size = 0, arena_allocated = 0;
+static uint64_t *offsets = NULL;     /* offsets[i] is where word i starts in arena */
+static uint64_t *masks   = NULL;     /* masks[i] tells which characters occur in word i (0 if word i is dead) */
+static int       nwords = 0, words_allocated = 0, ndead = 0;
+
+static struct segment {
+  const uint64_t *masks, *offsets;
+  const char *strings;
+  long nwords;
+} *extra_segments = NULL;            /* segments that are not ours to change (except for marking words as dead) */
+static int nextra_segments = 0;
+
+
+/* map a character to one of 64 bits: a-z (case-folded) and 0-9 get a bit of their own, all others share the remaining 28 */
+static uint64_t
+charbit(unsigned char c)
+{
+  c = tolower(c);
+  if (c >= 'a' && c <= 'z')
+    return (uint64_t) 1 << (c - 'a');
+  if (c >= '0' && c <= '9')
+    return (uint64_t) 1 << (26 + c - '0');
+  return (uint64_t) 1 << (36 + c % 28);
+}
+
+
+uint64_t
+fuzzy_charmask(const char *word)
+{
+  uint64_t mask = 0;
+  for (; *word; word++)
+    mask |= charbit(*word);
+  return mask;
+}
+
+
+static int
+chars_match(char c1, char c2)
+{
+  return completion_is_case_sensitive ? c1 == c2 : tolower(c1) == tolower(c2);
+}
+
+
+static int
+words_are_equal(const char *w1, const char *w2)
+{
+  return (completion_is_case_sensitive ? strcmp(w1, w2) : strcasecmp(w1, w2)) == 0;
+}
+
+
+/* bonus for matching the character at position p in word */
+static int
+bonus_at(const char *word, const char *p)
+{
+  if (p == word || !isalnum((unsigned char) p[-1]))
+    return BONUS_BOUNDARY;
+  if (islower((unsigned char) p[-1]) && isupper((unsigned char) *p))
+    return BONUS_CAMEL;
+  return 0;
+}
+
+
+/* If query (of length querylen > 0) is a subsequence of word, put its score in *pscore and return TRUE.
+   The score is computed for the shortest match that ends as early as possible: first find where the
+   leftmost match ends, then walk back to find the rightmost place where that match can start         */
+static int
+fuzzy_score(const char *word, const char *query, int querylen, int *pscore)
+{
+  const char *p, *q, *start, *end;
+  int score, in_gap, chunk_bonus;
+
+  for (p = word, q = query; *p && *q; p++)      /* forward pass */
+    if (chars_match(*p, *q))
+      q++;
+  if (*q)
+    return FALSE;
+  end = p - 1;
+
+  for (p = end, q = query + querylen - 1; ; p--) { /* backward pass, will always terminate as the forward pass found a match */
+    if (chars_match(*p, *q)) {
+      if (q == query)
+        break;
+      q--;
+    }
+  }
+  start = p;
+
+  for (score = 0, in_gap = FALSE, chunk_bonus = 0, p = start, q = query; p <= end; p++) {
+    if (*q && chars_match(*p, *q)) {
+      int bonus = bonus_at(word, p);
+      if (p > start && !in_gap)      /* consecutive match: it inherits the bonus of the start of its chunk */
+        bonus = max(bonus, max(chunk_bonus, BONUS_CONSECUTIVE));
+      else
+        chunk_bonus = bonus;
+      if (q == query)
+        bonus *= BONUS_FIRST_CHAR_FACTOR;
+      score += SCORE_MATCH + bonus;
+      in_gap = FALSE;
+      q++;
+    } else {
+      score -= (in_gap ? PENALTY_GAP_EXTENSION : PENALTY_GAP_START);
+      in_gap = TRUE;
+      chunk_bonus = 0;
+    }
+  }
+  *pscore = score;
+  return TRUE;
+}
+
+
+void
+fuzzy_add_word(const char *word)
+{
+  size_t length = strlen(word) + 1;
+
+  if (length == 1)
+    return;
+  if (arena_size + length > arena_allocated) {
+    size_t new_allocated = max(2 * arena_allocated, arena_size + length + 4096);
+    arena = myrealloc(arena, arena_allocated, new_allocated);
+    arena_allocated = new_allocated;
+  }
+  if (nwords == words_allocated) {
+    int new_allocated = max(2 * words_allocated, 1024);
+    offsets = myrealloc(offsets, words_allocated * sizeof(uint64_t), new_allocated * sizeof(uint64_t));
+    masks   = myrealloc(masks, words_allocated * sizeof(uint64_t), new_allocated * sizeof(uint64_t));
+    words_allocated = new_allocated;
+  }
+  memcpy(arena + arena_size, word, length);
+  offsets[nwords] = arena_size;
+  masks[nwords] = fuzzy_charmask(word);
+  arena_size += length;
+  nwords++;
+}
+
+
+/* squeeze out the dead words */
+static void
+compact_arena(void)
+{
+  int i, j;
+  size_t new_size;
+
+  for (i = j = 0, new_size = 0; i < nwords; i++) {
+    if (masks[i]) {
+      size_t length = strlen(arena + offsets[i]) + 1;
+      memmove(arena + new_size, arena + offsets[i], length);
+      offsets[j] = new_size;
+      masks[j++] = masks[i];
+      new_size += length;
+    }
+  }
+  DPRINTF3(DEBUG_COMPLETION, "compacted fuzzy arena from %d to %d words (%d bytes)", nwords, j, (int) new_size);
+  nwords = j;
+  arena_size = new_size;
+  ndead = 0;
+}
+
+
+void
+fuzzy_remove_word(const char *word)
+{
+  uint64_t mask = fuzzy_charmask(word);
+  int i;
+
+  for (i = 0; i < nwords; i++) {
+    if (masks[i] == mask && words_are_equal(arena + offsets[i], word)) {
+      masks[i] = 0;
+      if (++ndead > nwords / 2)
+        compact_arena();
+      return;
+    }
+  }
+}
+
+
+struct scored_word {
+  int score;
+  const char *word;
+};
+
+
+static int
+better_match(const void *a, const void *b)
+{
+  const struct scored_word *sa = a, *sb = b;
+  size_t la, lb;
+
+  if (sa->score != sb->score)
+    return sb->score - sa->score;
+  if ((la = strlen(sa->word)) != (lb = strlen(sb->word))) /* shorter words first ... */
+    return la < lb ? -1 : 1;
+  return strcmp(sa->word, sb->word);                      /* ... then alphabetically */
+}
+
+
+static void
+append_scored_word(struct scored_word **pmatches, int *pcount, int *pallocated, const char *word, int score)
+{
+  if (*pcount == *pallocated) {
+    int new_allocated = max(2 * *pallocated, 64);
+    *pmatches = myrealloc(*pmatches, *pallocated * sizeof(struct scored_word), new_allocated * sizeof(struct scored_word));
+    *pallocated = new_allocated;
+  }
+  (*pmatches)[*pcount].score = score;
+  (*pmatches)[(*pcount)++].word = word;
+}
+
+
+/* rearrange matches[] so that its best n elements come first (in no particular order), like C++'s nth_element().
+   Sorting only those is a lot faster than sorting all matches, when there are hundreds of thousands of them       */
+static void
+select_best_matches(struct scored_word *matches, int count, int n)
+{
+  int low = 0, high = count - 1;
+
+  while (low < high) {
+    struct scored_word pivot = matches[low + (high - low) / 2], swap;
+    int i = low, j = high;
+    while (i <= j) {
+      while (better_match(&matches[i], &pivot) < 0)
+        i++;
+      while (better_match(&pivot, &matches[j]) < 0)
+        j--;
+      if (i <= j) {
+        swap = matches[i], matches[i] = matches[j], matches[j] = swap;
+        i++, j--;
+      }
+    }
+    if (n <= j)
+      high = j;
+    else if (n >= i)
+      low = i;
+    else
+      break;
+  }
+}
+
+
+/* score all live words in a segment that match query */
+static void
+scan_segment(const struct segment *segment, const char *query, struct scored_word **pmatches, int *pcount, int *pallocated)
+{
+  uint64_t query_mask = fuzzy_charmask(query);
+  int querylen = strlen(query);
+  long block;
+  int i;
+
+  for (block = 0; block < segment->nwords; block += MASK_BLOCK) {
+    int blocksize = min(MASK_BLOCK, segment->nwords - block);
+    uint64_t survivors = 0;
+    const uint64_t *blockmasks = segment->masks + block;
+
+    for (i = 0; i < blocksize; i++)  /* no branches here, so that this will be vectorised */
+      survivors |= (uint64_t) ((blockmasks[i] & query_mask) == query_mask) << i;
+
+    for (i = 0; survivors; i++, survivors >>= 1) {
+      int score;
+      const char *word = segment->strings + segment->offsets[block + i];
+      if ((survivors & 1) && fuzzy_score(word, query, querylen, &score))
+        append_scored_word(pmatches, pcount, pallocated, word, score);
+    }
+  }
+}
+
+
+void
+fuzzy_add_segment(const uint64_t *masks, const uint64_t *offsets, const char *strings, long nwords)
+{
+  extra_segments = myrealloc(extra_segments, nextra_segments * sizeof(struct segment), (nextra_segments + 1) * sizeof(struct segment));
+  extra_segments[nextra_segments].masks   = masks;
+  extra_segments[nextra_segments].offsets = offsets;
+  extra_segments[nextra_segments].strings = strings;
+  extra_segments[nextra_segments].nwords  = nwords;
+  nextra_segments++;
+}
+
+
+/* Return the words matching query, best first, as a NULL-terminated list of pointers into the arena (or other segments).
+   The caller should free() the list (but not the words), and copy the words before the next call
+   to fuzzy_add_word() or fuzzy_remove_word(), which may move them around.
+   If limit > 0, skip the best skip matches, and return at most limit of the ones after them (*more tells whether
+   there are even more). Only those get sorted                                                                    */
+const char **
+fuzzy_matches(const char *query, int skip, int limit, bool *more)
+{
+  struct segment arena_segment;
+  struct scored_word *matches = NULL;
+  int nmatches = 0, matches_allocated = 0, nwanted;
+  const char **result;
+  int i;
+
+  arena_segment.masks   = masks;
+  arena_segment.offsets = offsets;
+  arena_segment.strings = arena;
+  arena_segment.nwords  = nwords;
+  scan_segment(&arena_segment, query, &matches, &nmatches, &matches_allocated);
+  for (i = 0; i < nextra_segments; i++)
+    scan_segment(&extra_segments[i], query, &matches, &nmatches, &matches_allocated);
+
+  if (limit <= 0)
+    skip = 0, limit = nmatches;
+  nwanted = min(nmatches, skip + limit);
+  if (more)
+    *more = nmatches > nwanted;
+  if (nwanted < nmatches)
+    select_best_matches(matches, nmatches, nwanted);
+  if (nwanted > 0)
+    qsort(matches, nwanted, sizeof(struct scored_word), &better_match);
+  nwanted = max(nwanted - skip, 0);
+  result = mymalloc((nwanted + 1) * sizeof(char *));
+  for (i = 0; i < nwanted; i++)
+    result[i] = matches[skip + i].word;
+  result[nwanted] = NULL;
+  DPRINTF4(DEBUG_COMPLETION, "query <%s>: %d fuzzy matches, returning %d (best: <%s>)", query, nmatches, nwanted, (nwanted ? result[0] : ""));
+  if (matches)
+    free(matches);
+  return result;
+}
+
+
+int
+fuzzy_is_match(const char *query, const char *word)
+{
+  int score;
+  return *query && fuzzy_score(word, query, strlen(query), &score);
+}
+
+
+/* Re-rank the count (malloc'ed) words in words[] for query, best first, freeing those that don't match at all.
+   Returns the number of remaining words (words[] gets NULL-terminated). Used to narrow down the candidates
+   for a previous query when query extends it: the new matches will always be a subset of the old          */
+int
+fuzzy_rank(const char *query, char **words, int count)
+{
+  int querylen = strlen(query);
+  struct scored_word *matches = NULL;
+  int nmatches = 0, matches_allocated = 0;
+  int i;
+
+  for (i = 0; i < count; i++) {
+    int score;
+    if (fuzzy_score(words[i], query, querylen, &score))
+      append_scored_word(&matches, &nmatches, &matches_allocated, words[i], score);
+    else
+      free(words[i]);
+  }
+  if (nmatches > 0)
+    qsort(matches, nmatches, sizeof(struct scored_word), &better_match);
+  for (i = 0; i < nmatches; i++)
+    words[i] = (char *) matches[i].word;
+  words[nmatches] = NULL;
+  free(matches);
+  return nmatches;
+}
+
+
+
+#ifdef UNIT_TEST
+
+TESTFUNC(test_fuzzy, argc, argv, stage) {
+  const char **matches, **p;
+  char **plist;
+
+  ONLY_AT_STAGE(TEST_AFTER_OPTION_PARSING);
+  if (argc < 2)
+    myerror(FATAL|NOERRNO, "usage: make CFLAGS='-g -DUNIT_TEST=test_fuzzy'; ./rlwrap <query> <word> <word> ...");
+  for (plist = argv + 1; *plist; plist++)
+    fuzzy_add_word(*plist);
+  matches = fuzzy_matches(argv[0], 0, 0, NULL);
+  for (p = matches; *p; p++) {
+    int score = 0;
+    fuzzy_score(*p, argv[0], strlen(argv[0]), &score);
+    printf("%5d  %s\n", score, *p);
+  }
+  free(matches);
+  exit(0);
+}
+
+#endif /* UNIT_TEST */
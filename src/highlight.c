@@ -0,0 +1,548 @@
+/*  highlight.c: colour the input line by token class
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License , or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; see the file COPYING.  If not, write to
+    the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+
+    You may contact the author by:
+       e-mail:  hanslub42@gmail.com
+*/
+
+
+/* With --highlight <file> (or if $RLWRAP_HOME/<command>_highlighting or ~/.<command>_highlighting exists) the input
+   line is coloured by token class: keywords, strings, numbers and comments. Like a completion file, <file> is
+   mostly a list of words (the keywords), with a few %directives:
+
+     %ignore-case                  keywords are matched case-insensitively
+     %strings <chars>              each of <chars> starts and ends a string (default: " and '). A backslash escapes
+     %comment <start> [<end>]      a comment from <start> to <end> (or to the end of the line, if there is no <end>)
+     %colour <class> <colour>      keyword, string, number or comment colour, in the format of --prompt-colour
+
+   readline cannot display colour codes in the input line, so we let rl_redisplay() draw it, and then paint over it.
+
+   On every keypress we only re-lex from the token before the edit until the lexer is at the start of an old token in
+   the same state (and then re-use the remaining tokens), and only re-paint the re-lexed tokens and the coloured
+   tokens past the edit (readline will have re-drawn those). Typing at the end of a line is therefore cheap, however
+   long the line is (e.g. when it has been built from many lines with -m)
+
+   This is only done in readline's default (multi-line) display mode, not with horizontal-scroll-mode, show-mode-in-prompt
+   or the homegrown redisplay, and only as long as the input line has no control characters (which readline displays
+   as ^X)                                                                                                              */
+
+
+#include "rlwrap.h"
+
+enum { PLAIN, KEYWORD, STRING, NUMBER, COMMENT, NCLASSES };
+static const char *class_names[NCLASSES] = { "plain", "keyword", "string", "number", "comment" };
+static char *class_colours[NCLASSES];
+
+#define NORMAL           0              /* lexer states (at the start of a token) */
+#define IN_STRING(c)     (0x100 | (unsigned char) (c))
+#define IN_COMMENT(i)    (0x200 | (i))
+#define MAX_COMMENTS     8
+
+struct token {
+  int start, end;                       /* byte offsets in the input line */
+  int state;                            /* lexer state at start           */
+  int class;
+};
+
+bool highlighting = FALSE;
+static char **keywords = NULL;
+static int nkeywords = 0, keywords_size = 0;
+static bool ignore_case = FALSE;
+static char *string_delimiters = "\"'";
+static struct { char *start, *end; } comments[MAX_COMMENTS];   /* end == NULL for comments up to the end of the line */
+static int ncomments = 0;
+static int lookahead = 1;               /* the number of bytes the lexer may look at past the end of a token */
+
+static char *lexed = NULL;              /* the input line that tokens[] describe (NULL: start afresh) */
+static struct token *tokens = NULL;
+static int ntokens = 0, tokens_size = 0;
+static int relexed_until;               /* set by relex(): where it started re-using old tokens */
+static char *painted_prompt = NULL;     /* the prompt that was displayed when we painted last */
+
+
+static int
+compare_keywords(const char *word, int length, const char *keyword)
+{
+  int result = ignore_case ? strncasecmp(word, keyword, length) : strncmp(word, keyword, length);
+  return result ? result : (keyword[length] ? -1 : 0);
+}
+
+
+static int
+qsort_keywords(const void *a, const void *b)
+{
+  const char *ka = *(const char * const *) a, *kb = *(const char * const *) b;
+  return ignore_case ? strcasecmp(ka, kb) : strcmp(ka, kb);
+}
+
+
+static bool
+is_keyword(const char *word, int length)
+{
+  int lo = 0, hi = nkeywords - 1, mid, cmp;
+
+  while (lo <= hi) {
+    mid = (lo + hi) / 2;
+    if ((cmp = compare_keywords(word, length, keywords[mid])) == 0)
+      return TRUE;
+    if (cmp < 0)
+      hi = mid - 1;
+    else
+      lo = mid + 1;
+  }
+  return FALSE;
+}
+
+
+static bool
+is_word_char(char c)
+{
+  return isalnum((unsigned char) c) || c == '_' || (unsigned char) c >= 0x80;
+}
+
+
+static bool
+starts_with(const char *p, const char *prefix)
+{
+  return strncmp(p, prefix, strlen(prefix)) == 0;
+}
+
+
+/* the end of a comment that ends at the end of the line, which is either the end of the input, or a multi-line separator (-m) */
+static int
+end_of_line(const char *buffer, int pos)
+{
+  const char *separator = multiline_separator ? strstr(buffer + pos, multiline_separator) : NULL;
+  return separator ? separator - buffer : (int) strlen(buffer);
+}
+
+
+/* lex the token that starts at buffer[pos] in lexer state *state. Return its end, put its class in *class
+   and the state after it in *state */
+static int
+lex_token(const char *buffer, int pos, int *state, int *class)
+{
+  const char *p = buffer + pos, *end;
+  int i;
+
+  if (*state == NORMAL) {
+    for (i = 0; i < ncomments; i++)
+      if (starts_with(p, comments[i].start))
+        break;
+    if (i < ncomments) {
+      *class = COMMENT;
+      if (!comments[i].end)
+        return end_of_line(buffer, pos + strlen(comments[i].start));
+      *state = IN_COMMENT(i);
+      p += strlen(comments[i].start);
+    } else if (*p && strchr(string_delimiters, *p)) {
+      *class = STRING;
+      *state = IN_STRING(*p);
+      p++;
+    } else if (isdigit((unsigned char) *p)) {
+      *class = NUMBER;
+      while (is_word_char(*p) || *p == '.')
+        p++;
+      return p - buffer;
+    } else if (is_word_char(*p)) {
+      while (is_word_char(*p))
+        p++;
+      *class = is_keyword(buffer + pos, p - buffer - pos) ? KEYWORD : PLAIN;
+      return p - buffer;
+    } else {
+      *class = PLAIN;
+      if (*p++ == ' ')
+        while (*p == ' ')
+          p++;
+      return p - buffer;
+    }
+  }
+
+  if (*state & IN_STRING(0)) {          /* (possibly still) within a string */
+    *class = STRING;
+    for (; *p; p++) {
+      if (*p == '\\' && p[1]) {
+        p++;
+      } else if (*p == (char) (*state & 0xff)) {
+        *state = NORMAL;
+        return p + 1 - buffer;
+      }
+    }
+    return p - buffer;
+  }
+
+  *class = COMMENT;                     /* (possibly still) within a comment */
+  i = *state & 0xff;
+  if ((end = strstr(p, comments[i].end))) {
+    *state = NORMAL;
+    return end + strlen(comments[i].end) - buffer;
+  }
+  return strlen(buffer);
+}
+
+
+static void
+add_token(int start, int end, int state, int class)
+{
+  if (ntokens == tokens_size) {
+    int new_size = tokens_size ? 2 * tokens_size : 64;
+    tokens = myrealloc(tokens, tokens_size * sizeof(struct token), new_size * sizeof(struct token));
+    tokens_size = new_size;
+  }
+  tokens[ntokens].start = start;
+  tokens[ntokens].end   = end;
+  tokens[ntokens].state = state;
+  tokens[ntokens].class = class;
+  ntokens++;
+}
+
+
+/* bring tokens[] up to date with buffer, and return the position from which the input line has to be re-painted (or
+   -1 if buffer hasn't changed). Sets relexed_until */
+static int
+relex(const char *buffer)
+{
+  int old_length = lexed ? strlen(lexed) : 0, new_length = strlen(buffer);
+  int prefix, suffix, delta = new_length - old_length, first, pos, state, start_state, class, start, nold, i, j, repaint_from;
+  struct token *old;
+
+  if (lexed && strcmp(lexed, buffer) == 0)
+    return -1;
+  if (!lexed)
+    ntokens = 0;
+  for (prefix = 0; prefix < old_length && lexed[prefix] == buffer[prefix]; prefix++)
+    ;
+  for (suffix = 0; suffix < old_length - prefix && suffix < new_length - prefix &&
+         lexed[old_length - 1 - suffix] == buffer[new_length - 1 - suffix]; suffix++)
+    ;
+
+  /* the first token that the edit may have changed: the one that ends at (or just before) the start of the edit. A
+     comment that ends at a multi-line separator will change if the separator does */
+  if (multiline_separator)
+    lookahead = max(lookahead, (int) strlen(multiline_separator));
+  for (first = 0; first < ntokens && tokens[first].end + lookahead <= prefix; first++)
+    ;
+  nold = ntokens - first;
+  old = mymalloc((nold + 1) * sizeof(struct token));
+  memcpy(old, tokens + first, nold * sizeof(struct token));
+  pos   = nold > 0 ? old[0].start : 0;
+  state = nold > 0 ? old[0].state : NORMAL;
+  ntokens = first;
+  repaint_from = prefix;
+
+  for (i = j = 0; pos < new_length; ) {
+    if (pos >= new_length - suffix) {   /* in the unchanged part: can we re-use the old tokens from here on? */
+      while (j < nold && old[j].start + delta < pos)
+        j++;
+      if (j < nold && old[j].start + delta == pos && old[j].state == state)
+        break;                          /* yes: from here on, lexing would find the same tokens as before */
+    }
+    start = pos;
+    start_state = state;
+    pos = lex_token(buffer, pos, &state, &class);
+    add_token(start, pos, start_state, class);
+    if (start < prefix) { /* a token that was already there: has its colour (or extent) changed? */
+      while (i < nold && old[i].start < start)
+        i++;
+      if (!(i < nold && old[i].start == start && old[i].class == class))
+        repaint_from = min(repaint_from, start);
+      else if (old[i].end != pos)
+        repaint_from = min(repaint_from, min(old[i].end, pos));
+    }
+  }
+  relexed_until = pos;
+  for (; pos < new_length && j < nold; j++)
+    add_token(old[j].start + delta, old[j].end + delta, old[j].state, old[j].class);
+  free(old);
+  if (lexed)
+    free(lexed);
+  lexed = mysavestring(buffer);
+  DPRINTF4(DEBUG_READLINE, "re-lexed %d..%d of %d bytes (%d tokens)", first < ntokens ? tokens[first].start : 0, relexed_until, new_length, ntokens);
+  return repaint_from;
+}
+
+
+/* move the cursor from (*row, *col) (relative to the start of the prompt; *col == -1 if we don't know) to (to_row, to_col) */
+static void
+move_cursor(int *row, int *col, int to_row, int to_col)
+{
+  for (; *row < to_row; (*row)++, *col = -1)
+    curs_down();
+  for (; *row > to_row; (*row)--, *col = -1)
+    curs_up();
+  if (*col != to_col)
+    cursor_hpos(to_col);
+  *col = to_col;
+}
+
+
+/* paint buffer (that rl_redisplay() has just displayed after prompt_width columns of prompt) in colour, from byte
+   offset from onwards. Only plain tokens that have been re-lexed need to be re-painted (their colour may have
+   changed), readline has drawn the others already                                                                 */
+static void
+paint(const char *buffer, int prompt_width, int from)
+{
+  int width = winsize.ws_col, length = strlen(buffer), *rows, *cols, row, col, char_width, top_row, i, start, end;
+  const char *p;
+  MBSTATE st;
+
+  /* first determine where each character is on screen */
+  rows = mymalloc((length + 1) * sizeof(int));
+  cols = mymalloc((length + 1) * sizeof(int));
+  row = prompt_width / width;
+  col = prompt_width % width;
+  for (mbc_initstate(&st), p = buffer; *p; mbc_inc(&p, &st)) {
+    if ((unsigned char) *p < ' ' || *p == 0x7f) {    /* displayed as ^X (or, for TAB, as spaces): we give up */
+      DPRINTF0(DEBUG_READLINE, "not highlighting input line with control characters");
+      free(rows);
+      free(cols);
+      return;
+    }
+    char_width = mbc_columns(p, &st);
+    if (col + char_width > width) {
+      row++;
+      col = 0;
+    }
+    for (i = p - buffer; i < p - buffer + mbc_charwidth(p, &st); i++) {
+      rows[i] = row;
+      cols[i] = col;
+    }
+    col += char_width;
+  }
+  rows[length] = row + (col >= width ? 1 : 0);
+  cols[length] = col >= width ? 0 : col;
+  top_row = max(0, rows[length] - winsize.ws_row + 1); /* rows above this one have scrolled off the screen */
+
+  fflush(rl_outstream ? rl_outstream : stdout);
+  row = rows[rl_point];
+  col = cols[rl_point];
+  for (i = 0; i < ntokens; i++) {
+    if (tokens[i].end <= from || (tokens[i].class == PLAIN && tokens[i].start >= relexed_until))
+      continue;
+    start = max(tokens[i].start, from);
+    end = tokens[i].end;
+    if (rows[start] < top_row)
+      continue;
+    move_cursor(&row, &col, rows[start], cols[start]);
+    if (tokens[i].class != PLAIN)
+      my_putstr(class_colours[tokens[i].class]);
+    write_patiently(STDOUT_FILENO, buffer + start, end - start, "to stdout");
+    if (tokens[i].class != PLAIN)
+      my_putstr("\033[0m");
+    row = rows[end - 1];
+    col = rows[end] == row ? cols[end] : -1; /* at the end of a row, the terminal may not have wrapped yet */
+  }
+  move_cursor(&row, &col, rows[rl_point], cols[rl_point]);
+  free(rows);
+  free(cols);
+}
+
+
+/* forget what the input line looks like (e.g. after accepting it), so that it will be painted from scratch */
+void
+forget_highlighting(void)
+{
+  if (lexed)
+    free(lexed);
+  lexed = NULL;
+}
+
+
+/* called right after rl_redisplay(). If repaint_everything is FALSE, readline has only updated the part that has
+   changed since we last painted */
+void
+highlight_input_line(int repaint_everything)
+{
+  const char *prompt = rl_prompt ? rl_prompt : "";
+  int from;
+
+  if (!highlighting)
+    return;
+  if (!redisplay || !redisplay_multiple_lines || rl_display_prompt != rl_prompt || strchr(prompt, '\n') ||
+      strings_are_equal(rl_variable_value("show-mode-in-prompt"), "on") || winsize.ws_col <= 0) {
+    forget_highlighting();
+    return;
+  }
+#ifdef RL_STATE_DISPATCHING
+  if (RL_ISSTATE(RL_STATE_DISPATCHING)) /* called from within a readline command (e.g. after listing completions) */
+    repaint_everything = TRUE;
+#endif
+  if (!painted_prompt || strcmp(painted_prompt, prompt) != 0) {
+    if (painted_prompt)
+      free(painted_prompt);
+    painted_prompt = mysavestring(prompt);
+    repaint_everything = TRUE;
+  }
+  from = relex(rl_line_buffer);
+  if (repaint_everything) {
+    from = 0;
+    relexed_until = strlen(rl_line_buffer);
+  }
+  if (from < 0)
+    return;
+  while (from > 0 && (rl_line_buffer[from] & 0xc0) == 0x80)
+    from--;                             /* don't start in the middle of a (UTF-8) character */
+  paint(rl_line_buffer, prompt_layout(prompt, winsize.ws_col)->width, from);
+}
+
+
+static void
+add_keyword(const char *word)
+{
+  if (nkeywords == keywords_size) {
+    int new_size = keywords_size ? 2 * keywords_size : 64;
+    keywords = myrealloc(keywords, keywords_size * sizeof(char *), new_size * sizeof(char *));
+    keywords_size = new_size;
+  }
+  keywords[nkeywords++] = mysavestring(word);
+}
+
+
+static void
+parse_directive(char *line, const char *filename, int lineno)
+{
+  char *directive = strtok(line, " \t"), *arg1 = strtok(NULL, " \t"), *arg2 = strtok(NULL, " \t");
+  int i;
+
+  if (!directive) {
+    myerror(WARNING|NOERRNO, "%s, line %d: empty %% directive", filename, lineno);
+  } else if (strcmp(directive, "ignore-case") == 0) {
+    ignore_case = TRUE;
+  } else if (strcmp(directive, "strings") == 0) {
+    string_delimiters = mysavestring(arg1 ? arg1 : "");
+  } else if (strcmp(directive, "comment") == 0) {
+    if (!arg1 || ncomments == MAX_COMMENTS) {
+      myerror(WARNING|NOERRNO, "%s, line %d: %s", filename, lineno, arg1 ? "too many comment types" : "%comment needs a start (and optionally an end)");
+      return;
+    }
+    comments[ncomments].start = mysavestring(arg1);
+    comments[ncomments].end = arg2 ? mysavestring(arg2) : NULL;
+    ncomments++;
+    lookahead = max(lookahead, (int) strlen(arg1) - 1);
+  } else if (strcmp(directive, "colour") == 0 || strcmp(directive, "color") == 0) {
+    for (i = PLAIN + 1; i < NCLASSES; i++)
+      if (arg1 && strcmp(arg1, class_names[i]) == 0)
+        break;
+    if (i == NCLASSES || !arg2)
+      myerror(WARNING|NOERRNO, "%s, line %d: use %%colour keyword|string|number|comment <colour>", filename, lineno);
+    else
+      class_colours[i] = decode_colour_spec(arg2);
+  } else {
+    myerror(WARNING|NOERRNO, "%s, line %d: unknown directive %%%s", filename, lineno, directive);
+  }
+}
+
+
+/* --highlight: read the keywords and %directives in filename */
+void
+read_highlighting_file(const char *filename, bool warn_if_unreadable)
+{
+  char buffer[BUFFSIZE], *word;
+  int lineno = 0;
+  FILE *fp;
+
+  if (!(fp = fopen(filename, "r"))) {
+    if (warn_if_unreadable)
+      myerror(WARNING|USE_ERRNO, "Could not open %s", filename);
+    return;
+  }
+  if (!highlighting) {
+    class_colours[KEYWORD] = decode_colour_spec("Blue");
+    class_colours[STRING]  = decode_colour_spec("green");
+    class_colours[NUMBER]  = decode_colour_spec("magenta");
+    class_colours[COMMENT] = decode_colour_spec("cyan");
+  }
+  while (fgets(buffer, sizeof(buffer), fp)) {
+    lineno++;
+    buffer[strcspn(buffer, "\r\n")] = '\0';
+    if (buffer[0] == '%')
+      parse_directive(buffer + 1, filename, lineno);
+    else
+      for (word = strtok(buffer, " \t"); word; word = strtok(NULL, " \t"))
+        add_keyword(word);
+  }
+  fclose(fp);
+  if (nkeywords > 0)
+    qsort(keywords, nkeywords, sizeof(char *), qsort_keywords);
+  highlighting = TRUE;
+  DPRINTF3(DEBUG_READLINE, "read %d keywords and %d comment types from %s", nkeywords, ncomments, filename);
+}
+
+
+#ifdef UNIT_TEST
+
+static int *
+classes_of(const char *line)
+{
+  int *classes = mymalloc((strlen(line) + 1) * sizeof(int)), i, j;
+
+  for (i = 0; i < ntokens; i++)
+    for (j = tokens[i].start; j < tokens[i].end; j++)
+      classes[j] = tokens[i].class;
+  return classes;
+}
+
+
+/* make clean; make CFLAGS='-g -DUNIT_TEST=test_highlight'; ./rlwrap -x <file> cat [<number of edits>]
+   Edits a line at random, and compares the tokens that relex() finds with those that a fresh lexer finds. Also checks
+   that nothing outside the part that is re-painted has changed colour */
+TESTFUNC(test_highlight, argc, argv, stage) {
+  static const char *pieces[] = { "select", "from", "x", " ", "  ", "'", "\"", "\\", "12", "3.4", "--", "/*", "*/", "#", "\xc3\xa9" };
+  int nedits = argc > 1 ? atoi(argv[1]) : 10000, edit, pos, ndeleted, old_length, new_length, repaint_from, i, nfresh, bad = 0;
+  char *line = mysavestring(""), *new_line;
+  int *old_classes, *new_classes;
+  struct token *incremental;
+
+  ONLY_AT_STAGE(TEST_AFTER_OPTION_PARSING);
+  srand(42);
+  relex(line);
+  for (edit = 0; edit < nedits; edit++) {
+    old_length = strlen(line);
+    pos = rand() % (old_length + 1);
+    ndeleted = old_length > 100 ? rand() % 20 : rand() % 3; /* (min() is a macro) */
+    ndeleted = min(old_length - pos, ndeleted);
+    new_line = mymalloc(old_length + 20);
+    memcpy(new_line, line, pos);
+    strcpy(new_line + pos, rand() % 3 ? pieces[rand() % (sizeof(pieces) / sizeof(char *))] : "");
+    strcat(new_line, line + pos + ndeleted);
+    new_length = strlen(new_line);
+
+    old_classes = classes_of(line);
+    repaint_from = relex(new_line);
+    new_classes = classes_of(new_line);
+    if (repaint_from >= 0) {
+      for (i = 0; i < min(repaint_from, new_length); i++)
+        if (new_classes[i] != old_classes[i])
+          bad++, printf("<%s> -> <%s>: byte %d changed colour, but was not re-painted (from %d)\n", line, new_line, i, repaint_from);
+      for (i = relexed_until; i < new_length; i++)
+        if (new_classes[i] != old_classes[i - new_length + old_length])
+          bad++, printf("<%s> -> <%s>: byte %d changed colour, but was not re-lexed (until %d)\n", line, new_line, i, relexed_until);
+    }
+    incremental = mymalloc((ntokens + 1) * sizeof(struct token));
+    memcpy(incremental, tokens, ntokens * sizeof(struct token));
+    nfresh = ntokens;
+    forget_highlighting();
+    relex(new_line);
+    if (nfresh != ntokens || memcmp(incremental, tokens, ntokens * sizeof(struct token)) != 0)
+      bad++, printf("<%s> -> <%s>: incremental lexing went wrong\n", line, new_line);
+    free_multiple(incremental, old_classes, new_classes, line, FMEND);
+    line = new_line;
+  }
+  printf("%d edits, %d errors\n", nedits, bad);
+  exit(bad ? 1 : 0);
+}
+
+#endif /* UNIT_TEST */
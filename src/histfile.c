@@ -0,0 +1,410 @@
+/*  histfile.c: append accepted lines to the history file as soon as they are accepted
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License , or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; see the file COPYING.  If not, write to
+    the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+
+    You may contact the author by:
+       e-mail:  hanslub42@gmail.com
+*/
+
+
+/* Normally, rlwrap writes the whole history at exit. If it gets killed (or the machine crashes) the session's
+   history is lost, and with a big history, writing it makes exiting slow. With --append-history (-J) every
+   accepted line is appended to the history file immediately, with one write() (O_APPEND) while holding a
+   (advisory, fcntl()) lock on the file, and nothing is written at exit.
+
+   The file then keeps growing, so every now and then (when it holds twice as many lines as the history
+   size, or when it has more than that and we haven't compacted it for an hour) it gets compacted: its last
+   <histsize> lines (without duplicates, if -D asks for that) are written to a temporary file which is
+   then renamed to the history file. We compact the file itself, not our own history, so that
+   lines appended by other rlwrap sessions are never lost.
+
+   Other sessions may be waiting for the lock on the file we just renamed over. They notice that
+   (the file they locked is no longer the one with that name), and start again with the new file.
+
+   With --share-history (-G) we also pick up the lines that other sessions append: we remember how much of
+   the history file we have seen, and whenever a prompt is shown (unless the user is browsing the history)
+   a stat() tells us whether the file has grown. If it has, we read only what has been added. If somebody has compacted the file, we read all of it (as all our own
+   lines are in the file already, this loses nothing). Lines appended by others just before we append our
+   own are read while we hold the lock, so that our history has the same order as the file              */
+
+
+#include "rlwrap.h"
+
+#define COMPACTION_INTERVAL 3600 /* seconds */
+
+static char *history_file = NULL;      /* NULL unless we're appending */
+static long lines_in_file = 0;         /* (about) how many lines the history file has */
+static time_t last_compaction;
+
+static bool sharing = FALSE;
+static struct {                        /* if sharing: how much of which history file we have seen */
+  dev_t device;
+  ino_t inode;
+  off_t size;
+} seen;
+
+
+/* open filename, and wait for a write lock on it. Returns -1 if this cannot be done. Also used by histtool.c */
+int
+open_locked(const char *filename, int flags)
+{
+  struct stat locked, named;
+  struct flock lock;
+  int fd;
+
+  while (TRUE) {
+    if ((fd = open(filename, flags | O_CREAT, 0600)) < 0)
+      return -1;
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = F_WRLCK;
+    lock.l_whence = SEEK_SET; /* l_start = l_len = 0: lock the whole file */
+    while (fcntl(fd, F_SETLKW, &lock) < 0) {
+      if (errno != EINTR) {
+        close(fd);
+        return -1;
+      }
+    }
+    if (fstat(fd, &locked) == 0 && stat(filename, &named) == 0 && locked.st_ino == named.st_ino && locked.st_dev == named.st_dev)
+      return fd;
+    close(fd); /* somebody has compacted the file while we were waiting for the lock: try again */
+  }
+}
+
+
+static bool
+write_all(int fd, const char *buffer, size_t count)
+{
+  ssize_t nwritten;
+
+  while (count > 0) {
+    if ((nwritten = write(fd, buffer, count)) < 0) {
+      if (errno == EINTR)
+        continue;
+      return FALSE;
+    }
+    buffer += nwritten;
+    count -= nwritten;
+  }
+  return TRUE;
+}
+
+
+static char *
+read_all(int fd, size_t *psize)
+{
+  struct stat buf;
+  char *contents;
+  ssize_t nread;
+  size_t total = 0;
+
+  if (fstat(fd, &buf))
+    return NULL;
+  contents = mymalloc(buf.st_size + 1);
+  while (total < (size_t) buf.st_size && (nread = read(fd, contents + total, buf.st_size - total)) != 0) {
+    if (nread < 0) {
+      if (errno == EINTR)
+        continue;
+      free(contents);
+      return NULL;
+    }
+    total += nread;
+  }
+  contents[total] = '\0';
+  *psize = total;
+  return contents;
+}
+
+
+struct numbered_line {
+  const char *line;
+  unsigned long hash;
+  long number;
+};
+
+
+static int
+compare_numbered_lines(const void *a, const void *b)
+{
+  const struct numbered_line *l1 = a, *l2 = b;
+  int result;
+
+  if (l1->hash != l2->hash)
+    return l1->hash < l2->hash ? -1 : 1;
+  if ((result = strcmp(l1->line, l2->line)))
+    return result;
+  return l1->number < l2->number ? -1 : l1->number > l2->number ? 1 : 0;
+}
+
+
+/* set records[i] to NULL for every record that also occurs after i (keeping the last of every set of doubles) */
+static void
+forget_all_doubles(char **records, long nlines)
+{
+  struct numbered_line *numbered = mymalloc(max(nlines, 1) * sizeof(struct numbered_line));
+  long i;
+
+  for (i = 0; i < nlines; i++) {
+    numbered[i].line = records[i];
+    numbered[i].hash = hash_multiple(1, records[i]);
+    numbered[i].number = i;
+  }
+  qsort(numbered, nlines, sizeof(struct numbered_line), &compare_numbered_lines);
+  for (i = 0; i + 1 < nlines; i++)
+    if (numbered[i].hash == numbered[i + 1].hash && strcmp(numbered[i].line, numbered[i + 1].line) == 0)
+      records[numbered[i].number] = NULL;
+  free(numbered);
+}
+
+
+/* add the (complete) lines in text to the history, avoiding duplicates like my_add_history() would. Returns the
+   number of bytes taken in */
+static size_t
+take_in_lines(char *text)
+{
+  char *line = text, *end;
+
+  for (; (end = strchr(line, '\n')); line = end + 1) {
+    *end = '\0';
+    if (history_duplicate_avoidance_policy == ELIMINATE_ALL_DOUBLES)
+      remove_from_history(line);
+    else if (history_duplicate_avoidance_policy == ELIMINATE_SUCCESIVE_DOUBLES && history_length > 0 &&
+             strcmp(history_get(history_base + history_length - 1)->line, line) == 0)
+      continue;
+    add_to_history(line);
+    lines_in_file++;
+  }
+  return line - text;
+}
+
+
+static void
+remember_what_we_have_seen(int fd, off_t size)
+{
+  struct stat buf;
+
+  if (fstat(fd, &buf) == 0) {
+    seen.device = buf.st_dev;
+    seen.inode = buf.st_ino;
+  }
+  seen.size = size;
+}
+
+
+/* Read lines that other sessions have added to the (open) history file fd, or the whole file, if it has been replaced
+   (or truncated) since we last looked at it */
+static void
+catch_up_with_history_file(int fd)
+{
+  struct stat buf;
+  char *contents;
+  ssize_t nread;
+  size_t total = 0;
+  bool replaced;
+
+  if (fstat(fd, &buf))
+    return;
+  replaced = buf.st_ino != seen.inode || buf.st_dev != seen.device || buf.st_size < seen.size;
+  if (!replaced && buf.st_size == seen.size)
+    return;
+  finish_loading_history();
+  if (replaced) {
+    DPRINTF1(DEBUG_HISTORY, "%s has been replaced, re-reading it", history_file);
+    clear_history();
+    forget_history_index();
+    seen.size = 0;
+    lines_in_file = 0;
+  }
+  contents = mymalloc(buf.st_size - seen.size + 1);
+  while (total < (size_t) (buf.st_size - seen.size) &&
+         (nread = pread(fd, contents + total, buf.st_size - seen.size - total, seen.size + total)) != 0) {
+    if (nread < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    total += nread;
+  }
+  contents[total] = '\0';
+  remember_what_we_have_seen(fd, seen.size + take_in_lines(contents)); /* a line that is still being written will be read next time */
+  DPRINTF2(DEBUG_HISTORY, "caught up with %s (%ld bytes seen)", history_file, (long) seen.size);
+  using_history();
+  free(contents);
+}
+
+
+/* Keep only the last history_max_entries lines of the history file, removing duplicates like my_add_history() would */
+static void
+compact_history_file(void)
+{
+  char *contents, *tmpname, **records, *line, *end;
+  size_t size;
+  long nlines = 0, nkept = 0, i, first;
+  int fd, tmpfd;
+  struct stat buf;
+
+  if ((fd = open_locked(history_file, O_RDWR)) < 0)
+    return;
+  if (!(contents = read_all(fd, &size))) {
+    close(fd);
+    return;
+  }
+  for (line = contents; *line; nlines++) /* the last line may lack its newline, but it still counts */
+    line = (end = strchr(line, '\n')) ? end + 1 : line + strlen(line);
+  records = mymalloc((nlines + 1) * sizeof(char *));
+  for (i = 0, line = contents; i < nlines; i++) {
+    records[i] = line;
+    if ((end = strchr(line, '\n'))) {
+      *end = '\0';
+      line = end + 1;
+    }
+  }
+  first = max(0, nlines - (history_is_stifled() ? history_max_entries : nlines));
+  if (history_duplicate_avoidance_policy == ELIMINATE_ALL_DOUBLES)
+    forget_all_doubles(records + first, nlines - first);
+
+  tmpname = add2strings(history_file, ".tmp");
+  if ((tmpfd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0600)) >= 0) {
+    bool ok = TRUE;
+    char *previous = NULL;
+    for (i = first; i < nlines && ok; i++) {
+      if (!records[i] ||
+          (history_duplicate_avoidance_policy == ELIMINATE_SUCCESIVE_DOUBLES && previous && strcmp(previous, records[i]) == 0))
+        continue;
+      ok = write_all(tmpfd, records[i], strlen(records[i])) && write_all(tmpfd, "\n", 1);
+      previous = records[i];
+      nkept++;
+    }
+    if (fstat(fd, &buf) == 0)
+      fchmod(tmpfd, buf.st_mode & 07777);
+    ok = ok && fsync(tmpfd) == 0; /* make sure that the new file is on disk before it replaces the old one */
+    ok = (close(tmpfd) == 0) && ok;
+    if (ok && rename(tmpname, history_file) == 0) {
+      DPRINTF3(DEBUG_HISTORY, "compacted %s from %ld to %ld lines", history_file, nlines, nkept);
+      lines_in_file = nkept;
+      if (sharing && stat(history_file, &buf) == 0) { /* we have seen the new file already */
+        seen.device = buf.st_dev;
+        seen.inode = buf.st_ino;
+        seen.size = buf.st_size;
+      }
+    } else {
+      myerror(WARNING|USE_ERRNO, "could not compact history file %s", history_file);
+      unlink(tmpname);
+    }
+  } else {
+    myerror(WARNING|USE_ERRNO, "could not create %s", tmpname);
+  }
+  last_compaction = time(NULL);
+  close(fd); /* only now release the lock */
+  free_multiple(tmpname, records, contents, FMEND);
+}
+
+
+static bool
+time_to_compact(void)
+{
+  long histsize;
+
+  if (!history_is_stifled())
+    return FALSE; /* then we never forget anything anyway */
+  histsize = history_max_entries;
+  return lines_in_file > histsize &&
+    (lines_in_file >= 2 * max(histsize, 1) || time(NULL) - last_compaction >= COMPACTION_INTERVAL);
+}
+
+
+/* From now on, append all accepted lines to filename, which has nlines lines */
+void
+start_appending_history(const char *filename, long nlines)
+{
+  history_file = mysavestring(filename);
+  lines_in_file = nlines;
+  last_compaction = time(NULL);
+  DPRINTF2(DEBUG_HISTORY, "appending history to %s (%ld lines)", filename, nlines);
+}
+
+
+/* Like start_appending_history(), but also pick up the lines that other sessions append */
+void
+start_sharing_history(const char *filename, long nlines)
+{
+  struct stat buf;
+
+  start_appending_history(filename, nlines);
+  sharing = TRUE;
+  if (stat(filename, &buf) == 0) {
+    seen.device = buf.st_dev;
+    seen.inode = buf.st_ino;
+    seen.size = buf.st_size;
+  } else {
+    seen.size = 0;
+  }
+}
+
+
+bool
+appending_history(void)
+{
+  return history_file != NULL;
+}
+
+
+/* If we're sharing the history, add the lines that other sessions have appended to it since we last looked. This is
+   done whenever a (new) prompt is shown, unless the user is browsing the history, and before we append a line ourselves */
+void
+pick_up_shared_history(void)
+{
+  struct stat buf;
+  int fd;
+
+  if (!sharing || where_history() < history_length || stat(history_file, &buf) != 0)
+    return;
+  if (buf.st_ino == seen.inode && buf.st_dev == seen.device && buf.st_size == seen.size)
+    return; /* nothing new (this is the usual case, and the only one that has to be fast) */
+  if ((fd = open(history_file, O_RDONLY)) < 0)
+    return;
+  catch_up_with_history_file(fd);
+  close(fd);
+}
+
+
+void
+append_to_history_file(const char *line)
+{
+  char *record;
+  bool ok;
+  int fd;
+
+  if (!history_file)
+    return;
+  if ((fd = open_locked(history_file, O_RDWR | O_APPEND)) < 0) {
+    myerror(WARNING|USE_ERRNO, "cannot append to history file %s", history_file);
+    return;
+  }
+  if (sharing)
+    catch_up_with_history_file(fd); /* with what others have appended since we last looked */
+  record = add2strings(line, "\n");
+  ok = write_all(fd, record, strlen(record)); /* normally in one write(), and anyway while holding the lock */
+  if (ok && sharing)
+    remember_what_we_have_seen(fd, lseek(fd, 0, SEEK_END));
+  close(fd);
+  free(record);
+  if (!ok) {
+    myerror(WARNING|USE_ERRNO, "cannot append to history file %s", history_file);
+    return;
+  }
+  lines_in_file++;
+  if (time_to_compact())
+    compact_history_file();
+}
@@ -0,0 +1,230 @@
+/*  histindex.c: an index of history lines, for --history-no-dupes=2
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License , or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; see the file COPYING.  If not, write to
+    the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+
+    You may contact the author by:
+       e-mail:  hanslub42@gmail.com
+*/
+
+
+/* With -D 2 (ELIMINATE_ALL_DOUBLES) every accepted line used to be compared with every line in the history.
+   Instead, we keep a hash table that tells how often every line occurs in the history. Most accepted lines
+   are either new, or have been entered recently, so there is usually nothing to search at all, or only a
+   few entries at the end of the history.
+
+   readline keeps its history in an array, and remove_history() shifts all newer entries, so it is no use
+   to remember the positions of the lines: we only look for them (from the newest entry backwards) when the
+   index tells us they are there.
+
+   The index only follows the history through add_to_history(). If anything else changes the history (like
+   lazyload.c, or a filter that rewrites it) it notices that history_length or history_base have changed, and
+   rebuilds the index the next time it is needed. The same happens after forget_history_index()            */
+
+
+#include "rlwrap.h"
+
+#define MINIMUM_TABLE_SIZE 1024  /* must be a power of 2 */
+
+struct indexed_line {
+  char *line;                    /* NULL if this slot is empty */
+  unsigned long hash;
+  int count;                     /* how many history entries have this line */
+};
+
+static struct indexed_line *table = NULL;
+static unsigned long table_size = 0, nlines = 0;
+static int indexed_length = -1, indexed_base = -1;   /* history_length and history_base when the index was last in sync */
+
+
+static bool
+index_is_in_sync(void)
+{
+  return table && indexed_length == history_length && indexed_base == history_base;
+}
+
+
+static void
+note_history_is_in_sync(void)
+{
+  indexed_length = history_length;
+  indexed_base = history_base;
+}
+
+
+static void
+clear_table(void)
+{
+  unsigned long i;
+  for (i = 0; i < table_size; i++)
+    if (table[i].line)
+      free(table[i].line);
+  if (table)
+    free(table);
+  table = NULL;
+  table_size = nlines = 0;
+}
+
+
+/* the slot for line (with hash), which is empty if line is not in the table */
+static struct indexed_line *
+find_slot(const char *line, unsigned long hash)
+{
+  unsigned long i;
+  for (i = hash & (table_size - 1); table[i].line; i = (i + 1) & (table_size - 1))
+    if (table[i].hash == hash && strcmp(table[i].line, line) == 0)
+      break;
+  return &table[i];
+}
+
+
+static void
+grow_table(void)
+{
+  struct indexed_line *old_table = table;
+  unsigned long old_size = table_size, i;
+
+  table_size = old_size ? 2 * old_size : MINIMUM_TABLE_SIZE;
+  table = mymalloc(table_size * sizeof(struct indexed_line));
+  memset(table, 0, table_size * sizeof(struct indexed_line));
+  for (i = 0; i < old_size; i++)
+    if (old_table[i].line)
+      *find_slot(old_table[i].line, old_table[i].hash) = old_table[i];
+  if (old_table)
+    free(old_table);
+}
+
+
+static void
+count_line(const char *line)
+{
+  unsigned long hash = hash_multiple(1, line);
+  struct indexed_line *slot;
+
+  if (4 * (nlines + 1) > 3 * table_size)  /* keep the table at most 75% full */
+    grow_table();
+  slot = find_slot(line, hash);
+  if (!slot->line) {
+    slot->line = mysavestring(line);
+    slot->hash = hash;
+    slot->count = 0;
+    nlines++;
+  }
+  slot->count++;
+}
+
+
+/* Remove the slot at i, and move later slots of the same cluster back where they belong (so that we need no "tombstones") */
+static void
+empty_slot(unsigned long i)
+{
+  unsigned long j, home;
+
+  free(table[i].line);
+  table[i].line = NULL;
+  nlines--;
+  for (j = (i + 1) & (table_size - 1); table[j].line; j = (j + 1) & (table_size - 1)) {
+    home = table[j].hash & (table_size - 1);
+    if (((j - home) & (table_size - 1)) >= ((j - i) & (table_size - 1))) { /* slot j may move back to i */
+      table[i] = table[j];
+      table[j].line = NULL;
+      i = j;
+    }
+  }
+}
+
+
+static void
+uncount_line(const char *line, int how_often)
+{
+  struct indexed_line *slot = find_slot(line, hash_multiple(1, line));
+
+  if (!slot->line)
+    return;
+  if ((slot->count -= how_often) <= 0)
+    empty_slot(slot - table);
+}
+
+
+static void
+rebuild_index(void)
+{
+  int i;
+
+  clear_table();
+  grow_table();
+  for (i = 0; i < history_length; i++)
+    count_line(history_get(history_base + i)->line);
+  note_history_is_in_sync();
+  DPRINTF2(DEBUG_HISTORY, "indexed %d history entries (%lu different lines)", history_length, nlines);
+}
+
+
+void
+forget_history_index(void)
+{
+  clear_table();
+  indexed_length = indexed_base = -1;
+  forget_search_index();
+}
+
+
+/* add line to the history, keeping the index up to date if we have one */
+void
+add_to_history(const char *line)
+{
+  bool in_sync = index_is_in_sync(), searchable = search_index_is_in_sync();
+
+  if (in_sync && history_is_stifled() && history_length >= history_max_entries && history_length > 0)
+    uncount_line(history_get(history_base)->line, 1); /* add_history() is about to drop the oldest entry */
+  add_history(line);
+  if (in_sync) {
+    count_line(line);
+    note_history_is_in_sync();
+  }
+  if (searchable)
+    add_to_search_index(line);
+}
+
+
+/* remove all history entries that are equal to line, returning how many there were */
+int
+remove_from_history(const char *line)
+{
+  struct indexed_line *slot;
+  int to_remove, removed = 0, here;
+  bool searchable = search_index_is_in_sync();
+
+  if (!index_is_in_sync())
+    rebuild_index();
+  slot = find_slot(line, hash_multiple(1, line));
+  if (!slot->line)
+    return 0;
+  for (to_remove = slot->count, here = history_length - 1; here >= 0 && removed < to_remove; here--) {
+    if (strcmp(history_get(history_base + here)->line, line) == 0) { /* history_get uses the logical offset history_base .. */
+      HIST_ENTRY *entry = remove_history(here);                      /* .. but remove_history doesn't!                      */
+      DPRINTF2(DEBUG_HISTORY, "removing duplicate entry #%d (%s)", here, entry->line);
+      free_foreign(entry->line);
+      free_foreign(entry);
+      if (searchable)
+        remove_from_search_index(here);
+      removed++;
+    }
+  }
+  uncount_line(line, to_remove);
+  note_history_is_in_sync();
+  if (removed < to_remove) /* some entry has been changed behind our back (readline lets users edit history entries) */
+    forget_history_index();
+  return removed;
+}
@@ -0,0 +1,412 @@
+/*  histlog.c: a binary history log, with a timestamp, working directory and duration for every entry
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License , or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; see the file COPYING.  If not, write to
+    the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+
+    You may contact the author by:
+       e-mail:  hanslub42@gmail.com
+*/
+
+
+/* The history file is plain text, and read_history() parses all of it, even if we only keep the last
+   <histsize> lines. It also doesn't tell when, or where, a line was entered. With --binary-history (-B)
+   rlwrap keeps its history in <history file>.bin instead, an append-only log of records:
+
+     header  (struct history_log_header, 24 bytes)
+     record  (struct history_log_record, 32 bytes, followed by the command's working directory and the line
+              itself, both '\0'-terminated, padding up to a multiple of 8 bytes and (again) the record's size)
+     record
+     ...
+
+   As every record ends with its size, the log can be read backwards: at startup we mmap() it and walk back
+   from the end until we have <histsize> entries, never looking at the (possibly much larger) rest of it.
+
+   Every accepted line is appended as a record straight away, while holding a (fcntl()) lock on the log, so that
+   concurrent sessions can share it. Its duration (the time until the command prints its next prompt) is only
+   known later, and then written into the record in place.
+
+   The first time -B is used, the plain history file is read, and its lines become the first records of the log
+   (without timestamp, working directory or duration). From then on, the plain history file is left alone.
+
+   A damaged record (the log may have been tampered with) is skipped: walking back, we resync at the next complete
+   record before it. Only an incomplete last record (we crashed while writing it) is cut off.
+
+   The log is never compacted: it grows by a record for every accepted line, until the user removes it.
+
+   Like with compiled completion lists (see wordindex.c) the format is "native"                                   */
+
+
+#include "rlwrap.h"
+#include <stddef.h>
+#include <limits.h>
+
+#define LOG_SUFFIX ".bin"
+#define HISTORY_LOG_MAGIC "rlwrap histlog\n"  /* 15 chars + '\0' */
+#define HISTORY_LOG_VERSION 1
+#define BYTE_ORDER_MARK 0x01020304
+#define RECORD_ALIGNMENT 8
+
+struct history_log_header {
+  char     magic[16];
+  uint32_t version;
+  uint32_t byte_order;
+};
+
+struct history_log_record {
+  uint32_t size;           /* of the whole record, including the size at its end */
+  int32_t  duration;       /* msecs between accepting the line and the next prompt, -1 if unknown */
+  int64_t  timestamp;      /* when the line was accepted (seconds since the epoch), 0 if unknown */
+  uint64_t session;        /* the same for all entries from one rlwrap session, 0 if unknown */
+  uint32_t cwd_length;     /* length of the working directory (without the '\0' that follows it) */
+  uint32_t line_length;    /* length of the line  */
+};
+
+static char *log_name = NULL;
+static int log_fd = -1;                 /* -1 unless we're logging */
+static uint64_t session;
+static off_t unfinished_record = -1;    /* where the last record that still waits for its duration is */
+static struct timeval accepted_at;
+
+
+static bool
+write_all(int fd, const char *buffer, size_t count)
+{
+  ssize_t nwritten;
+
+  while (count > 0) {
+    if ((nwritten = write(fd, buffer, count)) < 0) {
+      if (errno == EINTR)
+        continue;
+      return FALSE;
+    }
+    buffer += nwritten;
+    count -= nwritten;
+  }
+  return TRUE;
+}
+
+
+static bool
+lock_log(int type)
+{
+  struct flock lock;
+
+  memset(&lock, 0, sizeof(lock));
+  lock.l_type = type;
+  lock.l_whence = SEEK_SET;     /* l_start = l_len = 0: the whole file */
+  while (fcntl(log_fd, F_SETLKW, &lock) < 0)
+    if (errno != EINTR)
+      return FALSE;
+  return TRUE;
+}
+
+
+/* Append a record for line to the log (which the caller should have locked). Returns the offset of the record, or -1
+   if it couldn't be written */
+static off_t
+append_record(const char *line, int64_t timestamp, const char *cwd, int32_t duration)
+{
+  struct history_log_record record;
+  size_t unpadded, size;
+  char *buffer;
+  off_t offset;
+
+  record.cwd_length  = strlen(cwd);
+  record.line_length = strlen(line);
+  unpadded = sizeof(record) + record.cwd_length + 1 + record.line_length + 1 + sizeof(uint32_t);
+  size = (unpadded + RECORD_ALIGNMENT - 1) / RECORD_ALIGNMENT * RECORD_ALIGNMENT;
+  record.size      = size;
+  record.duration  = duration;
+  record.timestamp = timestamp;
+  record.session   = timestamp ? session : 0;
+  buffer = mymalloc(size);
+  memset(buffer, 0, size);
+  memcpy(buffer, &record, sizeof(record));
+  memcpy(buffer + sizeof(record), cwd, record.cwd_length);
+  memcpy(buffer + sizeof(record) + record.cwd_length + 1, line, record.line_length);
+  memcpy(buffer + size - sizeof(uint32_t), &record.size, sizeof(uint32_t));
+  if ((offset = lseek(log_fd, 0, SEEK_END)) < 0 || !write_all(log_fd, buffer, size))
+    offset = -1;
+  free(buffer);
+  return offset;
+}
+
+
+/* the record at offset in contents (which has size bytes), or NULL if there isn't a complete one */
+static const struct history_log_record *
+record_at(const char *contents, size_t size, size_t offset)
+{
+  const struct history_log_record *record = (const struct history_log_record *) (contents + offset);
+  uint32_t trailing_size;
+
+  if (offset % RECORD_ALIGNMENT || offset + sizeof(*record) > size ||
+      record->size < sizeof(*record) + 2 + sizeof(uint32_t) || record->size % RECORD_ALIGNMENT || record->size > size - offset ||
+      sizeof(*record) + (uint64_t) record->cwd_length + record->line_length + 2 + sizeof(uint32_t) > record->size)
+    return NULL;
+  memcpy(&trailing_size, contents + offset + record->size - sizeof(uint32_t), sizeof(uint32_t));
+  if (trailing_size != record->size || contents[offset + sizeof(*record) + record->cwd_length] ||
+      contents[offset + sizeof(*record) + record->cwd_length + 1 + record->line_length])
+    return NULL;
+  return record;
+}
+
+
+static const char *
+line_of(const struct history_log_record *record)
+{
+  return (const char *) record + sizeof(*record) + record->cwd_length + 1;
+}
+
+
+/* a set of lines (for -D 2: only the newest of equal lines in the log should make it into the history) */
+struct line_set {
+  const char **members;
+  unsigned long size;
+};
+
+
+static bool
+add_to_set(struct line_set *set, const char *line)
+{
+  unsigned long i;
+
+  for (i = hash_multiple(1, line) & (set->size - 1); set->members[i]; i = (i + 1) & (set->size - 1))
+    if (strcmp(set->members[i], line) == 0)
+      return FALSE;
+  set->members[i] = line;
+  return TRUE;
+}
+
+
+/* The end of the last complete record that ends at or before end, or the end of the header if there is none. This is
+   where we resume after a damaged record (or after a torn last one, if we crashed while writing it)                 */
+static size_t
+resync_backwards(const char *contents, size_t end)
+{
+  const struct history_log_record *record;
+  size_t offset;
+
+  for (offset = (end - sizeof(uint32_t)) / RECORD_ALIGNMENT * RECORD_ALIGNMENT; offset >= sizeof(struct history_log_header); offset -= RECORD_ALIGNMENT)
+    if ((record = record_at(contents, end, offset)))
+      return offset + record->size;
+  return sizeof(struct history_log_header);
+}
+
+
+/* Walk back from the end of the log, and collect (the offsets of) the records that the history should get. Returns
+   their number. Damaged records are skipped, but if the very last one is incomplete *ptorn_end is set to where it
+   starts (otherwise it is left alone)                                                                              */
+static long
+collect_records_backwards(const char *contents, size_t size, size_t *offsets, long wanted, size_t *ptorn_end)
+{
+  struct line_set seen = { NULL, 0 };
+  const char *newer_line = NULL;
+  size_t end = size;
+  long count = 0;
+
+  if (history_duplicate_avoidance_policy == ELIMINATE_ALL_DOUBLES) {
+    for (seen.size = 1024; seen.size < 2 * (unsigned long) wanted; seen.size *= 2)
+      ;
+    seen.members = mymalloc(seen.size * sizeof(char *));
+    memset(seen.members, 0, seen.size * sizeof(char *));
+  }
+  while (end > sizeof(struct history_log_header) && count < wanted) {
+    const struct history_log_record *record;
+    uint32_t record_size;
+    const char *line;
+
+    memcpy(&record_size, contents + end - sizeof(uint32_t), sizeof(uint32_t));
+    if (record_size > end - sizeof(struct history_log_header) || !(record = record_at(contents, end, end - record_size))) {
+      size_t good_end = resync_backwards(contents, end);
+      if (end == size)
+        *ptorn_end = good_end;
+      else
+        myerror(WARNING|NOERRNO, "%s is damaged between %ld and %ld bytes, skipping that part", log_name, (long) good_end, (long) end);
+      end = good_end;
+      continue;
+    }
+    end -= record_size;
+    line = line_of(record);
+    if (history_duplicate_avoidance_policy == ELIMINATE_SUCCESIVE_DOUBLES && newer_line && strcmp(line, newer_line) == 0)
+      continue;
+    if (seen.members && !add_to_set(&seen, line))
+      continue;
+    offsets[count++] = end;
+    newer_line = line;
+  }
+  if (seen.members)
+    free(seen.members);
+  return count;
+}
+
+
+static void
+map_log(int fd, char **pcontents, size_t *psize)
+{
+  struct stat buf;
+
+  *pcontents = NULL;
+  if (fstat(fd, &buf) || buf.st_size == 0)
+    return;
+  *psize = buf.st_size;
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+  *pcontents = mmap(NULL, *psize, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (*pcontents == MAP_FAILED)
+    *pcontents = NULL;
+#else
+  *pcontents = mymalloc(*psize);
+  if (pread(fd, *pcontents, *psize, 0) != (ssize_t) *psize) {
+    free(*pcontents);
+    *pcontents = NULL;
+  }
+#endif
+}
+
+
+static void
+unmap_log(char *contents, size_t size)
+{
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+  munmap(contents, size);
+#else
+  MAYBE_UNUSED(size);
+  free(contents);
+#endif
+}
+
+
+/* read the last <histsize> entries from the log into the history. Returns FALSE if fd is not a history log at all */
+static bool
+read_log(int fd, bool writable)
+{
+  const struct history_log_header *header;
+  char *contents;
+  size_t size, *offsets, torn_end = 0;
+  long wanted = history_is_stifled() ? history_max_entries : LONG_MAX, count, i;
+  bool locked = lock_log(writable ? F_WRLCK : F_RDLCK); /* don't read a record that another session is still writing */
+
+  if (!locked) /* e.g. on a file system that doesn't do locking. A record that is being written will look incomplete */
+    myerror(WARNING|USE_ERRNO, "cannot lock %s, reading it anyway", log_name);
+  map_log(fd, &contents, &size);
+  if (!contents) {
+    lock_log(F_UNLCK);
+    return FALSE;
+  }
+  header = (const struct history_log_header *) contents;
+  if (size < sizeof(*header) || strncmp(header->magic, HISTORY_LOG_MAGIC, sizeof(header->magic)) ||
+      header->version != HISTORY_LOG_VERSION || header->byte_order != BYTE_ORDER_MARK) {
+    unmap_log(contents, size);
+    lock_log(F_UNLCK);
+    return FALSE;
+  }
+  wanted = min(wanted, (long) (size / sizeof(struct history_log_record))); /* there cannot be more records than that */
+  offsets = mymalloc((wanted + 1) * sizeof(size_t));
+  count = collect_records_backwards(contents, size, offsets, wanted, &torn_end);
+  if (torn_end) { /* we crashed while writing the last record. Cut it off, so that new records can be found again */
+    myerror(WARNING|NOERRNO, "%s ends in an incomplete record after %ld bytes, %s", log_name, (long) torn_end,
+            writable && locked ? "cutting it off" : "ignoring it");
+    if (writable && locked && ftruncate(fd, torn_end)) /* without the lock, another session may still be writing it */
+      myerror(WARNING|USE_ERRNO, "could not truncate %s", log_name);
+  }
+  lock_log(F_UNLCK);
+  for (i = count - 1; i >= 0; i--)
+    add_history(line_of((const struct history_log_record *) (contents + offsets[i])));
+  DPRINTF3(DEBUG_HISTORY, "read %ld entries from the last %ld bytes of %s", count,
+           (long) (size - (count > 0 ? offsets[count - 1] : size)), log_name);
+  free(offsets);
+  unmap_log(contents, size);
+  return TRUE;
+}
+
+
+/* Read the last <histsize> entries of the log for history_file (or, if it doesn't exist yet, history_file itself, which
+   then becomes the start of the log). If writable, log every accepted line from now on                          */
+void
+start_history_log(const char *history_file, bool writable)
+{
+  struct stat buf;
+  bool is_new;
+  int i;
+
+  log_name = add2strings(history_file, LOG_SUFFIX);
+  session = ((uint64_t) time(NULL) << 32) | (uint32_t) getpid();
+  is_new = stat(log_name, &buf) != 0 || buf.st_size == 0;
+  if ((log_fd = open(log_name, (writable ? O_RDWR | O_CREAT : O_RDONLY), 0600)) < 0) {
+    if (writable || errno != ENOENT)
+      myerror(WARNING|USE_ERRNO, "cannot open history log %s", log_name);
+  } else if (!is_new && !read_log(log_fd, writable)) {
+    myerror(FATAL|NOERRNO, "%s is not an rlwrap history log (or written by an incompatible rlwrap)", log_name);
+  }
+  if (is_new) {
+    read_history(history_file); /* ignore errors: history_file may not exist either */
+    if (log_fd >= 0 && writable && lock_log(F_WRLCK)) {
+      if (lseek(log_fd, 0, SEEK_END) == 0) {  /* another session may have beaten us to it */
+        struct history_log_header header;
+        memset(&header, 0, sizeof(header));
+        strncpy(header.magic, HISTORY_LOG_MAGIC, sizeof(header.magic));
+        header.version = HISTORY_LOG_VERSION;
+        header.byte_order = BYTE_ORDER_MARK;
+        write_all(log_fd, (char *) &header, sizeof(header));
+        for (i = 0; i < history_length; i++)
+          append_record(history_get(history_base + i)->line, 0, "", -1);
+        DPRINTF2(DEBUG_HISTORY, "started history log %s with %d entries", log_name, history_length);
+      }
+      lock_log(F_UNLCK);
+    }
+  }
+  using_history();
+  if (log_fd >= 0 && !writable) {
+    close(log_fd);
+    log_fd = -1;
+  }
+}
+
+
+void
+log_history_entry(const char *line)
+{
+  char *cwd;
+
+  if (log_fd < 0)
+    return;
+  log_duration_until_prompt(); /* if a previous line (e.g. of a multi-line paste) is still waiting for it, it won't get it */
+  cwd = command_working_directory();
+  gettimeofday(&accepted_at, NULL);
+  unfinished_record = -1;
+  if (lock_log(F_WRLCK)) {
+    unfinished_record = append_record(line, accepted_at.tv_sec, cwd ? cwd : "", -1);
+    lock_log(F_UNLCK);
+  }
+  if (unfinished_record < 0)
+    myerror(WARNING|USE_ERRNO, "could not append to history log %s", log_name);
+  if (cwd)
+    free(cwd);
+}
+
+
+/* A new prompt has appeared: if the last logged line is still waiting for its duration, write it into its record */
+void
+log_duration_until_prompt(void)
+{
+  struct timeval now;
+  int32_t duration;
+
+  if (log_fd < 0 || unfinished_record < 0)
+    return;
+  gettimeofday(&now, NULL);
+  duration = 1000L * (now.tv_sec - accepted_at.tv_sec) + (now.tv_usec - accepted_at.tv_usec) / 1000;
+  if (pwrite(log_fd, &duration, sizeof(duration), unfinished_record + offsetof(struct history_log_record, duration)) != sizeof(duration))
+    DPRINTF2(DEBUG_HISTORY, "could not write duration into %s: %s", log_name, strerror(errno));
+  unfinished_record = -1;
+}
@@ -0,0 +1,295 @@
+/*  histsearch.c: a trigram index of the history, for rlwrap-search-history
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License , or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; see the file COPYING.  If not, write to
+    the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+
+    You may contact the author by:
+       e-mail:  hanslub42@gmail.com
+*/
+
+
+/* readline's reverse-i-search compares the search string with every history entry, from the newest backwards.
+   With a history of a million lines, a search for something rare can take a noticeable time, on every keystroke.
+
+   Here we keep, for every trigram (three consecutive bytes) that occurs in the history, a list of the entries
+   that contain it. Any entry that contains a search string of three or more bytes has to be on the list of
+   each of the search string's trigrams, so we only need to look at the entries on the shortest of these lists.
+
+   As remove_history() shifts all newer entries, the lists don't contain positions in the history. Instead,
+   every entry gets a serial number when it is indexed. Those only ever increase, so serials[] (the serial numbers
+   of the history entries, oldest first) is sorted, and a binary search finds where (or whether) an entry still is.
+   Entries that have disappeared from the history are left on the lists until there are so many of them that it
+   is worthwhile to rebuild the index.
+
+   The index is only built when the search is first used. Like histindex.c, it follows the history through
+   add_to_history() and remove_from_history(), and is rebuilt when anything else has changed the history.
+   Entries that are edited in place (readline lets users do that) may then be missed, but never mis-reported,
+   as every candidate is checked against the real entry                                                         */
+
+
+#include "rlwrap.h"
+
+#define MINIMUM_TABLE_SIZE 4096 /* must be a power of 2 */
+
+struct posting_list {
+  uint32_t trigram;
+  uint32_t *serials;            /* serial numbers of the entries that contain trigram, ascending (NULL if this slot is empty) */
+  int count, allocated;
+};
+
+static struct posting_list *table = NULL;
+static unsigned long table_size = 0, ntrigrams = 0;
+
+static uint32_t *serials = NULL;    /* serials[first + i] is the serial number of history entry i */
+static int first = 0, nserials = 0, serials_allocated = 0;
+static uint32_t next_serial = 0;
+static int dropped = 0;             /* number of entries that have left the history since the index was built */
+static int indexed_length = -1, indexed_base = -1;
+
+
+bool
+search_index_is_in_sync(void)
+{
+  return table && indexed_length == history_length && indexed_base == history_base;
+}
+
+
+static void
+note_search_index_is_in_sync(void)
+{
+  indexed_length = history_length;
+  indexed_base = history_base;
+}
+
+
+static inline uint32_t
+trigram_at(const char *p)
+{
+  return ((uint32_t) (unsigned char) p[0] << 16) | ((uint32_t) (unsigned char) p[1] << 8) | (unsigned char) p[2];
+}
+
+
+static inline unsigned long
+home_slot(uint32_t trigram)
+{
+  return (trigram * 2654435761U) & (table_size - 1); /* Knuth's multiplicative hash */
+}
+
+
+static struct posting_list *
+find_list(uint32_t trigram)
+{
+  unsigned long i;
+  for (i = home_slot(trigram); table[i].serials; i = (i + 1) & (table_size - 1))
+    if (table[i].trigram == trigram)
+      break;
+  return &table[i];
+}
+
+
+static void
+grow_table(void)
+{
+  struct posting_list *old_table = table;
+  unsigned long old_size = table_size, i;
+
+  table_size = old_size ? 2 * old_size : MINIMUM_TABLE_SIZE;
+  table = mymalloc(table_size * sizeof(struct posting_list));
+  memset(table, 0, table_size * sizeof(struct posting_list));
+  for (i = 0; i < old_size; i++)
+    if (old_table[i].serials)
+      *find_list(old_table[i].trigram) = old_table[i];
+  if (old_table)
+    free(old_table);
+}
+
+
+static void
+add_posting(uint32_t trigram, uint32_t serial)
+{
+  struct posting_list *list;
+
+  if (4 * (ntrigrams + 1) > 3 * table_size)
+    grow_table();
+  list = find_list(trigram);
+  if (!list->serials) {
+    list->trigram = trigram;
+    list->allocated = 4;
+    list->count = 0;
+    list->serials = mymalloc(list->allocated * sizeof(uint32_t));
+    ntrigrams++;
+  } else if (list->serials[list->count - 1] == serial) { /* trigram occurs more than once in the same entry */
+    return;
+  } else if (list->count >= list->allocated) {
+    list->serials = myrealloc(list->serials, list->allocated * sizeof(uint32_t), 2 * list->allocated * sizeof(uint32_t));
+    list->allocated *= 2;
+  }
+  list->serials[list->count++] = serial;
+}
+
+
+static void
+index_entry(const char *line)
+{
+  const char *p;
+  uint32_t serial = next_serial++;
+
+  if (first + nserials >= serials_allocated) {
+    if (first > 0) {
+      memmove(serials, serials + first, nserials * sizeof(uint32_t));
+      first = 0;
+    }
+    if (nserials >= serials_allocated) {
+      int new_allocated = max(2 * serials_allocated, 1024);
+      serials = myrealloc(serials, serials_allocated * sizeof(uint32_t), new_allocated * sizeof(uint32_t));
+      serials_allocated = new_allocated;
+    }
+  }
+  serials[first + nserials++] = serial;
+  for (p = line; p[0] && p[1] && p[2]; p++)
+    add_posting(trigram_at(p), serial);
+}
+
+
+void
+forget_search_index(void)
+{
+  unsigned long i;
+
+  for (i = 0; i < table_size; i++)
+    if (table[i].serials)
+      free(table[i].serials);
+  if (table)
+    free(table);
+  table = NULL;
+  table_size = ntrigrams = 0;
+  first = nserials = dropped = 0;
+  next_serial = 0;
+  indexed_length = indexed_base = -1;
+}
+
+
+static void
+build_search_index(void)
+{
+  struct timeval start, now;
+  int i;
+
+  gettimeofday(&start, NULL);
+  forget_search_index();
+  grow_table();
+  for (i = 0; i < history_length; i++)
+    index_entry(history_get(history_base + i)->line);
+  note_search_index_is_in_sync();
+  gettimeofday(&now, NULL);
+  DPRINTF3(DEBUG_HISTORY, "indexed %d history entries (%lu different trigrams) in %ld msec", history_length, ntrigrams,
+           1000L * (now.tv_sec - start.tv_sec) + (now.tv_usec - start.tv_usec) / 1000);
+}
+
+
+/* line has just been added to the history by add_to_history() (which may have made the oldest entry fall off) */
+void
+add_to_search_index(const char *line)
+{
+  int gone = history_base - indexed_base;
+
+  if (!table)
+    return;
+  gone = min(gone, nserials);
+  first += gone;
+  nserials -= gone;
+  dropped += gone;
+  index_entry(line);
+  note_search_index_is_in_sync();
+}
+
+
+/* history entry #which (counting from 0, like remove_history()) has just been removed by remove_from_history() */
+void
+remove_from_search_index(int which)
+{
+  if (!table || which < 0 || which >= nserials)
+    return;
+  memmove(serials + first + which, serials + first + which + 1, (nserials - which - 1) * sizeof(uint32_t));
+  nserials--;
+  dropped++;
+  note_search_index_is_in_sync();
+}
+
+
+/* where the entry with serial number serial is in the history now, or -1 if it has gone */
+static int
+entry_with_serial(uint32_t serial)
+{
+  int low = 0, high = nserials;
+  while (low < high) {
+    int middle = low + (high - low) / 2;
+    if (serials[first + middle] < serial)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  return (low < nserials && serials[first + low] == serial) ? low : -1;
+}
+
+
+static bool
+entry_contains(int which, const char *text)
+{
+  return strstr(history_get(history_base + which)->line, text) != NULL;
+}
+
+
+/* The newest history entry before entry #before (counting from 0, and history_length means: from the newest
+   entry) that contains text, or -1 if there is none */
+int
+search_history_for(const char *text, int before)
+{
+  struct posting_list *shortest = NULL;
+  uint32_t below;
+  const char *p;
+  int i, low, high;
+
+  before = min(before, history_length);
+  if (strlen(text) < 3) { /* no trigram to go by, but short strings will usually be found soon enough */
+    for (i = before - 1; i >= 0; i--)
+      if (entry_contains(i, text))
+        return i;
+    return -1;
+  }
+  if (!search_index_is_in_sync() || (dropped > 1000 && dropped > history_length))
+    build_search_index();
+  for (p = text; p[2]; p++) {
+    struct posting_list *list = find_list(trigram_at(p));
+    if (!list->serials)
+      return -1;           /* no entry contains this trigram */
+    if (!shortest || list->count < shortest->count)
+      shortest = list;
+  }
+  below = before < nserials ? serials[first + before] : next_serial;
+  for (low = 0, high = shortest->count; low < high; ) { /* find the first candidate that is not older than entry #before */
+    int middle = low + (high - low) / 2;
+    if (shortest->serials[middle] < below)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  DPRINTF3(DEBUG_HISTORY, "searching for <%s>: at most %d of %d candidates", text, low, shortest->count);
+  for (i = low - 1; i >= 0; i--) {
+    int which = entry_with_serial(shortest->serials[i]);
+    if (which >= 0 && entry_contains(which, text))
+      return which;
+  }
+  return -1;
+}
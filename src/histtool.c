@@ -0,0 +1,354 @@
+/*  histtool.c: rlwrap --history-tool dedupe|trim|merge file ...
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License , or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; see the file COPYING.  If not, write to
+    the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+
+    You may contact the author by:
+       e-mail:  hanslub42@gmail.com
+*/
+
+
+/* Maintenance of history files, without starting a command:
+
+     rlwrap [-D n] [-z filter] --history-tool dedupe file ...  removes duplicates (according to -D) from every file
+     rlwrap [-D n] [-z filter] [-s N] --history-tool trim file ... does the same, and then keeps only the last N entries
+     rlwrap [-D n] [-z filter] --history-tool merge file1 file2 ... merges all files (by timestamp) into file1 (which
+                                                                     is created if necessary), and removes duplicates
+
+   Every line is passed through the filter (as TAG_HISTORY, just like my_add_history() does) and dropped if the
+   filter returns an empty line.
+
+   Files are never read into memory as a whole:
+    1. the (merged and filtered) entries are copied to a temporary file. For -D 2 we remember, for every different
+       entry, only its fingerprint (a 64-bit hash and its length) and where it occurs last
+    2. the temporary file is read again, and the entries that should be kept are written to <file>.tmp, which is
+       then renamed to <file>. An entry whose fingerprint occurs later is only dropped after comparing it with that
+       later entry, so that a hash collision can never make us lose a line (it may only make -D 2 keep a duplicate,
+       and trim keep an entry too many).
+   All the while, we hold the same lock on <file> as --append-history and --share-history (cf. histfile.c), so
+   that we won't lose lines that running rlwrap sessions append to it.
+
+   A file may contain timestamps (lines like "#1700000000", as written by readline when history_write_timestamps
+   is set). These stay with the entries that they precede, and are what merge uses to sort the entries. An entry
+   without a timestamp gets the timestamp of the entry before it in the same file (or 0)                         */
+
+
+#include "rlwrap.h"
+
+struct entry {
+  char *timestamp_line;   /* NULL if the entry didn't have one */
+  long timestamp;
+  char *line;
+};
+
+struct history_stream {
+  const char *filename;
+  FILE *fp;
+  struct entry next;       /* the next entry (for merging) */
+  bool at_end;
+};
+
+struct fingerprint {
+  uint64_t hash;           /* 0: empty slot */
+  size_t length;
+  long last;               /* the number of the last entry with this fingerprint ... */
+  long last_offset;        /* ... and where it starts in the temporary file */
+};
+
+static struct fingerprint *fingerprints = NULL;
+static unsigned long nfingerprints = 0, fingerprints_size = 0;
+
+
+static bool
+is_timestamp_line(const char *line)
+{
+  const char *p;
+
+  if (*line != '#' || !line[1])
+    return FALSE;
+  for (p = line + 1; *p; p++)
+    if (!isdigit((unsigned char) *p))
+      return FALSE;
+  return TRUE;
+}
+
+
+static void
+forget_entry(struct entry *entry)
+{
+  if (entry->timestamp_line)
+    free(entry->timestamp_line);
+  if (entry->line)
+    free(entry->line);
+  entry->timestamp_line = entry->line = NULL;
+}
+
+
+/* read the next entry from fp into entry. Entries without a timestamp keep entry->timestamp. Returns FALSE at EOF */
+static bool
+read_entry(FILE *fp, struct entry *entry)
+{
+  char *line;
+
+  forget_entry(entry);
+  while ((line = read_line(fp))) {
+    if (!is_timestamp_line(line)) {
+      entry->line = line;
+      return TRUE;
+    }
+    if (entry->timestamp_line)
+      free(entry->timestamp_line);
+    entry->timestamp_line = line;
+    entry->timestamp = atol(line + 1);
+  }
+  return FALSE;
+}
+
+
+static bool
+write_entry(FILE *fp, const struct entry *entry)
+{
+  if (entry->timestamp_line && fprintf(fp, "%s\n", entry->timestamp_line) < 0)
+    return FALSE;
+  return fprintf(fp, "%s\n", entry->line) >= 0;
+}
+
+
+static uint64_t
+hash_line(const char *line)
+{
+  uint64_t hash = 14695981039346656037ULL; /* FNV-1a */
+
+  for (; *line; line++)
+    hash = (hash ^ (unsigned char) *line) * 1099511628211ULL;
+  return hash ? hash : 1;
+}
+
+
+static struct fingerprint *
+find_fingerprint(uint64_t hash, size_t length)
+{
+  unsigned long i;
+  for (i = hash & (fingerprints_size - 1); fingerprints[i].hash; i = (i + 1) & (fingerprints_size - 1))
+    if (fingerprints[i].hash == hash && fingerprints[i].length == length)
+      break;
+  return &fingerprints[i];
+}
+
+
+/* remember that entry #number (at offset in the temporary file) is line. Returns the fingerprint (so that we can see
+   whether #number is its last occurrence) */
+static struct fingerprint *
+take_fingerprint(const char *line, long number, long offset)
+{
+  struct fingerprint *fingerprint;
+  uint64_t hash = hash_line(line);
+  size_t length = strlen(line);
+
+  if (4 * (nfingerprints + 1) > 3 * fingerprints_size) {
+    struct fingerprint *old = fingerprints;
+    unsigned long old_size = fingerprints_size, i;
+    fingerprints_size = old_size ? 2 * old_size : 1024;
+    fingerprints = mymalloc(fingerprints_size * sizeof(struct fingerprint));
+    memset(fingerprints, 0, fingerprints_size * sizeof(struct fingerprint));
+    for (i = 0; i < old_size; i++)
+      if (old[i].hash)
+        *find_fingerprint(old[i].hash, old[i].length) = old[i];
+    if (old)
+      free(old);
+  }
+  fingerprint = find_fingerprint(hash, length);
+  if (!fingerprint->hash) {
+    fingerprint->hash = hash;
+    fingerprint->length = length;
+    nfingerprints++;
+  }
+  if (number >= 0) {
+    fingerprint->last = number;
+    fingerprint->last_offset = offset;
+  }
+  return fingerprint;
+}
+
+
+/* the stream (of those that haven't ended) whose next entry is the oldest, or NULL if all have ended */
+static struct history_stream *
+oldest_stream(struct history_stream *streams, int nstreams)
+{
+  struct history_stream *oldest = NULL;
+  int i;
+
+  for (i = 0; i < nstreams; i++)
+    if (!streams[i].at_end && (!oldest || streams[i].next.timestamp < oldest->next.timestamp)) /* on ties, earlier files go first */
+      oldest = &streams[i];
+  return oldest;
+}
+
+
+/* Step 1: copy the entries of all files (in the order of their timestamps), passed through the filter and without
+   successive duplicates (with -D 1), to a temporary file. Returns that file, and the number of entries in it */
+static FILE *
+gather_entries(const char **filenames, int nfiles, long *pcount)
+{
+  struct history_stream *streams = mymalloc(nfiles * sizeof(struct history_stream));
+  struct history_stream *stream;
+  char *previous = NULL;
+  FILE *gathered = tmpfile();
+  long count = 0;
+  int i;
+
+  if (!gathered)
+    myerror(FATAL|USE_ERRNO, "cannot create temporary file");
+  for (i = 0; i < nfiles; i++) {
+    stream = &streams[i];
+    memset(stream, 0, sizeof(*stream));
+    stream->filename = filenames[i];
+    if (!(stream->fp = fopen(filenames[i], "r")))
+      myerror(FATAL|USE_ERRNO, "cannot read %s", filenames[i]);
+    if ((stream->at_end = !read_entry(stream->fp, &stream->next)))
+      fclose(stream->fp);
+  }
+  while ((stream = oldest_stream(streams, nfiles))) {
+    struct entry *entry = &stream->next;
+    char *filtered = pass_through_filter(TAG_HISTORY, entry->line);
+    if (*filtered && !(history_duplicate_avoidance_policy == ELIMINATE_SUCCESIVE_DOUBLES && previous && strcmp(previous, filtered) == 0)) {
+      long offset = ftell(gathered);
+      free(entry->line);
+      entry->line = filtered;
+      if (offset < 0 || !write_entry(gathered, entry))
+        myerror(FATAL|USE_ERRNO, "cannot write temporary file");
+      if (history_duplicate_avoidance_policy == ELIMINATE_ALL_DOUBLES)
+        take_fingerprint(filtered, count, offset);
+      if (previous)
+        free(previous);
+      previous = mysavestring(filtered);
+      count++;
+    } else {
+      free(filtered);
+    }
+    if ((stream->at_end = !read_entry(stream->fp, entry)))
+      fclose(stream->fp);
+  }
+  if (previous)
+    free(previous);
+  free(streams);
+  fflush(gathered);
+  rewind(gathered);
+  *pcount = count;
+  return gathered;
+}
+
+
+/* whether the entry at offset in gathered is line (as fingerprints may collide). Leaves gathered where it was */
+static bool
+entry_at_offset_is(FILE *gathered, long offset, const char *line)
+{
+  struct entry other = { NULL, 0, NULL };
+  long here = ftell(gathered);
+  bool same;
+
+  if (here < 0 || fseek(gathered, offset, SEEK_SET))
+    myerror(FATAL|USE_ERRNO, "cannot seek in temporary file");
+  same = read_entry(gathered, &other) && strcmp(other.line, line) == 0;
+  forget_entry(&other);
+  if (fseek(gathered, here, SEEK_SET))
+    myerror(FATAL|USE_ERRNO, "cannot seek in temporary file");
+  return same;
+}
+
+
+/* Step 2: write the last keep (or, if keep < 0, all) entries from gathered that survive -D 2 to target */
+static long
+write_survivors(FILE *gathered, long count, long keep, const char *target, int locked_fd)
+{
+  struct entry entry = { NULL, 0, NULL };
+  struct fingerprint *fingerprint;
+  char *tmpname = add2strings(target, ".tmp");
+  long nsurvivors = history_duplicate_avoidance_policy == ELIMINATE_ALL_DOUBLES ? (long) nfingerprints : count;
+  long skip = (keep >= 0 && nsurvivors > keep) ? nsurvivors - keep : 0, number, written = 0;
+  struct stat buf;
+  bool ok = TRUE;
+  FILE *out;
+  int tmpfd;
+
+  if ((tmpfd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0 || !(out = fdopen(tmpfd, "w")))
+    myerror(FATAL|USE_ERRNO, "cannot create %s", tmpname);
+  if (fstat(locked_fd, &buf) == 0)
+    fchmod(tmpfd, buf.st_mode & 07777);
+  for (number = 0; ok && read_entry(gathered, &entry); number++) {
+    if (history_duplicate_avoidance_policy == ELIMINATE_ALL_DOUBLES &&
+        (fingerprint = take_fingerprint(entry.line, -1, -1))->last != number &&
+        entry_at_offset_is(gathered, fingerprint->last_offset, entry.line))
+      continue;             /* a later entry is the same */
+    if (skip > 0) {
+      skip--;
+      continue;
+    }
+    ok = write_entry(out, &entry);
+    written++;
+  }
+  forget_entry(&entry);
+  ok = fflush(out) == 0 && fsync(tmpfd) == 0 && ok;
+  ok = fclose(out) == 0 && ok;
+  if (!ok || rename(tmpname, target)) {
+    unlink(tmpname);
+    myerror(FATAL|USE_ERRNO, "could not write %s", target);
+  }
+  free(tmpname);
+  return written;
+}
+
+
+static void
+rewrite_history(const char **filenames, int nfiles, long keep)
+{
+  const char *target = filenames[0];
+  long count, written;
+  FILE *gathered;
+  int fd;
+
+  if ((fd = open_locked(target, O_RDWR)) < 0)
+    myerror(FATAL|USE_ERRNO, "cannot open and lock %s", target);
+  gathered = gather_entries(filenames, nfiles, &count);
+  written = write_survivors(gathered, count, keep, target, fd);
+  fclose(gathered);
+  close(fd); /* only now release the lock */
+  printf("%s: %ld entries\n", target, written);
+  if (fingerprints)
+    free(fingerprints);
+  fingerprints = NULL;
+  nfingerprints = fingerprints_size = 0;
+}
+
+
+/* rlwrap --history-tool tool file ... (never returns) */
+void
+run_history_tool(const char *tool, char **files, int nfiles, int histsize)
+{
+  int i;
+
+  if (nfiles < 1)
+    myerror(FATAL|NOERRNO, "%s --history-tool needs one or more history files as arguments", program_name);
+  if (strcmp(tool, "merge") == 0) {
+    if (nfiles < 2)
+      myerror(FATAL|NOERRNO, "--history-tool merge needs two or more history files (the first one gets the result)");
+    rewrite_history((const char **) files, nfiles, -1);
+  } else if (strcmp(tool, "dedupe") == 0 || strcmp(tool, "trim") == 0) {
+    for (i = 0; i < nfiles; i++)
+      rewrite_history((const char **) &files[i], 1, strcmp(tool, "trim") == 0 ? histsize : -1);
+  } else {
+    myerror(FATAL|NOERRNO, "--history-tool should be followed by dedupe, trim or merge, not '%s'", tool);
+  }
+  exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,222 @@
+/*  known_prompts.c: prompts that can be cooked without waiting
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License , or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; see the file COPYING.  If not, write to
+    the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+
+    You may contact the author by:
+       e-mail:  hanslub42@gmail.com
+*/
+
+
+/* Most commands only ever show a handful of different prompts ("SQL> ", ">>> ", "... "). Once the user has
+   answered a prompt, we know that it really is one, and when command's output ends with it again, the main loop
+   cooks it at once, instead of waiting (-w) to see whether more output will follow. If it does follow (without
+   the user doing anything), the prompt is forgotten again (cf. prompt_timeout.c)
+
+   With --known-prompts <file>, the prompts in <file> are known from the start, and <file> is rewritten whenever
+   we learn or forget a prompt, so that it holds exactly the prompts that we know (at most MAX_KNOWN_PROMPTS of
+   them, without duplicates). The file has one raw prompt per line, with backslash escapes for backslashes (\\),
+   ESC (\e) and other control characters (\xHH). Note that trailing spaces are significant                    */
+
+
+#include "rlwrap.h"
+
+#define MAX_KNOWN_PROMPTS 64    /* when we know more, we forget the oldest */
+
+struct known_prompt {
+  unsigned long hash;
+  char *prompt;
+};
+
+static struct known_prompt known_prompts[MAX_KNOWN_PROMPTS];
+static int nknown = 0;
+static char *known_prompts_file = NULL;
+
+
+static int
+find_known_prompt(const char *prompt, unsigned long hash)
+{
+  int i;
+  for (i = 0; i < nknown; i++)
+    if (known_prompts[i].hash == hash && strcmp(known_prompts[i].prompt, prompt) == 0)
+      return i;
+  return -1;
+}
+
+
+bool
+is_known_prompt(const char *raw_prompt)
+{
+  return *raw_prompt && find_known_prompt(raw_prompt, hash_multiple(1, raw_prompt)) >= 0;
+}
+
+
+static bool
+add_known_prompt(const char *prompt)
+{
+  unsigned long hash = hash_multiple(1, prompt);
+
+  if (!*prompt || find_known_prompt(prompt, hash) >= 0)
+    return FALSE;
+  if (nknown == MAX_KNOWN_PROMPTS) {
+    free(known_prompts[0].prompt);
+    memmove(known_prompts, known_prompts + 1, (MAX_KNOWN_PROMPTS - 1) * sizeof(struct known_prompt));
+    nknown--;
+  }
+  known_prompts[nknown].hash = hash;
+  known_prompts[nknown].prompt = mysavestring(prompt);
+  nknown++;
+  return TRUE;
+}
+
+
+static void save_known_prompts(void);
+
+
+void
+forget_known_prompt(const char *raw_prompt)
+{
+  int i = find_known_prompt(raw_prompt, hash_multiple(1, raw_prompt));
+
+  if (i < 0)
+    return;
+  DPRINTF1(DEBUG_READLINE, "forgetting known prompt <%s>", M(raw_prompt));
+  free(known_prompts[i].prompt);
+  memmove(known_prompts + i, known_prompts + i + 1, (nknown - i - 1) * sizeof(struct known_prompt));
+  nknown--;
+  save_known_prompts(); /* so that it won't be known the next time either */
+}
+
+
+static char *
+escape_prompt(const char *prompt)
+{
+  char *escaped = mymalloc(4 * strlen(prompt) + 1), *q = escaped;
+  const unsigned char *p;
+
+  for (p = (const unsigned char *) prompt; *p; p++) {
+    if (*p == '\\') {
+      *q++ = '\\';
+      *q++ = '\\';
+    } else if (*p == '\033') {
+      *q++ = '\\';
+      *q++ = 'e';
+    } else if (*p < ' ' || *p == 0x7f) {
+      sprintf(q, "\\x%02x", *p);
+      q += 4;
+    } else {
+      *q++ = *p;
+    }
+  }
+  *q = '\0';
+  return escaped;
+}
+
+
+static char *
+unescape_prompt(const char *line)
+{
+  char *prompt = mymalloc(strlen(line) + 1), *q = prompt;
+  const char *p;
+
+  for (p = line; *p; p++) {
+    if (*p != '\\' || !p[1]) {
+      *q++ = *p;
+    } else if (p[1] == 'e') {
+      *q++ = '\033';
+      p++;
+    } else if (p[1] == 'x' && isxdigit((unsigned char) p[2]) && isxdigit((unsigned char) p[3])) {
+      char hex[3] = { p[2], p[3], '\0' };
+      *q++ = (char) strtol(hex, NULL, 16);
+      p += 3;
+    } else {
+      *q++ = p[1];
+      p++;
+    }
+  }
+  *q = '\0';
+  return prompt;
+}
+
+
+/* Replace the contents of known_prompts_file by the prompts that we know now (via a temporary file, so that it
+   won't get lost if we crash halfway). Other sessions may use the same file, so we hold the same lock on it as
+   histfile.c does on history files while we write (and rename) the temporary file */
+static void
+save_known_prompts(void)
+{
+  char *tmpname, *escaped;
+  FILE *fp = NULL;
+  bool ok;
+  int i, locked_fd;
+
+  if (!known_prompts_file)
+    return;
+  tmpname = add2strings(known_prompts_file, ".tmp");
+  ok = (locked_fd = open_locked(known_prompts_file, O_RDWR)) >= 0 && (fp = fopen(tmpname, "w")) != NULL;
+  for (i = 0; ok && i < nknown; i++) {
+    escaped = escape_prompt(known_prompts[i].prompt);
+    ok = fprintf(fp, "%s\n", escaped) >= 0;
+    free(escaped);
+  }
+  if (fp)
+    ok = fclose(fp) == 0 && ok;
+  if (!ok || rename(tmpname, known_prompts_file)) {
+    myerror(WARNING|USE_ERRNO, "cannot write %s (won't try again)", known_prompts_file);
+    if (locked_fd >= 0)
+      unlink(tmpname); /* without the lock, it might be another session's */
+    free(known_prompts_file);
+    known_prompts_file = NULL;
+  }
+  if (locked_fd >= 0)
+    close(locked_fd); /* only now release the lock */
+  free(tmpname);
+}
+
+
+/* --known-prompts: read the prompts in filename (which need not exist yet), and keep it up to date from now on */
+void
+read_known_prompts(const char *filename)
+{
+  char *line, *prompt;
+  int nlines = 0;
+  FILE *fp;
+
+  known_prompts_file = mysavestring(filename);
+  if (!(fp = fopen(filename, "r"))) {
+    if (errno != ENOENT)
+      myerror(WARNING|USE_ERRNO, "cannot read known prompts from %s", filename);
+    return;
+  }
+  for (; (line = read_line(fp)); nlines++) {
+    prompt = unescape_prompt(line);
+    add_known_prompt(prompt); /* this skips duplicates (and forgets the oldest prompts if there are too many) */
+    free_multiple(prompt, line, FMEND);
+  }
+  fclose(fp);
+  DPRINTF3(DEBUG_READLINE, "read %d known prompts (from %d lines) from %s", nknown, nlines, filename);
+  if (nlines > nknown) /* some of them were duplicates (or empty, or too many): clean up the file */
+    save_known_prompts();
+}
+
+
+/* the user has answered raw_prompt, so it must have been a prompt */
+void
+learn_known_prompt(const char *raw_prompt)
+{
+  if (!add_known_prompt(raw_prompt))
+    return;
+  DPRINTF1(DEBUG_READLINE, "learned prompt <%s>", M(raw_prompt));
+  save_known_prompts();
+}
@@ -0,0 +1,383 @@
+/*  lazyload.c: load history and completion lists while rlwrap (and the user) would otherwise be idle
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License , or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; see the file COPYING.  If not, write to
+    the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+
+    You may contact the author by:
+       e-mail:  hanslub42@gmail.com
+*/
+
+
+/* Reading a big history file, and splitting big completion lists into words, used to happen before the
+   wrapped command was even started. With a large history (especially with -f .) this could take seconds.
+
+   Now, init_rlwrap() only puts these files in a queue (after opening them, so that we can still complain
+   early about unreadable files). They are then loaded a chunk of lines at a time, whenever main_loop()
+   would otherwise be waiting in select(), i.e. while the command is starting up and the user is reading
+   its output. Typing plain characters doesn't need either list, so only when the user presses a key that
+   is bound to something else than self-insert (like TAB, Up, CTRL-R or Enter) do we wait for the
+   rest of the lists to be loaded: finish_loading_lists_before(key)
+
+   With -f . the history file is also a completion list. It is then read only once: the same chunks of lines
+   that go into the history are split into words for the completion list as well.
+
+   Once all lists are loaded, the idle time is used to add the words on compiled completion lists (which are
+   never loaded, cf. wordindex.c) to the BK-tree that is used to correct typos (cf. bktree.c)
+
+   rlwrap has always been single-threaded (readline isn't thread-safe, and neither is the
+   completion tree), so we don't use a separate thread for this.                                            */
+
+
+#include "rlwrap.h"
+#include <limits.h>
+
+#define LINES_PER_CHUNK 500   /* a chunk takes well under a millisecond on a modern machine */
+#define WORDS_PER_CHUNK 1000  /* (words from compiled completion lists to be added to the BK-tree in bktree.c) */
+
+enum list_type { HISTORY, COMPLETIONS };
+
+struct lazy_list {
+  enum list_type type;
+  char *filename;
+  FILE *fp;                /* COMPLETIONS: still to be read */
+  char *break_chars;       /* the word-breaking characters at the moment the list was queued (NULL for a HISTORY list that isn't fed into the completion list) */
+  bool warn;               /* COMPLETIONS: warn if reading goes wrong */
+  bool with_sections;      /* COMPLETIONS: whether the list may contain sections (cf. completion.rb) */
+  char *contents;          /* HISTORY: the whole history file ...  */
+  char *next_line;         /* ... the first line that hasn't been loaded yet ... */
+  char *first_history_line;/* ... and the first line that the (stifled) history will keep */
+  struct lazy_list *next;
+};
+
+static struct lazy_list *queue = NULL; /* lists still (partially) to be loaded, in the order they were queued */
+static long lines_loaded = 0;
+
+
+static void
+add_to_queue(struct lazy_list *list)
+{
+  struct lazy_list **last;
+  for (last = &queue; *last; last = &(*last)->next)
+    ;
+  list->next = NULL;
+  *last = list;
+}
+
+
+/* Read the whole of filename into a '\0'-terminated string. Returns NULL if this cannot be done */
+static char *
+read_whole_file(const char *filename)
+{
+  struct stat buf;
+  char *contents;
+  ssize_t nread, total = 0;
+  int fd = open(filename, O_RDONLY);
+
+  if (fd < 0)
+    return NULL;
+  if (fstat(fd, &buf)) {
+    close(fd);
+    return NULL;
+  }
+  contents = mymalloc(buf.st_size + 1);
+  while (total < buf.st_size && (nread = read(fd, contents + total, buf.st_size - total)) != 0) {
+    if (nread < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    total += nread;
+  }
+  contents[total] = '\0';
+  close(fd);
+  return contents;
+}
+
+
+/* readline's read_history() recognises timestamp lines like "#1700000000" (but only when history_comment_char is set) */
+static bool
+is_timestamp(const char *line)
+{
+  return history_comment_char && *line == history_comment_char && isdigit((unsigned char) line[1]);
+}
+
+
+/* When the history is stifled to histsize entries, read_history() would add every line in the file, and then
+   immediately forget all but the last histsize of them. Start at the first line that will be remembered instead */
+static char *
+first_line_worth_reading(char *contents)
+{
+  char *p = contents + strlen(contents);
+  int lines_to_go;
+
+  if (!history_is_stifled() || history_comment_char) /* with timestamps, a line is not necessarily a history entry */
+    return contents;
+  if (p > contents && p[-1] == '\n')
+    p--;                  /* skip the final newline */
+  for (lines_to_go = history_max_entries; p > contents; p--)
+    if (p[-1] == '\n' && --lines_to_go <= 0)
+      break;
+  return p;
+}
+
+
+/* Queue the history file (and, if feed_completions, make it a completion list as well). Just like read_history(), this
+   silently ignores a non-existent or unreadable file. Returns the number of lines in the file */
+long
+load_history_lazily(const char *filename, bool feed_completions)
+{
+  struct lazy_list *list;
+  char *contents = read_whole_file(filename), *p;
+  long nlines = 0;
+
+  if (!contents)
+    return 0;
+  for (p = contents; (p = strchr(p, '\n')); p++)
+    nlines++;
+  list = mymalloc(sizeof(struct lazy_list));
+  memset(list, 0, sizeof(struct lazy_list));
+  list->type      = HISTORY;
+  list->filename  = mysavestring(filename);
+  list->contents  = contents;
+  list->first_history_line = first_line_worth_reading(contents);
+  list->next_line = feed_completions ? contents : list->first_history_line; /* all lines go into the completion list */
+  if (feed_completions)
+    list->break_chars = mysavestring(rl_basic_word_break_characters);
+  add_to_queue(list);
+  DPRINTF1(DEBUG_HISTORY, "queued history file %s", filename);
+  return nlines;
+}
+
+
+/* Queue a completion list, to be split into words using the word-breaking characters that are in use *now*.
+   A completion file may contain sections, a history file used as a completion list (-f .) cannot */
+void
+load_completions_lazily(const char *filename, bool warn_if_unreadable, bool with_sections)
+{
+  struct lazy_list *list;
+  FILE *fp = fopen(filename, "r");
+
+  if (!fp) {
+    if (warn_if_unreadable)
+      myerror(WARNING|USE_ERRNO, "Could not open %s", filename);
+    return;
+  }
+  list = mymalloc(sizeof(struct lazy_list));
+  memset(list, 0, sizeof(struct lazy_list));
+  list->type          = COMPLETIONS;
+  list->filename      = mysavestring(filename);
+  list->fp            = fp;
+  list->break_chars   = mysavestring(rl_basic_word_break_characters);
+  list->warn          = warn_if_unreadable;
+  list->with_sections = with_sections;
+  add_to_queue(list);
+  DPRINTF1(DEBUG_COMPLETION, "queued completion list %s", filename);
+}
+
+
+static void
+forget_first_in_queue(void)
+{
+  struct lazy_list *list = queue;
+
+  DPRINTF2((DEBUG_HISTORY|DEBUG_COMPLETION), "finished loading %s (%ld lines so far)", list->filename, lines_loaded);
+  queue = list->next;
+  if (list->type == COMPLETIONS)
+    fclose(list->fp);
+  else
+    free(list->contents);
+  if (list->break_chars)
+    free(list->break_chars);
+  free_multiple(list->filename, list, FMEND);
+}
+
+
+/* add at most max_lines lines from the history file to the history (and maybe the completion list). Returns TRUE when done */
+static bool
+load_history_lines(struct lazy_list *list, int max_lines)
+{
+  const char *saved_break_chars = rl_basic_word_break_characters;
+  char *line = list->next_line, *end;
+  int count;
+
+  if (list->break_chars)
+    rl_basic_word_break_characters = list->break_chars;
+  for (count = 0; count < max_lines && *line; count++, line = end) {
+    end = strchr(line, '\n');
+    if (end)
+      *end++ = '\0';
+    else
+      end = line + strlen(line);
+    if (is_timestamp(line)) {
+      if (history_length > 0 && line >= list->first_history_line)
+        add_history_time(line);
+      continue;
+    }
+    if (list->break_chars)
+      feed_line_into_completion_list(line);
+    if (line >= list->first_history_line)
+      add_history(line);
+  }
+  rl_basic_word_break_characters = saved_break_chars;
+  lines_loaded += count;
+  list->next_line = line;
+  if (*line)
+    return FALSE;
+  using_history(); /* lines may have been added after init_readline() called this: position at the end again */
+  return TRUE;
+}
+
+
+/* feed at most max_lines lines from a completion list into the completion list. Returns TRUE when done */
+static bool
+load_completion_lines(struct lazy_list *list, int max_lines)
+{
+  char buffer[BUFFSIZE];
+  const char *saved_break_chars = rl_basic_word_break_characters;
+  int count;
+  bool done = FALSE;
+
+  rl_basic_word_break_characters = list->break_chars;
+  for (count = 0; count < max_lines; count++) {
+    if (fgets(buffer, BUFFSIZE - 1, list->fp) == NULL) {
+      if (! feof(list->fp) && ferror(list->fp) && list->warn)
+        myerror(WARNING|USE_ERRNO, "Couldn't read completions from %s", list->filename);
+      done = TRUE;
+      break;
+    }
+    buffer[BUFFSIZE - 1] = '\0';
+    if (list->with_sections)
+      feed_completion_file_line(buffer);
+    else
+      feed_line_into_completion_list(buffer);
+  }
+  if (done && list->with_sections)
+    end_of_completion_file();
+  rl_basic_word_break_characters = saved_break_chars;
+  lines_loaded += count;
+  return done;
+}
+
+
+/* load the next chunk of (at most max_lines lines of) the lists in the queue */
+static void
+load_some_lists(int max_lines)
+{
+  bool done;
+
+  if (!queue) {
+    add_indexed_words_to_bktree(WORDS_PER_CHUNK);
+    return;
+  }
+  if (queue->type == HISTORY)
+    done = load_history_lines(queue, max_lines);
+  else
+    done = load_completion_lines(queue, max_lines);
+  if (done)
+    forget_first_in_queue();
+}
+
+
+/* whether there is anything left to do while idle */
+bool
+lists_are_loading(void)
+{
+  return queue != NULL || !add_indexed_words_to_bktree(0);
+}
+
+
+/* The history is complete when there is no (unfinished) history file in the queue */
+bool
+history_is_loaded(void)
+{
+  struct lazy_list *list;
+  for (list = queue; list; list = list->next)
+    if (list->type == HISTORY)
+      return FALSE;
+  return TRUE;
+}
+
+
+void
+finish_loading_history(void)
+{
+  while (!history_is_loaded())
+    load_some_lists(INT_MAX);
+}
+
+
+void
+finish_loading_lists(void)
+{
+  if (!queue)
+    return;
+  DPRINTF0((DEBUG_HISTORY|DEBUG_COMPLETION), "waiting for history and completion lists to be loaded");
+  while (queue)
+    load_some_lists(INT_MAX);
+}
+
+
+/* Called before readline gets to see key: if it will do anything else than just inserting itself,
+   it may need the history or the completion list (and we cannot know which), so finish loading them first */
+void
+finish_loading_lists_before(int key)
+{
+  Keymap keymap = rl_get_keymap();
+
+  if (!queue)
+    return;
+  if (keymap[key].type == ISFUNC && keymap[key].function == rl_insert)
+    return;
+  finish_loading_lists();
+}
+
+
+static long
+nanoseconds_since(const struct timeval *start)
+{
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return 1000000000L * (now.tv_sec - start->tv_sec) + 1000L * (now.tv_usec - start->tv_usec);
+}
+
+
+/* Like my_pselect(), but while waiting, load chunks from the lists in the queue. As long as there are lists to be
+   loaded, we poll the file descriptors between chunks (with a zero timeout, hence the copies of the fd_sets)       */
+int
+my_pselect_while_loading(int n, fd_set *readfds, fd_set *writefds, const struct timespec *ptimeout_ts, const sigset_t *sigmask)
+{
+  static const struct timespec immediately = { 0, 0 };
+  struct timeval start;
+  struct timespec remaining;
+  fd_set saved_readfds = *readfds, saved_writefds = *writefds;
+  long timeout_nsec = ptimeout_ts ? 1000000000L * ptimeout_ts->tv_sec + ptimeout_ts->tv_nsec : 0;
+  int nfds;
+
+  gettimeofday(&start, NULL);
+  while (lists_are_loading()) {
+    if ((nfds = my_pselect(n, readfds, writefds, NULL, &immediately, sigmask)) != 0)
+      return nfds;
+    *readfds = saved_readfds;
+    *writefds = saved_writefds;
+    if (ptimeout_ts && nanoseconds_since(&start) >= timeout_nsec)
+      return 0;
+    load_some_lists(LINES_PER_CHUNK);
+  }
+  if (!ptimeout_ts)
+    return my_pselect(n, readfds, writefds, NULL, NULL, sigmask);
+  timeout_nsec = max(0, timeout_nsec - nanoseconds_since(&start)); /* all lists have been loaded, wait for what remains of the timeout */
+  remaining.tv_sec  = timeout_nsec / 1000000000L;
+  remaining.tv_nsec = timeout_nsec % 1000000000L;
+  return my_pselect(n, readfds, writefds, NULL, &remaining, sigmask);
+}
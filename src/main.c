@@ -30,6 +30,7 @@ char *password_prompt_search_string = NULL;  /* (part of) password prompt (argum
 int ansi_colour_aware = FALSE;               /* -A option: make readline aware of ANSI colour codes in prompt */
 int bleach_the_prompt = FALSE;               /* -A!: remove all ANSI colour codes in prompt      */
 int complete_filenames = FALSE;              /* -c option: whether to complete file names        */
+int fuzzy_completion = FALSE;                /* -y option: match completions by subsequence, best matches first */
 int debug = 0;                               /* -d option: debugging mask                        */
 char *extra_char_after_completion = " ";     /* -e option: override readlines's default completion_append_char (space) */
 int always_echo = FALSE;                     /* -E option: always echo, even if client has ECHO off */
@@ -38,6 +39,7 @@ int history_duplicate_avoidance_policy =
 char *history_format = NULL;                 /* -F option: format to append to history entries            */
 char *forget_regexp = NULL;                  /* -g option: keep matching input out of history           */
 int pass_on_sigINT_as_sigTERM =  FALSE;      /* -I option: send a SIGTERM to client when a SIGINT is received */
+int completion_limit = 0;                     /* -L option: collect (and list) at most this many completions at a time (0: no limit) */
 char *multi_line_tmpfile_ext = NULL;         /* -M option: tmpfile extension for multi-line editor */
 int nowarn = FALSE;                          /* -n option: suppress warnings */
 int commands_children_not_wrapped =  FALSE;  /* -N option: always use direct mode when <command> is waiting */
@@ -48,7 +50,9 @@ int colour_the_prompt = FALSE;               /* -p option: whether we should pai
 int renice = FALSE;                          /* -R option: whether to be nicer than command */
 int mirror_arguments = FALSE;                /* -U option: whether to mirror command's arguments */
 int wait_before_prompt =  40;                /* -w option: how long we wait before deciding we have a cookable prompt (in msec)) */
+bool adaptive_wait_before_prompt = FALSE;    /* -w auto: learn how long to wait (cf. prompt_timeout.c) */
 int polling = FALSE;                         /* -W option: always give select() a small (=wait_before_prompt) timeout. */
+int resize_delay = 50;                       /* -Z option: only act on a window resize when the size has been stable for this long (in msec) */
 int impatient_prompt = TRUE;                 /* show raw prompt as soon as possible, even before we cook it. may result in "flashy" prompt */
 char *substitute_prompt = NULL;              /* -S option: substitute our own prompt for <command>s */
 char *filter_command = NULL;                 /* -z option: pipe prompts, input, output, history and completion requests through an external filter */
@@ -85,12 +89,16 @@ bool advise_always_readline = FALSE;         /* ... which has to be given a bit
 static char *history_filename = NULL;
 static int  histsize = 300;
 static int  write_histfile = TRUE;
+static int  append_histfile = FALSE;         /* -J option: append every accepted line to the history file at once */
+static int  share_histfile = FALSE;          /* -G option: ... and pick up the lines that other sessions append to it */
+static int  binary_histfile = FALSE;         /* -B option: keep the history in a binary log (<history file>.bin) */
 static char *completion_filename, *default_completion_filename;
 static char *full_program_name;
 static int  last_option_didnt_have_optional_argument = FALSE;
 static int  last_opt = -1;
 static char *client_term_name = NULL; /* we'll set TERM to this before exec'ing client command */
 static int feed_history_into_completion_list = FALSE;
+static struct dfa *prompt_dfa = NULL;          /* -O! option: prompt_regexp, ready to be fed the raw prompt a chunk at a time */
 
 
 /*
@@ -109,16 +117,17 @@ static void init_rlwrap(char *command_line);
 static void fork_child(char *command_name, char **argv);
 static char *read_options_and_command_name(int argc, char **argv);
 static void main_loop(void);
+static bool raw_prompt_matches_prompt_regexp(size_t unchanged);
 
 
 
 /* options */
 #ifdef GETOPT_GROKS_OPTIONAL_ARGS
-static char optstring[] = "+:a::A::b:cC:d::D:e:Ef:F:g:hH:iIl:nNM:m::oO:p::P:q:rRs:S:t:TUvw:WXz:";
+static char optstring[] = "+:a::A::b:BcC:d::D:e:Ef:F:g:GhH:iIJkK:l:L:nNM:m::oO:p::P:q:rRs:S:t:TUvw:Wx:XyY:z:Z:";
 /* +: is not really documented. configure checks wheteher it works as expected
    if not, GETOPT_GROKS_OPTIONAL_ARGS is undefined. @@@ */
 #else
-static char optstring[] = "+:a:A:b:cC:d:D:e:Ef:F:g:hH:iIl:nNM:m:oO:p:P:q:rRs:S:t:TUvw:WXz:"; 
+static char optstring[] = "+:a:A:b:BcC:d:D:e:Ef:F:g:GhH:iIJkK:l:L:nNM:m:oO:p:P:q:rRs:S:t:TUvw:Wx:XyY:z:Z:"; 
 #endif
 
 #ifdef HAVE_GETOPT_LONG
@@ -126,6 +135,7 @@ static struct option longopts[] = {
   {"always-readline",             optional_argument,  NULL, 'a'},
   {"ansi-colour-aware",           optional_argument,  NULL, 'A'},
   {"break-chars",                 required_argument,  NULL, 'b'},
+  {"binary-history",              no_argument,        NULL, 'B'},
   {"complete-filenames",          no_argument,        NULL, 'c'},
   {"command-name",                required_argument,  NULL, 'C'},
   {"debug",                       optional_argument,  NULL, 'd'},
@@ -135,11 +145,16 @@ static struct option longopts[] = {
   {"file",                        required_argument,  NULL, 'f'},
   {"history-format",              required_argument,  NULL, 'F'},
   {"forget-matching",             required_argument,  NULL, 'g'},
+  {"share-history",               no_argument,        NULL, 'G'},
   {"help",                        no_argument,        NULL, 'h'},
   {"history-filename",            required_argument,  NULL, 'H'},
   {"case-insensitive",            no_argument,        NULL, 'i'},
   {"pass-sigint-as-sigterm",      no_argument,        NULL, 'I'},
+  {"append-history",              no_argument,        NULL, 'J'},
+  {"compile-completions",         no_argument,        NULL, 'k'},
+  {"known-prompts",               required_argument,  NULL, 'K'},
   {"logfile",                     required_argument,  NULL, 'l'},
+  {"completion-limit",            required_argument,  NULL, 'L'},
   {"multi-line",                  optional_argument,  NULL, 'm'},
   {"multi-line-ext",              required_argument,  NULL, 'M'},
   {"no-warnings",                 no_argument,        NULL, 'n'},
@@ -159,8 +174,12 @@ static struct option longopts[] = {
   {"version",                     no_argument,        NULL, 'v'},
   {"wait-before-prompt",          required_argument,  NULL, 'w'},    
   {"polling",                     no_argument,        NULL, 'W'},
+  {"highlight",                   required_argument,  NULL, 'x'},
   {"skip-setctty",                no_argument,        NULL, 'X'},  
+  {"fuzzy-completion",            no_argument,        NULL, 'y'},
+  {"history-tool",                required_argument,  NULL, 'Y'},
   {"filter",                      required_argument,  NULL, 'z'}, 
+  {"resize-delay",                required_argument,  NULL, 'Z'},
   {0, 0, 0, 0}
 };
 #endif
@@ -218,6 +237,7 @@ main(int argc, char **argv)
 
   /* Harvest options and leave optind pointing to first non-option argument: */
   command_name = read_options_and_command_name(argc, argv);
+  mbc_init();
 
 
   /* by now, optind points to slave <command>, and &argv[optind] is <command>'s argv. Remember slave command line: */
@@ -302,8 +322,10 @@ main_loop(void)
   char buf[BUFFSIZE], *timeoutstr, *old_raw_prompt, *new_output_minus_prompt;
   int promptlen = 0;
   int leave_prompt_alone;
+  size_t unchanged;
   sigset_t no_signals_blocked;
   int seen_EOF = FALSE;     
+  bool waiting_for_resize;
    
   struct timespec         select_timeout, *select_timeoutptr;
   struct timespec immediately = { 0, 0 }; /* zero timeout when child is dead */
@@ -336,7 +358,10 @@ main_loop(void)
       select_timeout = immediately;
       select_timeoutptr = &select_timeout;
       timeoutstr = "immediately";
-    } else if (prompt_is_still_uncooked || polling) {
+    } else if (prompt_is_still_uncooked) {
+      select_timeoutptr = prompt_timeout(&select_timeout);
+      timeoutstr = "wait_a_little";
+    } else if (polling) {
       select_timeout = wait_a_little;
       select_timeoutptr = &select_timeout;
       timeoutstr = "wait_a_little";
@@ -344,11 +369,16 @@ main_loop(void)
       select_timeoutptr = forever; /* NULL */
       timeoutstr = "forever";
     }
+    if ((waiting_for_resize = wait_for_resize_to_settle(&select_timeout, &select_timeoutptr))) /* cf. signals.c */
+      timeoutstr = "until resize has settled";
      
     DPRINTF2(DEBUG_TERMIO, "calling select() with timeout %s %s ...",  timeoutstr, within_line_edit ? "(within line edit)" : "");
     
 
-    nfds = my_pselect(1 + master_pty_fd, &readfds, &writefds, NULL, select_timeoutptr, &no_signals_blocked);
+    if (lists_are_loading() && !command_is_dead && !ignore_queued_input) /* use the time we would spend waiting to load history and completions */
+      nfds = my_pselect_while_loading(1 + master_pty_fd, &readfds, &writefds, select_timeoutptr, &no_signals_blocked);
+    else
+      nfds = my_pselect(1 + master_pty_fd, &readfds, &writefds, NULL, select_timeoutptr, &no_signals_blocked);
     
     DPRINTF5(DEBUG_TERMIO, "... returning %d%s %s %s %s"
              , nfds
@@ -363,6 +393,8 @@ main_loop(void)
     /* check flags that may have been set by signal handlers */
     if (filter_is_dead) 
       filters_last_words(); /* will call myerror with last words */
+
+    act_on_settled_resize(); /* only does something when the last SIGWINCH is resize_delay msecs ago. May set received_WINCH */
        
     if (received_WINCH) {  /* received_WINCH flag means we've had a WINCH while within_line_edit was FALSE */
       DPRINTF0(DEBUG_READLINE, "Starting line edit as a result of WINCH ");
@@ -380,7 +412,9 @@ main_loop(void)
     } else if (nfds == 0) {
       
       /* timeout, which can only happen when .. */
-      if (ignore_queued_input) {       /* ... we have read all the input keystrokes that should
+      if (waiting_for_resize) {        /* ... we have waited for a resize to settle (and acted on it, see above), ... */
+        continue;
+      } else if (ignore_queued_input) {       /* ... we have read all the input keystrokes that should
                                           be ignored (i.e. those that accumulated on stdin while we
                                           were calling an external editor) */
         ignore_queued_input = FALSE;
@@ -398,6 +432,8 @@ main_loop(void)
           continue;
         } 
         if (!skip_rlwrap()) {                        /* ... or else, it is time to cook the prompt */
+          log_duration_until_prompt();               /* only with --binary-history */
+          note_prompt_cooked(saved_rl_state.raw_prompt); /* cf. prompt_timeout.c */
           if (pre_given && accepted_lines == 0) {
             /* input_buffer and point have already been set in init_readline() */
             DPRINTF0(DEBUG_READLINE, "Starting line edit (because of -P option)");
@@ -526,6 +562,7 @@ main_loop(void)
         else
           old_raw_prompt = mysavestring(""); /*  don't leave  old_raw_prompt untialised, as it might be freed */
         
+        unchanged = strchr(buf, '\n') ? 0 : strlen(saved_rl_state.raw_prompt); /* how much of the raw prompt will stay */
         new_output_minus_prompt = process_new_output(buf, &saved_rl_state); /* chop off the part after the last newline and put this in
                                                                                saved_rl_state.raw_prompt (or append buf if  no newline found)*/
 
@@ -539,7 +576,7 @@ main_loop(void)
 
           my_putstr(filtered); 
           free (filtered);
-          if (regexp_means_prompt && prompt_regexp && match_regexp(saved_rl_state.raw_prompt, prompt_regexp, FALSE)) {
+          if (regexp_means_prompt && prompt_regexp && raw_prompt_matches_prompt_regexp(unchanged)) {
             /* user specified -O!.... so any natching candidate prompt will be cooked and output immediately: */
             move_cursor_to_start_of_prompt(ERASE);  /* erase already printed raw prompt */
             cook_prompt_if_necessary();
@@ -556,6 +593,7 @@ main_loop(void)
 
       
         prompt_is_still_uncooked = TRUE; 
+        note_command_output(saved_rl_state.raw_prompt);
        
 
         if (within_line_edit)
@@ -590,6 +628,7 @@ main_loop(void)
           continue;             /* do nothing with it*/
         assert(nread == 1);
         DPRINTF2(DEBUG_TERMIO, "read from stdin: byte 0x%02x (%s)", byte_read, mangle_char_for_debug_log(byte_read, TRUE)); 
+        note_user_input();
         if (skip_rlwrap()) { /* direct mode, just pass it on */
           /* remote possibility of a race condition here: when the first half of a multi-byte char is read in
              direct mode and the second half in readline mode. Oh well... */
@@ -606,6 +645,7 @@ main_loop(void)
         } else {  /* hand it over to readline */
           if (!within_line_edit) { /* start a new line edit    */
             DPRINTF0(DEBUG_READLINE, "Starting line edit");
+            log_duration_until_prompt();
             within_line_edit = TRUE;
             restore_rl_state();
           } 
@@ -618,6 +658,7 @@ main_loop(void)
             free(sent_EOF);
           } 
           else {
+            finish_loading_lists_before(byte_read); /* unless byte_read is just inserted, readline may need the history or completion list */
             rl_stuff_char(byte_read);  /* stuff it back in readline's input queue */
             DPRINTF0(DEBUG_TERMIO, "passing it to readline"); 
             DPRINTF2(DEBUG_READLINE, "rl_callback_read_char() (_rl_eof_char=%d, term_eof=%d)", _rl_eof_char, term_eof);
@@ -641,6 +682,27 @@ main_loop(void)
 }    /* void main_loop()      */
 
 
+/* Does the raw prompt, of which only the first <unchanged> bytes are the same as at the previous call, match the -O!
+   regexp? Usually only the newly arrived bytes have to be fed to prompt_dfa (but when the raw prompt has been
+   replaced without our knowledge, <unchanged> won't be what we have seen, and we start again from scratch) */
+static bool
+raw_prompt_matches_prompt_regexp(size_t unchanged)
+{
+  static size_t seen = 0;
+  size_t length = strlen(saved_rl_state.raw_prompt);
+
+  if (!prompt_dfa)
+    return match_regexp(saved_rl_state.raw_prompt, prompt_regexp, FALSE);
+  if (unchanged != seen || length < seen) {
+    dfa_restart(prompt_dfa);
+    seen = 0;
+  }
+  dfa_feed(prompt_dfa, saved_rl_state.raw_prompt + seen, length - seen);
+  seen = length;
+  return dfa_has_matched(prompt_dfa);
+}
+
+
 /* Read history and completion word lists */
 static void
 init_rlwrap(char *command_line)
@@ -649,6 +711,8 @@ init_rlwrap(char *command_line)
   char *homedir, *histdir, *homedir_prefix, *hostname;
   struct stat statbuf;
   time_t now;
+  long history_file_lines;
+  int i;
   
 
   hostname = getenv("HOSTNAME") ? getenv("HOSTNAME") : "?";
@@ -711,10 +775,23 @@ init_rlwrap(char *command_line)
   /* Initialize history */
   using_history();
   stifle_history(histsize);
-  read_history(history_filename); /* ignore errors here: history file may not yet exist, but will be created on exit */
+  if (binary_histfile) {
+    if (append_histfile)
+      myerror(FATAL|NOERRNO, "--binary-history cannot be combined with --append-history or --share-history");
+    start_history_log(history_filename, write_histfile && histsize > 0);
+  } else {
+    /* ignore errors here: history file may not yet exist, but will be created on exit. With -f . it also becomes a completion list */
+    history_file_lines = load_history_lazily(history_filename, feed_history_into_completion_list);
+    if (share_histfile && write_histfile && histsize > 0)
+      start_sharing_history(history_filename, history_file_lines);
+    else if (append_histfile && write_histfile && histsize > 0)
+      start_appending_history(history_filename, history_file_lines);
+  }
+
+  if (feed_history_into_completion_list && binary_histfile) /* (the plain history file may be long out of date) */
+    for (i = 0; i < history_length; i++)
+      feed_line_into_completion_list(history_get(history_base + i)->line);
 
-  if (feed_history_into_completion_list)
-    feed_file_into_completion_list(history_filename, FALSE);
   /* Determine completion file name (completion files are never written to,
      and ignored when unreadable or non-existent) */
 
@@ -733,6 +810,10 @@ init_rlwrap(char *command_line)
     feed_file_into_completion_list(default_completion_filename, FALSE);
   }
 
+  /* Without --highlight, colour the input line if there is a <command>_highlighting file (cf. highlight.c) */
+  if (!highlighting)
+    read_highlighting_file(add3strings(homedir_prefix, command_name, "_highlighting"), FALSE);
+
   
 }
 
@@ -792,6 +873,10 @@ read_options_and_command_name(int argc, char **argv)
   int option_count = 0;
   int opt_b = FALSE;
   int opt_f = FALSE;
+  int opt_k = FALSE;
+  char **completion_files = NULL; /* -f files, read only when we know the final word-breaking characters */
+  int ncompletion_files = 0, i;
+  char *history_tool = NULL;
   int remaining = -1; /* remaining number of arguments on command line */
   int longindex = -1; /* index of current option in longopts[], set by getopt_long */
   
@@ -830,9 +915,8 @@ read_options_and_command_name(int argc, char **argv)
     case 'b':
       rl_basic_word_break_characters = skip_prefix_or_else(optarg, "precisely:", add2strings("\r\n \t", optarg));
       opt_b = TRUE;
-      if (opt_f)
-        myerror(WARNING|NOERRNO, "if you want to split a completion file with your given --break-chars, the -f (--file) option needs to come *after* the --break-chars (-b) option ");  
       break;
+    case 'B': binary_histfile = TRUE; break;
     case 'c':   complete_filenames = TRUE;
 #ifndef CAN_FOLLOW_COMMANDS_CWD
       myerror(WARNING|NOERRNO, "On this system rlwrap cannot follow the rlwrapped command's working directory:\n"
@@ -867,21 +951,28 @@ read_options_and_command_name(int argc, char **argv)
     case 'f':
       if (strcmp(optarg, ".") == 0)
         feed_history_into_completion_list =  TRUE;
-      else
-        feed_file_into_completion_list(optarg, TRUE);
+      else {
+        completion_files = myrealloc(completion_files, ncompletion_files * sizeof(char *), (ncompletion_files + 1) * sizeof(char *));
+        completion_files[ncompletion_files++] = optarg;
+      }
       opt_f = TRUE;
       break;
     case 'F': WONTRETURN(myerror(FATAL|NOERRNO, "The -F (--history-format) option is obsolete. Use -z \"history_format '%s'\" instead", optarg));
-    case 'g': forget_regexp = mysavestring(optarg);  match_regexp("complain NOW if regexp is wrong", forget_regexp, 1); break;
+    case 'g': forget_regexp = mysavestring(optarg);  match_regexp("complain NOW if regexp is wrong", forget_regexp, TRUE); break; /* with the same flags as in readline.c, so that it is compiled only once */
+    case 'G': share_histfile = append_histfile = TRUE; break;
     case 'h': WONTRETURN(usage(EXIT_SUCCESS));   
     case 'H': history_filename = mysavestring(optarg); break;
-    case 'i': 
-      if (opt_f)
-        myerror(FATAL|NOERRNO, "-i option has to precede -f options");
-      completion_is_case_sensitive = FALSE;
-      break;
+    case 'i': completion_is_case_sensitive = FALSE; break;
     case 'I': pass_on_sigINT_as_sigTERM = TRUE; break;
+    case 'J': append_histfile = TRUE; break;
+    case 'k': opt_k = TRUE; break;
+    case 'K': read_known_prompts(optarg); break;
     case 'l': open_logfile(optarg); break;
+    case 'L':
+      completion_limit = my_atoi(optarg);
+      if (completion_limit < 0)
+        myerror(FATAL|NOERRNO, "%s option with illegal value %d, should be >= 0", current_option('L', longindex), completion_limit);
+      break;
     case 'n': nowarn = TRUE; break;
     case 'm':
 #ifndef HAVE_SYSTEM
@@ -899,7 +990,9 @@ read_options_and_command_name(int argc, char **argv)
         regexp_means_prompt = TRUE;
         prompt_regexp += 1;
       }
-      match_regexp("complain NOW if regexp is wrong", prompt_regexp, 1);
+      match_regexp("complain NOW if regexp is wrong", prompt_regexp, FALSE); /* -O is case-sensitive (unlike -g) */
+      if (regexp_means_prompt)
+        prompt_dfa = compile_dfa(prompt_regexp, FALSE); /* NULL if too difficult, then we'll use match_regexp() */
       break;
     case 'p':
       colour_the_prompt = TRUE;
@@ -929,6 +1022,11 @@ read_options_and_command_name(int argc, char **argv)
     case 'U': mirror_arguments = TRUE; break;
     case 'v': printf("rlwrap %s\n",  VERSION); exit(EXIT_SUCCESS);
     case 'w':
+      if (strcmp(optarg, "auto") == 0 || strcmp(optarg, "-auto") == 0) {
+        adaptive_wait_before_prompt = TRUE;
+        impatient_prompt = (*optarg != '-');
+        break;
+      }
       wait_before_prompt = my_atoi(optarg);
       if (wait_before_prompt < 0) {
         wait_before_prompt *= -1;
@@ -937,9 +1035,17 @@ read_options_and_command_name(int argc, char **argv)
       break;
     case 'W': 
       polling = TRUE; break;
+    case 'x': read_highlighting_file(optarg, TRUE); break;
     case 'X':
       skip_setctty = TRUE; break;
+    case 'y': fuzzy_completion = TRUE; break;
+    case 'Y': history_tool = optarg; break;
     case 'z': filter_command = mysavestring(optarg); break;
+    case 'Z':
+      resize_delay = my_atoi(optarg);
+      if (resize_delay < 0)
+        myerror(FATAL|NOERRNO, "%s option with illegal value %d, should be >= 0", current_option('Z', longindex), resize_delay);
+      break;
     case '?':
       assert(optind > 0);
       WONTRETURN(myerror(FATAL|NOERRNO, "unrecognised option %s\ntry '%s --help' for more information", argv[optind-1], full_program_name));
@@ -957,6 +1063,28 @@ read_options_and_command_name(int argc, char **argv)
       add2strings(rl_basic_word_break_characters, "/.");
   }
 
+  if (opt_k) { /* rlwrap [-b chars] [-c] [-i] --compile-completions file ... : the options determine how the files will be split into words */
+    if (optind >= argc)
+      myerror(FATAL|NOERRNO, "%s --compile-completions needs one or more completion files as arguments", program_name);
+    for (; optind < argc; optind++)
+      compile_completions_file(argv[optind]);
+    exit(EXIT_SUCCESS);
+  }
+
+  if (history_tool) { /* rlwrap [-D n] [-s N] [-z filter] --history-tool dedupe|trim|merge file ... */
+    if (filter_command) {
+      mysignal(SIGALRM, HANDLER(handle_sigALRM)); /* needed for read_patiently2 */
+      spawn_filter(filter_command);
+    }
+    run_history_tool(history_tool, argv + optind, argc - optind, histsize);
+  }
+
+  /* -f lists are split with the same word-breaking characters as the default lists (and as rlwrap -k uses when compiling them) */
+  for (i = 0; i < ncompletion_files; i++)
+    feed_file_into_completion_list(completion_files[i], TRUE);
+  if (completion_files)
+    free(completion_files);
+
   if (!complete_filenames && !opt_f && !remember_for_completion && !always_readline) { /* https://github.com/hanslub42/rlwrap/issues/147 */
     rl_bind_key('\t', rl_insert);
   }
@@ -1075,7 +1203,9 @@ cleanup_rlwrap_and_exit(int status)
   unblock_all_signals();
   DPRINTF0(DEBUG_TERMIO, "Cleaning up");
 
-  if (write_histfile && (histsize==0 ||  history_total_bytes() > 0))  {/* avoid creating empty .speling_eror_history file after typo */
+  if (write_histfile && !appending_history() && !binary_histfile /* if so, all history has already been written */
+      && history_is_loaded() /* if not, the history is unchanged, and writing it would truncate the history file */
+      && (histsize==0 ||  history_total_bytes() > 0))  {/* avoid creating empty .speling_eror_history file after typo */
     DPRINTF2(DEBUG_HISTORY, "Writing history file %s (%d bytes)", history_filename, history_total_bytes());
     write_history(history_filename); /* ignore errors */
   }
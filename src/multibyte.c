@@ -1,5 +1,9 @@
+#define _GNU_SOURCE /* for wcwidth() */
 #include "rlwrap.h"
 #include <limits.h>
+#ifdef UNIT_TEST
+#  include <wctype.h>
+#endif
 
 
 /* rlwrap was written without worrying about multibyte characters.
@@ -20,6 +24,123 @@
 
 #ifdef MULTIBYTE_AWARE
 
+/* Almost everybody uses UTF-8 nowadays. As UTF-8 is stateless, and easy to decode, we don't need mbrlen() and friends
+   for it: in a UTF-8 locale the functions below decode it themselves, skip runs of ASCII a word at a time, and only
+   ask wcwidth() for the widths of characters beyond Latin-1. The results are the same as with mbrlen(), except that (like RFC 3629,
+   but unlike glibc) we don't accept sequences for characters beyond U+10FFFF                                        */
+
+static bool utf8_locale = FALSE;
+
+/* call this once, after setlocale() */
+void
+mbc_init(void)
+{
+  const char *codeset;
+  char *lowercase_codeset;
+#ifdef HAVE_LANGINFO_H
+  codeset = nl_langinfo(CODESET);
+#else
+  codeset = setlocale(LC_CTYPE, NULL); /* e.g. "en_US.UTF-8" */
+#endif
+  if (!codeset)
+    return;
+  lowercase_codeset = lowercase(codeset);
+  utf8_locale = strstr(lowercase_codeset, "utf-8") || strstr(lowercase_codeset, "utf8");
+  free(lowercase_codeset);
+  DPRINTF2(DEBUG_READLINE, "codeset: %s%s", codeset, utf8_locale ? " (using UTF-8 fast path)" : "");
+}
+
+
+/* the length of the (complete and valid) UTF-8 sequence at p, 0 at the end of the string, or -1 */
+static int
+utf8_length(const char *p)
+{
+  const unsigned char *s = (const unsigned char *) p;
+  unsigned char min = 0x80, max = 0xbf; /* allowed range for the second byte */
+  int i, length;
+
+  if (s[0] < 0x80)
+    return s[0] ? 1 : 0;
+  else if (s[0] < 0xc2)            /* stray continuation byte, or overlong 2-byte sequence */
+    return -1;
+  else if (s[0] < 0xe0)
+    length = 2;
+  else if (s[0] < 0xf0) {
+    length = 3;
+    if (s[0] == 0xe0)
+      min = 0xa0;                   /* overlong */
+    else if (s[0] == 0xed)
+      max = 0x9f;                   /* UTF-16 surrogate */
+  } else if (s[0] < 0xf5) {
+    length = 4;
+    if (s[0] == 0xf0)
+      min = 0x90;                   /* overlong */
+    else if (s[0] == 0xf4)
+      max = 0x8f;                   /* beyond U+10FFFF */
+  } else
+    return -1;
+  if (s[1] < min || s[1] > max)
+    return -1;
+  for (i = 2; i < length; i++)
+    if ((s[i] & 0xc0) != 0x80)
+      return -1;
+  return length;
+}
+
+
+static unsigned long
+utf8_decode(const char *p, int length)
+{
+  const unsigned char *s = (const unsigned char *) p;
+  unsigned long c = length == 1 ? s[0] : s[0] & (0x7f >> length);
+  int i;
+
+  for (i = 1; i < length; i++)
+    c = (c << 6) | (s[i] & 0x3f);
+  return c;
+}
+
+
+/* TRUE if none of the 8 bytes at p is a NUL or non-ASCII */
+static bool
+is_ascii_word(const char *p)
+{
+  const uint64_t ones = 0x0101010101010101ULL, highs = 0x8080808080808080ULL;
+  uint64_t word;
+
+  memcpy(&word, p, sizeof(word));
+  return !((word | ((word - ones) & ~word)) & highs);
+}
+
+
+/* TRUE if all of the 8 bytes at p are printable ASCII (i.e. between ' ' and '~') */
+static bool
+is_printable_ascii_word(const char *p)
+{
+  const uint64_t ones = 0x0101010101010101ULL, highs = 0x8080808080808080ULL;
+  uint64_t word;
+
+  memcpy(&word, p, sizeof(word));
+  return !((word | (word + ones) | ((word - 0x20 * ones) & ~word)) & highs);
+}
+
+
+/* The width of a (printable) character is what readline thinks it is, i.e. what wcwidth() says. Only Latin-1 and the
+   other characters before the first combining mark (U+0300) are always one column wide, and need no lookup */
+static int
+utf8_columns(unsigned long c)
+{
+  int width;
+
+  if (c < 0x20 || (c >= 0x7f && c < 0xa0))
+    return 0;
+  if (c < 0x300)
+    return 1;
+  width = wcwidth((wchar_t) c);
+  return width < 0 ? 0 : width;
+}
+
+
 MBSTATE *
 mbc_initstate(MBSTATE *st)
 {
@@ -38,12 +159,18 @@ int
 mbc_is_valid(const char *mb_string, const MBSTATE *st)
 {
   MBSTATE scrap = *st;
+  if (utf8_locale)
+    return utf8_length(mb_string) >= 0;
   return (int) mbrlen(mb_string, MB_LEN_MAX, &scrap ) >= 0;
 }
 
 const char *
 mbc_next(const char *mb_string, MBSTATE *st)
 {
+  if (utf8_locale) {
+    int length = utf8_length(mb_string);
+    return mb_string + (length > 0 ? length : 1);
+  }
   if (!*mb_string || !mbc_is_valid(mb_string, st))
     return mb_string + 1;     
   else
@@ -63,7 +190,9 @@ mbc_first(const char *mb_string, const MBSTATE *st)
 {
   MBSTATE scrap = *st;
   char buffer[MB_LEN_MAX+1];
-  int len = mbrlen(mb_string, MB_LEN_MAX, &scrap );
+  int len = utf8_locale ? utf8_length(mb_string) : (int) mbrlen(mb_string, MB_LEN_MAX, &scrap );
+  if (len < 0)
+    len = 1;
   strncpy(buffer, mb_string, len);
   buffer[len] = '\0';
   return mysavestring(buffer);
@@ -73,7 +202,7 @@ mbc_first(const char *mb_string, const MBSTATE *st)
 int
 mbc_charwidth(const char *p, MBSTATE *st)
 {
-  int width =  mbrlen(p, MB_LEN_MAX, st);
+  int width = utf8_locale ? utf8_length(p) : (int) mbrlen(p, MB_LEN_MAX, st);
   if (width < 0) {
     DPRINTF1(DEBUG_READLINE, "invalid multi-byte charavter at stert of %s", M(p)); 
     width = 1; /* if we don''n recognise it, interpret it as a byte */
@@ -94,6 +223,8 @@ int
 is_multibyte(const char *mb_char, const MBSTATE *st)
 {
   MBSTATE scrap = *st;
+  if (utf8_locale)
+    return utf8_length(mb_char) > 1;
   return mbc_is_valid(mb_char, st) && mbrlen(mb_char, MB_LEN_MAX, &scrap) > 1;
 }
 
@@ -102,15 +233,153 @@ mbc_strnlen(const char *mb_string, size_t maxlen, MBSTATE *st)
 {
   size_t len;
   const char *p;
+  if (utf8_locale) {
+    const char *end = memchr(mb_string, '\0', maxlen); /* stops at the first NUL, cf. C11 7.24.5.1 */
+    if (!end)
+      end = mb_string + maxlen;
+    for (len = 0, p = mb_string; p < end; ) {
+      if (p + 8 <= end && is_ascii_word(p)) {
+        len += 8;
+        p += 8;
+      } else {
+        mbc_inc(&p, st);
+        len++;
+      }
+    }
+    return len;
+  }
   for (len = 0, p = mb_string; *p && p < mb_string + maxlen; mbc_inc(&p, st))
     len++;
   return len;
 }
 
 
+/* the number of columns that the (possibly multi-byte) character at p takes up on the screen (0 for control characters) */
+int
+mbc_columns(const char *p, MBSTATE *st)
+{
+  MBSTATE scrap = *st;
+  wchar_t wc;
+  int length, width;
+
+  if (utf8_locale) {
+    length = utf8_length(p);
+    return length > 0 ? utf8_columns(utf8_decode(p, length)) : (length < 0); /* invalid bytes are shown as a single (odd) character */
+  }
+  if ((int) mbrtowc(&wc, p, MB_LEN_MAX, &scrap) < 0)
+    return 1;
+  width = wcwidth(wc);
+  return width < 0 ? 0 : width;
+}
+
+
+
+
+/* the number of screen columns taken up by the first nbytes of mb_string (which shouldn't contain a NUL). If pchars
+   != NULL, *pchars is set to the number of characters (cf. mbc_strnlen()) */
+int
+mbc_measure(const char *mb_string, size_t nbytes, MBSTATE *st, int *pchars)
+{
+  const char *p = mb_string, *end = mb_string + nbytes;
+  int chars = 0, width = 0, length;
+
+  if (utf8_locale) {
+    while (p < end) {
+      if (p + 8 <= end && is_printable_ascii_word(p)) {
+        chars += 8;
+        width += 8;
+        p += 8;
+        continue;
+      }
+      length = utf8_length(p);
+      if (length > 0 && p + length <= end) {
+        width += utf8_columns(utf8_decode(p, length));
+        p += length;
+      } else {
+        width += 1;
+        p += 1;
+      }
+      chars++;
+    }
+  } else {
+    for ( ; p < end; mbc_inc(&p, st), chars++)
+      width += mbc_columns(p, st);
+  }
+  if (pchars)
+    *pchars = chars;
+  return width;
+}
+
+
+#ifdef UNIT_TEST
+
+/* compare the UTF-8 fast path with libc (exits with 1 on any difference): make clean; make CFLAGS='-g -DUNIT_TEST=test_multibyte'; LC_ALL=C.UTF-8 ./rlwrap [n] */
+TESTFUNC(test_multibyte, argc, argv, stage) {
+  static const char *pieces[] = { "a", "xyz ", "\xc3\xa9", "\xe4\xb8\xad", "\xf0\x9f\x98\x80", "\xcc\x81", "\x80", "\xc0\xaf", "\xed\xa0\x80",
+                                  "\xe4\xb8", "\xff", "\x1b", "0123456789abcdef" };
+  int i, j, n = argc > 0 ? atoi(argv[0]) : 10000, mismatches = 0, width_mismatches;
+  unsigned long c;
+  char encoded[MB_LEN_MAX + 1];
+  MBSTATE st;
+
+  ONLY_AT_STAGE(TEST_AFTER_OPTION_PARSING);
+  mbc_init();
+  if (!utf8_locale)
+    myerror(FATAL|NOERRNO, "test_multibyte needs a UTF-8 locale");
+  srand(42);
+  for (i = 0; i < n; i++) {
+    char text[200] = "";
+    const char *p;
+    for (j = rand() % 12; j > 0; j--)
+      strcat(text, pieces[rand() % (sizeof(pieces) / sizeof(char *))]);
+    for (p = text; ; p = mbc_next(p, mbc_initstate(&st))) {
+      int fast[6], slow[6], maxlen = rand() % 40;
+      for (utf8_locale = TRUE; ; utf8_locale = FALSE) {
+        int *result = utf8_locale ? fast : slow;
+        result[0] = mbc_next(p, mbc_initstate(&st)) - p;
+        result[1] = mbc_charwidth(p, mbc_initstate(&st));
+        result[2] = mbc_is_valid(p, mbc_initstate(&st));
+        result[3] = is_multibyte(p, mbc_initstate(&st));
+        result[4] = mbc_strnlen(p, maxlen, mbc_initstate(&st));
+        result[5] = mbc_measure(p, strlen(p), mbc_initstate(&st), NULL);
+        if (!utf8_locale)
+          break;
+      }
+      utf8_locale = TRUE;
+      if (memcmp(fast, slow, sizeof(fast))) {
+        printf("mismatch at byte %d of string #%d: fast %d %d %d %d %d %d, slow %d %d %d %d %d %d\n", (int) (p - text), i,
+               fast[0], fast[1], fast[2], fast[3], fast[4], fast[5], slow[0], slow[1], slow[2], slow[3], slow[4], slow[5]);
+        mismatches++;
+      }
+      if (!*p)
+        break;
+    }
+  }
+  printf("%d random strings, %d mismatches\n", n, mismatches);
+  for (c = 0x20, width_mismatches = 0; c < 0x110000; c++) { /* readline uses wcwidth(), so we should agree with it */
+    mbstate_t ps;
+    int width;
+    if (!iswprint((wint_t) c))
+      continue;
+    memset(&ps, 0, sizeof(ps));
+    memset(encoded, 0, sizeof(encoded));
+    wcrtomb(encoded, (wchar_t) c, &ps);
+    if ((width = mbc_columns(encoded, mbc_initstate(&st))) != wcwidth((wchar_t) c) && width_mismatches++ < 10)
+      printf("U+%04lX: wcwidth() says %d, mbc_columns() %d\n", c, wcwidth((wchar_t) c), width);
+  }
+  printf("%d printable characters with a different width than wcwidth() says\n", width_mismatches);
+  exit(mismatches || width_mismatches ? 1 : 0);
+}
+
+#endif /* UNIT_TEST */
 
 #else /* if not MULTIBYTE_AWARE: */
 
+void
+mbc_init(void)
+{
+}
+
 MBSTATE *
 mbc_initstate(MBSTATE *st)
 {
@@ -176,5 +445,24 @@ mbc_strnlen(const char *string, size_t maxlen, MBSTATE *UNUSED(st))
   return strnlen(string, maxlen);
 }
 
+int
+mbc_columns(const char *p, MBSTATE *UNUSED(st))
+{
+  return isprint((unsigned char) *p) ? 1 : 0;
+}
+
+int
+mbc_measure(const char *string, size_t nbytes, MBSTATE *UNUSED(st), int *pchars)
+{
+  size_t i;
+  int width = 0;
+
+  for (i = 0; i < nbytes; i++)
+    width += isprint((unsigned char) string[i]) ? 1 : 0;
+  if (pchars)
+    *pchars = nbytes;
+  return width;
+}
+
 #endif
 
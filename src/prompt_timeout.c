@@ -0,0 +1,146 @@
+/*  prompt_timeout.c: decide how long to wait before cooking a prompt
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License , or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; see the file COPYING.  If not, write to
+    the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+
+    You may contact the author by:
+       e-mail:  hanslub42@gmail.com
+*/
+
+
+/* rlwrap only knows that command's output has ended with a prompt when nothing more has arrived for a while
+   (wait_before_prompt, 40 msec by default). A fast REPL will have written its whole answer long before that, so
+   that every prompt is cooked later than necessary. A slow one may pause in the middle of its output for longer,
+   and have a line fragment mistaken for a prompt.
+
+   With -w auto, we watch command's output:
+
+   - while its output is still coming in, we keep a running average (and mean deviation) of the gaps between
+     successive chunks, in the same way that TCP estimates round trip times. Waiting for the average plus four
+     times the deviation is then normally enough to know that no more output is coming.
+   - when more output arrives after we have cooked a prompt, and before the user has done anything, we have
+     been too hasty. The gap that we didn't wait for is then taken into account (with a much larger weight)
+   - when the user answers a prompt, we know that it really was a prompt (it becomes a known prompt, cf.
+     known_prompts.c). When command's output ends with a known prompt again, we hardly wait at all: only about
+     twice the average gap, in case the prompt is just a line fragment that happens to look the same.
+
+   Until we have seen enough gaps (and the prompt is not a known one) we wait wait_before_prompt msecs, as we
+   would without -w auto. Without -w auto (or before we have seen enough gaps) known prompts are learned and
+   forgotten in the same way, but, as there is no average gap to go by, they are cooked without waiting at all */
+
+
+#include "rlwrap.h"
+
+#define MIN_TIMEOUT_USEC     2000      /* never wait less than this ... */
+#define MAX_TIMEOUT_USEC   500000      /* ... or more than this */
+#define MIN_GAPS                4      /* until we have seen this many gaps, use wait_before_prompt */
+
+enum { OUTPUT_COMING_IN, PROMPT_COOKED, USER_RESPONDED };
+
+static int state = USER_RESPONDED;
+static struct timeval last_output;
+static double mean_gap = 0, gap_deviation = 0;        /* in usecs */
+static int ngaps = 0;
+static char *cooked_prompt = NULL;                    /* the raw prompt that we cooked last */
+static bool output_ends_with_known_prompt = FALSE;
+
+
+static long
+usecs_since(const struct timeval *then)
+{
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return 1000000L * (now.tv_sec - then->tv_sec) + (now.tv_usec - then->tv_usec);
+}
+
+
+static void
+learn_gap(long gap, double weight)
+{
+  double error;
+
+  if (ngaps++ == 0) {
+    mean_gap = gap;
+    gap_deviation = gap / 2.0;
+    return;
+  }
+  error = gap - mean_gap;
+  mean_gap += weight * error;
+  gap_deviation += weight * ((error < 0 ? -error : error) - gap_deviation);
+}
+
+
+/* command has written something; raw_prompt is what comes after its last newline */
+void
+note_command_output(const char *raw_prompt)
+{
+  long gap = last_output.tv_sec ? usecs_since(&last_output) : -1;
+
+  if (gap >= 0 && gap < MAX_TIMEOUT_USEC) {
+    if (state == OUTPUT_COMING_IN) {
+      if (adaptive_wait_before_prompt)
+        learn_gap(gap, 1.0 / 8);
+    } else if (state == PROMPT_COOKED) { /* we have been too hasty */
+      DPRINTF2(DEBUG_TERMIO, "output %ld usec after <%s>: that wasn't a prompt", gap, M(cooked_prompt));
+      if (adaptive_wait_before_prompt)
+        learn_gap(gap, 1.0 / 2);
+      forget_known_prompt(cooked_prompt); /* it may occur in the middle of command's output */
+    }
+  }
+  state = OUTPUT_COMING_IN;
+  gettimeofday(&last_output, NULL);
+  output_ends_with_known_prompt = is_known_prompt(raw_prompt);
+}
+
+
+/* we have decided that raw_prompt is a prompt, and cooked it */
+void
+note_prompt_cooked(const char *raw_prompt)
+{
+  state = PROMPT_COOKED;
+  if (cooked_prompt)
+    free(cooked_prompt);
+  cooked_prompt = mysavestring(raw_prompt);
+}
+
+
+/* the user has pressed a key */
+void
+note_user_input(void)
+{
+  if (state != PROMPT_COOKED)
+    return;
+  state = USER_RESPONDED;
+  learn_known_prompt(cooked_prompt);
+}
+
+
+/* how long to wait for more output before cooking the prompt */
+struct timespec *
+prompt_timeout(struct timespec *timeout)
+{
+  long usecs;
+
+  if (output_ends_with_known_prompt)
+    usecs = adaptive_wait_before_prompt && ngaps >= MIN_GAPS ? max(MIN_TIMEOUT_USEC, (long) (2 * mean_gap)) : 0;
+  else if (!adaptive_wait_before_prompt || ngaps < MIN_GAPS)
+    usecs = 1000L * wait_before_prompt;
+  else
+    usecs = max(MIN_TIMEOUT_USEC, min(MAX_TIMEOUT_USEC, (long) (mean_gap + 4 * gap_deviation)));
+  timeout->tv_sec = usecs / 1000000;
+  timeout->tv_nsec = 1000 * (usecs % 1000000);
+  DPRINTF4(DEBUG_TERMIO, "prompt timeout: %ld usec (average gap %.0f, deviation %.0f usec%s)", usecs, mean_gap, gap_deviation,
+           output_ends_with_known_prompt ? ", known prompt" : "");
+  return timeout;
+}
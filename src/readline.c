@@ -53,6 +53,7 @@ static int direct_keypress(int, int);
 static int direct_prefix(int, int);
 static int handle_hotkey(int, int);
 static int handle_hotkey_without_history(int, int);
+static int search_history(int, int);
 
 /* only useful while debugging: */
 static int debug_ad_hoc(int,int);
@@ -72,6 +73,7 @@ init_readline(char *UNUSED(prompt))
   rl_add_defun("rlwrap-direct-prefix", direct_prefix, -1);
   rl_add_defun("rlwrap-hotkey", handle_hotkey, -1);
   rl_add_defun("rlwrap-hotkey-without-history", handle_hotkey_without_history, -1);
+  rl_add_defun("rlwrap-search-history", search_history, -1);
 
   /* only useful while debugging */
   rl_add_defun("rlwrap-dump-all-keybindings", dump_all_keybindings,-1);
@@ -91,6 +93,7 @@ init_readline(char *UNUSED(prompt))
   bindkey(15, RL_COMMAND_FUN(my_accept_line_and_forget), "emacs-standard; vi-insert; vi-command");	/* ascii #15 (Control-O) is unused in readline's emacs and vi keymaps */
   if (multiline_separator) 
     bindkey(30, RL_COMMAND_FUN(munge_line_in_editor), "emacs-standard;vi-insert;vi-command");           /* CTRL-^: unused in vi-insert-mode, hardly used in emacs  (doubles arrow-up) */
+  bindkey('s', RL_COMMAND_FUN(search_history), "emacs-meta");                                           /* ESC-s (or Meta-s) is unbound in readline's emacs keymaps */
 
   
   
@@ -112,6 +115,7 @@ init_readline(char *UNUSED(prompt))
   rl_redisplay_function = my_redisplay;
   rl_completion_entry_function =
     (rl_compentry_func_t *) & my_completion_function;
+  rl_attempted_completion_function = &my_attempted_completion_function;
   
   rl_catch_signals = FALSE;
   rl_catch_sigwinch = FALSE;
@@ -151,6 +155,7 @@ save_rl_state(void)
   rl_delete_text(0, rl_end);    /* clear line  (after prompt) */
   rl_point = 0;
   my_redisplay();               /* and redisplay (this time without user input, cf the comments for the line_handler() function below) */
+  forget_displayed_line();      /* command's output will follow */
 #ifdef HAVE_RL_FREE_UNDO_LIST
   rl_free_undo_list();          /* prevent readline > 8.3 from reverting the most recently entered history item  */
 #endif  
@@ -173,6 +178,7 @@ restore_rl_state(void)
   rl_expand_prompt(newprompt);
   DPRINTF1(DEBUG_READLINE, "newprompt after rl_expand_prompt(): <%s>", M(newprompt));
   mirror_slaves_echo_mode();    /* don't show passwords etc */
+  pick_up_shared_history();     /* only with --share-history */
   
   DPRINTF1(DEBUG_READLINE,"newprompt now <%s>", M(newprompt));
   rl_callback_handler_install(newprompt, &line_handler);
@@ -182,6 +188,8 @@ restore_rl_state(void)
   rl_point = saved_rl_state.point;
   saved_rl_state.already_saved = 0;
   rl_redisplay(); 
+  highlight_input_line(TRUE);
+  forget_displayed_line();      /* rl_redisplay() may have printed the prompt behind my_homegrown_redisplay()'s back */
   rl_prep_terminal(1);
   prompt_is_still_uncooked =  FALSE; /* has been done right now */
 }
@@ -216,6 +224,8 @@ line_handler(char *line)
   char *rewritten_line, *filtered_line;
   bool history_can_safely_be_extended = !invoked_by_operate_and_get_next ||  history_duplicate_avoidance_policy != ELIMINATE_ALL_DOUBLES;
   DPRINTF1(DEBUG_HISTORY, "history_can_safely_be_extended: %d", history_can_safely_be_extended);
+  forget_displayed_line(); /* the next line will be a new one */
+  forget_highlighting();
   if (line == NULL) {           /* EOF on input, forward it  */
     DPRINTF1(DEBUG_READLINE, "EOF detected, writing character %d", term_eof);
     /* colour_the_prompt = FALSE; don't mess with the cruft that may come out of dying command @@@ but command may not die!*/
@@ -364,6 +374,33 @@ my_accept_line_and_forget(int count, int UNUSED(key))
   return my_accept_line(count, '\n');
 }
 
+/* this function will be bound to rlwrap-search-history (ESC-s by default): fetch the newest history entry that contains
+   the current input. Pressing it again fetches the next older one that contains the same text */
+static int
+search_history(int UNUSED(count), int UNUSED(key))
+{
+  static char *searched_text = NULL;
+  static int found = -1;
+  int where;
+
+  if (rl_last_func != search_history || !searched_text) {
+    if (searched_text)
+      free(searched_text);
+    searched_text = mysavestring(rl_line_buffer);
+    found = history_length;
+  }
+  if (!*searched_text || (where = search_history_for(searched_text, found)) < 0) {
+    rl_ding();
+    return 0;
+  }
+  found = where;
+  history_set_pos(where);
+  rl_replace_line(history_get(history_base + where)->line, TRUE);
+  rl_point = strstr(rl_line_buffer, searched_text) - rl_line_buffer;
+  return 0;
+}
+
+
 static int
 dump_all_keybindings(int count, int key)
 {
@@ -403,10 +440,13 @@ my_add_history(const char *line)
   /* as a separate history item (I believe that is what bash does as well).                                         */
 
   DPRINTF1(DEBUG_HISTORY, "my_add_history: %s", line);
+  finish_loading_history(); /* normally, this will already have happened when Enter was pressed */
   list = split_with(line,"\n"); 
   for (lineptr = list; *lineptr; lineptr++) {
     filtered_line =  pass_through_filter(TAG_HISTORY, *lineptr);
     DPRINTF1(DEBUG_HISTORY, "after splitting (and filtering) %s", filtered_line);
+    append_to_history_file(filtered_line); /* only with --append-history. This comes first, as with --share-history it may add lines
+                                              from other sessions, which have to be there before we look for duplicates */
     
   
     switch (history_duplicate_avoidance_policy) { 
@@ -415,7 +455,8 @@ my_add_history(const char *line)
     case ELIMINATE_SUCCESIVE_DOUBLES:
       lookback = 1; break;
     case ELIMINATE_ALL_DOUBLES:
-      lookback = history_length; break;
+      remove_from_history(filtered_line); /* cf. histindex.c */
+      lookback = 0; break;
     default: lookback = 0;
     }
 
@@ -435,20 +476,121 @@ my_add_history(const char *line)
         free_foreign(entry);
       }
     }
-    add_history(new_entry);
+    log_history_entry(new_entry);      /* only with --binary-history */
+    add_to_history(new_entry);
     free(new_entry);
   }
   free_splitlist(list);
 }
   
-/* Homegrown redisplay function - erases current line and prints the
-   new one.  Used for passwords (where we want to show **** instead of
-   user input) and whenever HOMEGROWN_REDISPLAY is defined (for
-   systems where rl_redisplay() misbehaves, like sometimes on
-   Solaris). Otherwise we use the much faster and smoother
-   rl_redisplay() This function cannot display multiple lines: it will
-   only scroll horizontally (even if horizontal-scroll-mode is off in
-   .inputrc)
+/* What my_homegrown_redisplay() has last printed on the current screen line, or NULL if we don't know (e.g. because
+   something else has been printed since) */
+static char *displayed_line = NULL;
+static int displayed_invisible_chars; /* the number of invisible chars (in the prompt, if shown) in displayed_line */
+static int cursor_column = -1;        /* where my_homegrown_redisplay() has left the cursor (-1 if we don't know) */
+
+void
+forget_displayed_line(void)
+{
+  if (displayed_line)
+    free(displayed_line);
+  displayed_line = NULL;
+  cursor_column = -1;
+}
+
+
+static void
+move_cursor_to_column(int column)
+{
+  if (column != cursor_column)
+    cursor_hpos(column);
+  cursor_column = column;
+}
+
+
+static void
+cursor_has_moved(int ncolumns)
+{
+  if (cursor_column >= 0)
+    cursor_column += ncolumns;
+  if (cursor_column >= winsize.ws_col) /* the cursor may or may not have wrapped around */
+    cursor_column = -1;
+}
+
+
+static void
+write_at_cursor(const char *string, int length)
+{
+  write_patiently(STDOUT_FILENO, string, length, "to stdout");
+  cursor_has_moved(length);
+}
+
+
+static int
+is_printable_ascii(const char *string)
+{
+  for (; *string; string++)
+    if (*string < ' ' || *string > '~')
+      return FALSE;
+  return TRUE;
+}
+
+
+/* Change the screen line from displayed_line into new_line by moving the cursor past their common prefix and
+   then writing only what has changed (using the terminals insert- or delete-character capability, if that
+   is cheaper). Both lines have invisible_chars invisible chars within their first first_changeable
+   bytes (i.e. in the prompt).  Returns FALSE, without writing anything, if this isn't possible */
+static int
+redraw_difference(const char *new_line, int invisible_chars, int first_changeable)
+{
+  const char *old_line = displayed_line;
+  int old_length = strlen(old_line), new_length = strlen(new_line);
+  int prefix, suffix, ninserted, ndeleted, cost_of_rewriting;
+  char *code = NULL;
+
+  if (invisible_chars != displayed_invisible_chars ||
+      old_length < first_changeable || new_length < first_changeable ||
+      !is_printable_ascii(old_line + first_changeable) || !is_printable_ascii(new_line + first_changeable)) /* only then is every byte one column */
+    return FALSE;
+  for (prefix = 0; prefix < old_length && old_line[prefix] == new_line[prefix]; prefix++)
+    ;
+  if (prefix < first_changeable)  /* prompt has changed */
+    return FALSE;
+  for (suffix = 0; suffix < old_length - prefix && suffix < new_length - prefix &&
+         old_line[old_length - 1 - suffix] == new_line[new_length - 1 - suffix]; suffix++)
+    ;
+  ninserted = new_length - prefix - suffix;
+  ndeleted  = old_length - prefix - suffix;
+  DPRINTF4(DEBUG_READLINE, "redisplay: %d chars unchanged, %d inserted, %d deleted, %d unchanged at end", prefix, ninserted, ndeleted, suffix);
+
+  if (ninserted == 0 && ndeleted == 0)
+    return TRUE;
+  move_cursor_to_column(prefix - invisible_chars);
+  cost_of_rewriting = new_length - prefix + (new_length < old_length ? clear_to_eol_length(old_length - new_length) : 0);
+  if (ninserted == 0 && (code = delete_chars_code(ndeleted)) && (int) strlen(code) < cost_of_rewriting) {
+    my_putstr(code);
+  } else if (ndeleted == 0 && (code = insert_chars_code(ninserted)) && (int) strlen(code) + ninserted < cost_of_rewriting) {
+    my_putstr(code);
+    write_at_cursor(new_line + prefix, ninserted);
+  } else {
+    write_at_cursor(new_line + prefix, new_length - prefix);
+    if (new_length < old_length)
+      cursor_has_moved(clear_to_eol(old_length - new_length));
+  }
+  if (code)
+    free(code);
+  return TRUE;
+}
+
+
+/* Homegrown redisplay function - prints the new line, or only the
+   part that has changed since the last time.  Used for passwords
+   (where we want to show **** instead of user input) and whenever
+   HOMEGROWN_REDISPLAY is defined (for systems where rl_redisplay()
+   misbehaves, like sometimes on Solaris). Otherwise we use the much
+   smoother rl_redisplay() This function cannot display multiple
+   lines: it will only scroll horizontally (even if
+   horizontal-scroll-mode is off in .inputrc)
 */
 
 
@@ -458,8 +600,6 @@ my_homegrown_redisplay(int hide_passwords)
   static int line_start = 0;    /* at which position of prompt_plus_line does the printed line start? */
   static int line_extends_right = 0;
   static int line_extends_left = 0;
-  static char *previous_line = NULL;
-  
   
   int width = winsize.ws_col;
   int skip = max(1, min(width / 5, 10));        /* jumpscroll this many positions when cursor reaches edge of terminal */
@@ -474,7 +614,7 @@ my_homegrown_redisplay(int hide_passwords)
   int curpos = promptlen + rl_point; /* cursor position within prompt_plus_line */
   int i, printed_length,
     new_curpos,                    /* cursor position on screen */
-    keep_old_line, vlinestart, printwidth, last_column;
+    keep_old_line, vlinestart, printwidth, last_column, shown_invisible_chars;
 
   /* In order to handle prompt with colour we either print the whole prompt, or start past it:
      starting in the middle is too difficult (i.e. I am too lazy) to get it right.
@@ -550,27 +690,30 @@ my_homegrown_redisplay(int hide_passwords)
 
   
 
-  keep_old_line = FALSE;
-  if (term_cursor_hpos) {
-    if (previous_line && strcmp(new_line, previous_line) == 0) {
-      keep_old_line = TRUE;
-    } else {
-      if (previous_line)
-        free(previous_line);
-      previous_line = mysavestring(new_line);
-    }
-  }
-  /* keep_old_line = TRUE; */
+#ifdef RL_STATE_DISPATCHING
+  if (RL_ISSTATE(RL_STATE_DISPATCHING))  /* called from within a readline command (e.g. after listing completions): */
+    forget_displayed_line();             /* the screen may have changed behind our back                            */
+#endif
+
+  shown_invisible_chars = (line_start > 0 ? 0 : invisible_chars_in_prompt);
+  keep_old_line = term_cursor_hpos && displayed_line &&
+    redraw_difference(new_line, shown_invisible_chars, line_start > 0 ? 0 : promptlen);
   if (!keep_old_line) {
     clear_line();
     cr();
     write_patiently(STDOUT_FILENO, new_line, printed_length, "to stdout");
   }
+  if (term_cursor_hpos) {
+    if (displayed_line)
+      free(displayed_line);
+    displayed_line = mysavestring(new_line);
+    displayed_invisible_chars = shown_invisible_chars;
+  }
   
   assert(term_cursor_hpos || !keep_old_line);   /* if we cannot position cursor, we must have reprinted ... */
 
   if (term_cursor_hpos)
-    cursor_hpos(new_curpos);
+    move_cursor_to_column(new_curpos);
   else                          /* ... so we know we're 1 past last position on line */
     backspace(last_column - new_curpos);
   free(prompt_plus_line);
@@ -592,6 +735,7 @@ my_redisplay(void)
 #ifndef HOMEGROWN_REDISPLAY
   if (redisplay && !debug_force_homegrown_redisplay) {
     rl_redisplay();
+    highlight_input_line(FALSE); /* cf. highlight.c */
   } else
 #endif
     my_homegrown_redisplay(!redisplay);
@@ -827,6 +971,7 @@ handle_hotkey2(int UNUSED(count), int hotkey, int without_history)
     char **linep, **history_lines = split_on_single_char(new_history, '\n', 0);
     DPRINTF3(DEBUG_READLINE, "hash=%lx, new_history is %d bytes long, histpos <%s>", hash, (int) strlen(new_history), new_histpos_as_string);
     clear_history();
+    forget_history_index();
     for (linep = history_lines; *linep; linep++) 
       add_history(*linep);
     new_histpos = my_atoi(new_histpos_as_string);
@@ -918,7 +1063,7 @@ move_cursor_to_start_of_prompt(int erase)
     return; /* @@@ is this necessary ?*/
 
 	
-  promptlen_on_screen =  colourless_strlen_unmarked(saved_rl_state.cooked_prompt ? saved_rl_state.cooked_prompt : saved_rl_state.raw_prompt, termwidth);
+  promptlen_on_screen =  prompt_layout(saved_rl_state.cooked_prompt ? saved_rl_state.cooked_prompt : saved_rl_state.raw_prompt, termwidth) -> width;
   curpos = (within_line_edit ? 1 : 0); /* if the user has pressed a key the cursor will be 1 past the current prompt */
   assert(termwidth > 0); 
   number_of_lines_in_prompt = 1 +  ((promptlen_on_screen + curpos -1) / termwidth); /* integer arithmetic! (e.g. 171/80 = 2) */
@@ -970,6 +1115,8 @@ char *process_new_output(const char* buffer, struct rl_state* UNUSED(state)) {
   last_nl = strrchr(old_prompt_plus_new_output, '\n');
   if (last_nl != NULL) {        /* newline seen, will get new prompt: */
     new_prompt = mysavestring(last_nl +1); /* chop off the part after the last newline -  this will be the new prompt */
+    start_virtual_line();
+    feed_virtual_line(new_prompt);
     *last_nl = '\0';
     old_prompt_plus_new_output = append_and_free_old (old_prompt_plus_new_output, "\n");
     result = (impatient_prompt ? mysavestring (old_prompt_plus_new_output): pass_through_filter(TAG_OUTPUT, old_prompt_plus_new_output));
@@ -978,6 +1125,7 @@ char *process_new_output(const char* buffer, struct rl_state* UNUSED(state)) {
     }
   } else {      
     new_prompt = mysavestring(old_prompt_plus_new_output);
+    feed_virtual_line(buffer);
     result = mysavestring("");
   }                 
   free(old_prompt_plus_new_output);
@@ -992,7 +1140,58 @@ char *process_new_output(const char* buffer, struct rl_state* UNUSED(state)) {
 
 
 
+/* Most commands print the same prompt, over and over again. Cooking it (stripping, unbackspacing, matching, filtering
+   and colourising) always gives the same result for the same raw prompt, as long as the options don't change (they
+   don't, after startup) and the filter doesn't declare its prompts to be dynamic (like count_in_prompt's are).
+   So we keep the last few cooked prompts, keyed by their raw prompt                                             */
+
+#define PROMPT_CACHE_SIZE 16            /* must be a power of 2 */
+#define MAX_CACHED_PROMPT_LENGTH 1024   /* impatient rlwrap may see long stretches of output as "prompts" */
+
+static struct cooked_prompt {
+  char *raw;       /* NULL: empty slot */
+  char *cooked;    /* saved_rl_state.cooked_prompt */
+  char *rubbish;   /* what had to be written before the prompt (only if !impatient_prompt) */
+  int retval;      /* what cook_prompt_if_necessary() returned */
+} prompt_cache[PROMPT_CACHE_SIZE];
+
+
+static bool
+prompt_cache_usable(const char *raw_prompt)
+{
+  return strlen(raw_prompt) <= MAX_CACHED_PROMPT_LENGTH && !filter_prompts_are_dynamic();
+}
+
+
+static struct cooked_prompt *
+prompt_cache_slot(const char *raw_prompt)
+{
+  return &prompt_cache[hash_multiple(1, raw_prompt) & (PROMPT_CACHE_SIZE - 1)];
+}
+
+
+static void
+remember_cooked_prompt(const char *raw_prompt, const char *cooked, const char *rubbish, int retval)
+{
+  struct cooked_prompt *slot;
+
+  if (!prompt_cache_usable(raw_prompt))
+    return;
+  slot = prompt_cache_slot(raw_prompt);
+  if (slot->raw) {
+    free(slot->raw);
+    free(slot->cooked);
+    free(slot->rubbish);
+  }
+  slot->raw = mysavestring(raw_prompt);
+  slot->cooked = mysavestring(cooked);
+  slot->rubbish = mysavestring(rubbish);
+  slot->retval = retval;
+}
+
+
 int cook_prompt_if_necessary (void) {
+  struct cooked_prompt *cached;
   char *pre_cooked, *slightly_cooked, *rubbish_from_alternate_screen,  *filtered, *uncoloured, *cooked, *p, *non_rubbish = NULL;
   static char **term_ctrl_seqs[] 
     = {&term_rmcup, &term_rmkx, NULL}; /* (NULL-terminated) list of (pointers to) term control sequences that may be
@@ -1007,7 +1206,16 @@ int cook_prompt_if_necessary (void) {
   if (saved_rl_state.cooked_prompt)    /* if (!prompt_is_still_uncooked) bombs with multi-line paste. Apparently
                                         prompt_is_still_uncooked can be FALSE while saved_rl_state.cooked_prompt = NULL. Ouch!@@@! */
     return FALSE;  /* cooked already */
-  
+
+  if (prompt_cache_usable(saved_rl_state.raw_prompt) &&
+      (cached = prompt_cache_slot(saved_rl_state.raw_prompt))->raw && strcmp(cached->raw, saved_rl_state.raw_prompt) == 0) {
+    DPRINTF1(DEBUG_READLINE, "Prompt <%s> cooked already (found in cache)", M(cached->cooked));
+    if (cached->retval && !impatient_prompt)
+      write_patiently(STDOUT_FILENO, cached->rubbish, strlen(cached->rubbish), "to stdout");
+    saved_rl_state.cooked_prompt = mysavestring(cached->cooked);
+    return cached->retval;
+  }
+
   pre_cooked = mysavestring(saved_rl_state.raw_prompt);
 
   
@@ -1028,11 +1236,10 @@ int cook_prompt_if_necessary (void) {
     rubbish_from_alternate_screen = mysavestring("");
   }
   
-  slightly_cooked = ansi_colour_aware ? protect_or_cleanup(pre_cooked, FALSE) : mysavestring(pre_cooked);
+  /* interpret CR, Backspace and (with -A) escape codes, as the terminal would. Programs that display a running counter
+     would otherwise make rlwrap keep prompts like " 1%\r 2%\r 3%\ ......" */
+  slightly_cooked = non_rubbish ? interpret_line(pre_cooked) : virtual_line_as_prompt(saved_rl_state.raw_prompt);
   free(pre_cooked);
-  
-  unbackspace(slightly_cooked); /* programs that display a running counter would otherwise make rlwrap keep prompts
-                              like " 1%\r 2%\r 3%\ ......" */
 
   if ( /* raw prompt doesn't match '--only-cook' regexp */
       (prompt_regexp && ! match_regexp(slightly_cooked, prompt_regexp, FALSE)) ||
@@ -1041,8 +1248,11 @@ int cook_prompt_if_necessary (void) {
     /* don't cook, eat raw (and eat nothing if patient) */       
     saved_rl_state.cooked_prompt =  (impatient_prompt ? mysavestring(slightly_cooked) : mysavestring("")); 
     /* NB: if impatient, the rubbish_from_alternate_screen has been output already, no need to send it again */  
+    remember_cooked_prompt(saved_rl_state.raw_prompt, saved_rl_state.cooked_prompt, "", FALSE);
     free(slightly_cooked);
-    free(filtered); /* free(NULL) is never an error */
+    free(rubbish_from_alternate_screen);
+    if (filtered)
+      free(filtered);
     return FALSE;
   }   
   free(slightly_cooked);
@@ -1062,6 +1272,7 @@ int cook_prompt_if_necessary (void) {
                               it in the prompt, as this may be re-printed e.g. after resuming a suspended rlwrap */                            
     write_patiently(STDOUT_FILENO,rubbish_from_alternate_screen, strlen(rubbish_from_alternate_screen), "to stdout");
 
+  remember_cooked_prompt(saved_rl_state.raw_prompt, cooked, rubbish_from_alternate_screen, TRUE);
   free(rubbish_from_alternate_screen);
   saved_rl_state.cooked_prompt = cooked;
   return TRUE;
@@ -43,6 +43,7 @@
 #include <sys/ioctl.h>
 #include <sys/resource.h>
 #include <fcntl.h>
+#include <dirent.h>
 #include <unistd.h>
 #include <signal.h>
 #include <stdio.h>
@@ -59,6 +60,9 @@
 
 #include <stdlib.h>
 #include <locale.h>
+#ifdef HAVE_LANGINFO_H
+#  include <langinfo.h>
+#endif
 
 
 #include <sched.h>
@@ -76,6 +80,15 @@
 #include <sys/file.h>
 #endif
 
+#if HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#if HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#include <sys/vfs.h>  /* statfs(), to find out whether inotify can be trusted */
+#endif
+
 #ifdef HAVE_GETOPT_H
 #  include <getopt.h>
 #endif
@@ -232,6 +245,8 @@ extern char *program_name, *command_name;
 extern int always_readline;
 extern int always_echo;
 extern int complete_filenames;
+extern int fuzzy_completion;
+extern int completion_limit;
 extern int within_line_edit;
 extern int screen_is_alternate;
 extern pid_t command_pid;
@@ -266,6 +281,7 @@ extern int colour_the_prompt;
 extern int received_WINCH;
 extern int prompt_is_still_uncooked;
 extern int wait_before_prompt;
+extern bool adaptive_wait_before_prompt;
 extern int mirror_arguments;
 extern int impatient_prompt;
 extern int we_just_got_a_signal_or_EOF;
@@ -275,6 +291,7 @@ extern int accepted_lines;
 extern char *filter_command;
 extern int skip_setctty;
 extern int polling;
+extern int resize_delay;
 
 void cleanup_rlwrap_and_exit(int status);
 void put_in_output_queue(char *stuff);
@@ -296,6 +313,7 @@ void restore_rl_state(void);
 void message_in_echo_area(char *message);
 void init_readline(char *);
 void my_redisplay(void);
+void forget_displayed_line(void);
 char *decode_colour_spec(const char *colour_spec);
 void reprint_prompt(int coloured);
 char *colourise (const char *prompt);
@@ -340,6 +358,8 @@ void unblock_all_signals(void);
 void ignore_sigchld(void);
 void suicide_by(int sig, int status);
 int  adapt_tty_winsize(int from_fd, int to_fd);
+bool wait_for_resize_to_settle(struct timespec *timeout, struct timespec **timeoutptr);
+void act_on_settled_resize(void);
 void myalarm(int msec);
 void handle_sigALRM(int signo);
 char *signal_name(int signal);
@@ -372,11 +392,13 @@ void  mirror_args(pid_t command_pid);
 
 void  myerror(int error_flags, const char *message, ...);
 void  *mymalloc(size_t size);
+void  *myrealloc(void *ptr, size_t old_size, size_t new_size);
 void  free_multiple(void *ptr, ...);
 void  mysetsid(void);
 void  close_open_files_without_writing_buffers(void);
 size_t filesize(const char *filename);
 void  my_fopen(FILE  **pfp, const char *path, const char *mode, const char *description);
+char *read_line(FILE *fp);
 void  open_logfile(const char *filename);
 void  write_logfile(const char *str);
 void  close_logfile(void);
@@ -384,6 +406,7 @@ void  timestamp(char *buf, int size);
 unsigned long hash_multiple(int n, ...);
 int   killed_by(int status);
 void  change_working_directory(void);
+char *command_working_directory(void);
 void  log_terminal_settings(struct termios *terminal_settings);
 void  log_fd_info(int fd);
 void  last_minute_checks(void);
@@ -428,6 +451,17 @@ char *mark_invisible(const char *buf);
 char *copy_and_unbackspace(const char *original);
 int colourless_strlen(const char *str, char **pcopy_without_ignore_markers, int termwidth, int stop_at, char **stopptr);
 int colourless_strlen_unmarked (const char *str, int termwidth);
+
+struct prompt_layout {
+  char *string;         /* the string that was laid out ...                                      */
+  int termwidth;        /* ... on a terminal this wide                                            */
+  char *colourless;     /* string without its invisible parts (colour codes, RL_PROMPT_*_IGNORE) */
+  int chars;            /* number of (multi-byte) characters in colourless                        */
+  int width;            /* number of screen columns they take up                                  */
+  int rows;             /* number of screen rows (1 if termwidth == 0)                            */
+  int last_row;         /* offset in colourless of the start of the last row                      */
+};
+const struct prompt_layout *prompt_layout(const char *str, int termwidth);
 char *get_last_screenline(char *long_line, int termwidth);
 char *lowercase(const char *str);
 int match_regexp(const char *string, const char *regexp, int case_insensitive);
@@ -436,7 +470,6 @@ int isnumeric(char *string);
 char *append_field_and_free_old(char *message, const char *field);
 char *merge_fields(char *field, ...);
 char **split_filter_message(char *message, int *count);
-char *protect_or_cleanup(char *prompt, bool free_prompt);
 void check_cupcodes(const char *client_output);
 
 /* in pty.c: */
@@ -461,12 +494,111 @@ int ptytty_openpty(int *amaster, int *aslave, const void **ptytty_or_ttydev);
 /* in completion.rb: */
 void init_completer(void);
 void feed_file_into_completion_list(const char *completions_file, bool warn_if_unreadable);
+void compile_completions_file(const char *completions_file);
 void feed_line_into_completion_list(const char *line);
+void feed_completion_file_line(const char *line);
+void end_of_completion_file(void);
 void add_word_to_completions(const char *word);
 void remove_word_from_completions(const char *word);
 char *my_completion_function(char *prefix, int state);
+char **my_attempted_completion_function(const char *text, int start, int end);
 
 extern int completion_is_case_sensitive;
+int compare(const char *string1, const char *string2);
+
+/* in wordindex.c: */
+void write_word_index(const char *source, const char **words, long nwords);
+bool load_word_index(const char *source, bool warn_if_stale);
+const char **indexed_words_with_prefix(const char *prefix, const char *after, int max_per_list);
+bool word_is_indexed(const char *word);
+bool unindex_word(const char *word);
+bool add_indexed_words_to_bktree(int max_words);
+
+/* in bktree.c: */
+int edit_distance(const char *word1, const char *word2, int max_distance);
+void bktree_add(const char *word);
+void bktree_remove(const char *word);
+const char **bktree_lookup(const char *word, int max_distance);
+int keep_words_within_edit_distance(const char *word, int max_distance, char **words, int count);
+
+/* in dircache.c: */
+char **cached_filename_completions(const char *prefix);
+int filename_is_cached(const char *filename);
+int filename_is_directory(const char *filename);
+unsigned long directory_listing_version(const char *prefix);
+
+/* in histindex.c: */
+void add_to_history(const char *line);
+int  remove_from_history(const char *line);
+void forget_history_index(void);
+
+/* in histsearch.c: */
+bool search_index_is_in_sync(void);
+void add_to_search_index(const char *line);
+void remove_from_search_index(int which);
+void forget_search_index(void);
+int  search_history_for(const char *text, int before);
+
+/* in histlog.c: */
+void start_history_log(const char *history_file, bool writable);
+void log_history_entry(const char *line);
+void log_duration_until_prompt(void);
+
+/* in histtool.c: */
+void run_history_tool(const char *tool, char **files, int nfiles, int histsize);
+
+/* in histfile.c: */
+int  open_locked(const char *filename, int flags);
+void start_appending_history(const char *filename, long nlines);
+void start_sharing_history(const char *filename, long nlines);
+bool appending_history(void);
+void append_to_history_file(const char *line);
+void pick_up_shared_history(void);
+
+/* in prompt_timeout.c: */
+void note_command_output(const char *raw_prompt);
+void note_prompt_cooked(const char *raw_prompt);
+void note_user_input(void);
+struct timespec *prompt_timeout(struct timespec *timeout);
+
+/* in known_prompts.c: */
+bool is_known_prompt(const char *raw_prompt);
+void forget_known_prompt(const char *raw_prompt);
+void read_known_prompts(const char *filename);
+void learn_known_prompt(const char *raw_prompt);
+
+
+/* in virtual_line.c: */
+void start_virtual_line(void);
+void feed_virtual_line(const char *output);
+char *virtual_line_as_prompt(const char *raw_prompt);
+char *interpret_line(const char *raw);
+
+/* in dfa.c: */
+struct dfa;
+struct dfa *compile_dfa(const char *regexp, bool case_insensitive);
+void dfa_restart(struct dfa *dfa);
+void dfa_feed(struct dfa *dfa, const char *text, size_t length);
+bool dfa_has_matched(struct dfa *dfa);
+
+/* in lazyload.c: */
+long load_history_lazily(const char *filename, bool feed_completions);
+void load_completions_lazily(const char *filename, bool warn_if_unreadable, bool with_sections);
+bool lists_are_loading(void);
+bool history_is_loaded(void);
+void finish_loading_history(void);
+void finish_loading_lists(void);
+void finish_loading_lists_before(int key);
+int  my_pselect_while_loading(int n, fd_set *readfds, fd_set *writefds, const struct timespec *ptimeout_ts, const sigset_t *sigmask);
+
+/* in fuzzy.c: */
+uint64_t fuzzy_charmask(const char *word);
+void fuzzy_add_segment(const uint64_t *masks, const uint64_t *offsets, const char *strings, long nwords);
+void fuzzy_add_word(const char *word);
+void fuzzy_remove_word(const char *word);
+const char **fuzzy_matches(const char *query, int skip, int limit, bool *more);
+int fuzzy_is_match(const char *query, const char *word);
+int fuzzy_rank(const char *query, char **words, int count);
 
 
 /* in term.c: */
@@ -477,6 +609,10 @@ void prepare_terminal(void);
 void cr(void);
 void backspace(int);
 void clear_line(void);
+int clear_to_eol(int count);
+int clear_to_eol_length(int count);
+char *insert_chars_code(int count);
+char *delete_chars_code(int count);
 void clear_the_screen(void);
 void curs_up(void);
 void curs_down(void);
@@ -524,12 +660,19 @@ extern int filter_is_dead;
 void spawn_filter(const char *filter_commandline);
 void kill_filter(void);
 int filter_is_interested_in(int tag); 
+bool filter_prompts_are_dynamic(void);
 char *pass_through_filter(int tag, const char *buffer);
 char *filters_last_words(void);
 void filter_test(void);
 
 
 
+/* in highlight.c: */
+extern bool highlighting;
+void read_highlighting_file(const char *filename, bool warn_if_unreadable);
+void highlight_input_line(int repaint_everything);
+void forget_highlighting(void);
+
 /* in multibyte.c: */
 
 #ifdef MULTIBYTE_AWARE /* i.e. if configured with --enable-multibyte-aware  */
@@ -539,6 +682,7 @@ void filter_test(void);
    #define MBSTATE int
 #endif
 
+void mbc_init(void);
 MBSTATE * mbc_initstate(MBSTATE *st);
 MBSTATE *mbc_copystate(MBSTATE st, MBSTATE *stc);
 int mbc_is_valid(const char *mb_string, const MBSTATE *st);
@@ -549,6 +693,8 @@ int is_multibyte(const char *mb_char, const MBSTATE *st);
 const char *mbc_inc(const char **mbc, MBSTATE *st);
 void mbc_copy(const char *p, char **q, MBSTATE *st);
 size_t mbc_strnlen(const char *mb_string, size_t maxlen, MBSTATE *st);
+int mbc_columns(const char *p, MBSTATE *st);
+int mbc_measure(const char *mb_string, size_t nbytes, MBSTATE *st, int *pchars);
 
 
 
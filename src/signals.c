@@ -27,6 +27,8 @@ int filters_exit_status = 0;
 int deferred_adapt_commands_window_size = FALSE; /* whether we have to adapt clients winsize when accepting a line */
 int signal_handlers_were_installed = FALSE; 
 int received_sigALRM =  FALSE;
+static bool resize_pending = FALSE;            /* a SIGWINCH has arrived, but we haven't acted on it yet (cf. resize_delay) */
+static struct timeval last_resize;
 
 static void change_signalmask(int, int *);
 static void child_died(int);
@@ -263,6 +265,12 @@ pass_on_signal(int signo)
 
   switch (signo) {
   case SIGWINCH: /* non-POSIX, but present on most systems */
+    if (resize_delay > 0) {     /* wait until the resize has settled, cf. act_on_settled_resize() */
+      gettimeofday(&last_resize, NULL);
+      resize_pending = TRUE;
+      pass_it_on = FALSE;
+      break;
+    }
     /* Make slave pty's winsize equal to that of STDIN. Pass the signal on *only if*
        winsize has changed. This is particularly important because we have the slave pty
        still open - when we pass on the signal the child will probably do a TIOCSWINSZ ioctl()
@@ -322,8 +330,10 @@ adapt_tty_winsize(int from_fd, int to_fd)
       received_WINCH = TRUE;           /* we can't start line edit in signal handler, so we only set a flag */
     } else if (within_line_edit) {      /* try to keep displayed line tidy */
       wipe_textarea(&old_winsize);
+      forget_displayed_line();
       rl_on_new_line();
       rl_redisplay();
+      highlight_input_line(TRUE);
       
     }
     
@@ -334,14 +344,66 @@ adapt_tty_winsize(int from_fd, int to_fd)
   
 }
 
+/* Dragging a terminal window's edge sends us dozens of SIGWINCHes per second. Acting on every one of them would make
+   both readline and command redraw as many times. With resize_delay > 0 (-Z), pass_on_signal() only notes the time of
+   the last SIGWINCH, and the main loop (which will wait no longer than necessary, cf. wait_for_resize_to_settle()) calls
+   act_on_settled_resize() once no SIGWINCH has arrived for resize_delay msecs: only then do we adapt to the (latest)
+   size, redraw, and pass a single SIGWINCH on to command */
+
+static long
+usecs_until_resize_settles(void)
+{
+  struct timeval now;
+  long elapsed;
+
+  gettimeofday(&now, NULL);
+  elapsed = 1000000L * (now.tv_sec - last_resize.tv_sec) + (now.tv_usec - last_resize.tv_usec);
+  return max(0, 1000L * resize_delay - elapsed);
+}
+
+
+/* make *timeoutptr (NULL means: forever) point to timeout if a pending resize settles sooner. Returns TRUE if it does */
+bool
+wait_for_resize_to_settle(struct timespec *timeout, struct timespec **timeoutptr)
+{
+  long usecs;
+
+  if (!resize_pending)
+    return FALSE;
+  usecs = usecs_until_resize_settles();
+  if (*timeoutptr && 1000000L * (*timeoutptr)->tv_sec + (*timeoutptr)->tv_nsec / 1000 <= usecs)
+    return FALSE;
+  timeout->tv_sec = usecs / 1000000;
+  timeout->tv_nsec = 1000 * (usecs % 1000000);
+  *timeoutptr = timeout;
+  return TRUE;
+}
+
+
+void
+act_on_settled_resize(void)
+{
+  if (!resize_pending || usecs_until_resize_settles() > 0)
+    return;
+  resize_pending = FALSE;
+  DPRINTF0(DEBUG_SIGNALS, "resize has settled");
+  if (adapt_tty_winsize(STDIN_FILENO, master_pty_fd) && command_pid) {
+    int ret = kill(-command_pid, SIGWINCH);
+    MAYBE_UNUSED(ret); /* only used in the debug log */
+    DPRINTF2(DEBUG_SIGNALS, "kill(%d,SIGWINCH) = %d", -command_pid, ret);
+    we_just_got_a_signal_or_EOF = TRUE;
+  }
+}
+
+
 /* After a resize, clear all the lines that were occupied by prompt + line buffer before the resize */
 static
 void wipe_textarea(struct winsize *old_winsize)
 {
   int point, lineheight, linelength, cursor_height, i, promptlength;
   if (!prompt_is_single_line()) {       /* Don't need to do anything in horizontal_scroll_mode  */
-    promptlength = colourless_strlen((saved_rl_state.cooked_prompt ? saved_rl_state.cooked_prompt:  saved_rl_state.raw_prompt),
-                                     NULL, old_winsize -> ws_col, 0, NULL); 
+    promptlength = prompt_layout((saved_rl_state.cooked_prompt ? saved_rl_state.cooked_prompt:  saved_rl_state.raw_prompt),
+                                 old_winsize -> ws_col) -> width; 
     linelength = (within_line_edit ? strlen(rl_line_buffer) : 0) + promptlength;
     point = (within_line_edit ? rl_point : 0) + promptlength;
     assert(old_winsize -> ws_col > 0);
@@ -780,108 +780,189 @@ copy_next(int n, const char **original, char **copy)
 
 
 
-/* helper function: returns the number of displayed characters (the "colourless length") of str (which has to have its
-   unprintable sequences marked with RL_PROMPT_*_IGNORE).  
-   It works internally by building a list  of visible character cells (struct mbchar_cell, see below) and returning its length.
-   Flattens this list into bytes and points copy_without_ignore_markers  (if  != NULL) to the result
-   if stop_at != 0 then the list building will end  as soon as stop_at cells have been seen, and  point stopptr (if != NULL) 
-   at a copy of str beginning at the first (visible, multibyte) character past the stop position.  
-   
-   This can be used to determine where a (possibly multibyte, coloured) prompt moves to a new line on a narrow terminal.   
-*/
-
-int
-colourless_strlen(const char *str, char ** pcopy_without_ignore_markers, int UNUSED(termwidth), int stop_at, char **stopptr)
+/* Laying out a prompt: in one pass over str, strip its invisible parts and count the visible characters and the screen
+   columns that they take up. If str contains RL_PROMPT_START_IGNORE, only the parts between that and
+   RL_PROMPT_END_IGNORE are invisible, otherwise (as if str had been passed through mark_invisible()) every ESC[..m
+   and ESC]..m sequence. Like a terminal, we interpret CR (go back to the start) and Backspace (one character back)
+   outside invisible parts.
+
+   Everything except CR, Backspace, ESC and the markers is copied a whole run at a time (found with strcspn(), and
+   measured with mbc_measure(), both of which handle many bytes at a time), unless we need to know where every
+   character starts: when str contains a Backspace, or we have to stop after stop_at characters. Then we return
+   (a pointer into str to) the first character past the stop position, or NULL                                    */
+
+static const char *
+lay_out(const char *str, int stop_at, struct prompt_layout *layout)
 {
-  int visible  = TRUE;
-  int length   = strlen(str);
-  int i, colourless_length, colourless_bytes;
-  const char *str_ptr, *p;
-  char *copy_ptr, *copy_without_ignore_markers;
-  MBSTATE st;
-
-  typedef struct {
-    char *bytes;
-    MBSTATE state;
-  } mbchar_cell;
-  
-  mbchar_cell *cellptr, *copied_cells = mymalloc((length + 1)  * sizeof(mbchar_cell));
-    
-  /* The next loop scans str, one multi-byte character at a time, constructing a colourless copy  */
-  /* cellptr always points at the next available free cell                                        */
-  for(mbc_initstate(&st), colourless_length = 0, str_ptr = str, colourless_bytes = 0, cellptr = copied_cells;
-      *str_ptr;
-      mbc_inc(&str_ptr, &st)) {
-    assert (cellptr < copied_cells + length);
-    if (stop_at && stopptr && (colourless_length >= stop_at)) {
-      *stopptr = mysavestring(str_ptr);
+  const bool marked = strchr(str, RL_PROMPT_START_IGNORE) != NULL;
+  const bool one_by_one = stop_at > 0 || strchr(str, BACKSPACE);
+  const char marked_specials[]   = { RL_PROMPT_START_IGNORE, RL_PROMPT_END_IGNORE, CARRIAGE_RETURN, BACKSPACE, '\0' };
+  const char unmarked_specials[] = { ESCAPE, CARRIAGE_RETURN, BACKSPACE, '\0' };
+  const char *specials = marked ? marked_specials : unmarked_specials;
+  size_t length = strlen(str), nbytes = 0, old_nbytes;
+  char *copy = mymalloc(length + 1);
+  int *char_starts = one_by_one ? mymalloc((length + 1) * sizeof(int)) : NULL; /* where every character in copy starts */
+  int chars = 0, width = 0, nchars;
+  bool visible = TRUE;
+  const char *p = str, *run_end = str, *next, *stopped_at = NULL;
+  MBSTATE st, scrap;
+
+  for (mbc_initstate(&st); *p; ) {
+    if (stop_at && chars >= stop_at) {
+      stopped_at = p;
       break;
     }
-
-    switch (*str_ptr) {
+    if (p >= run_end)
+      run_end = p + strcspn(p, specials);
+    if (p < run_end) {                /* we're in a run of ordinary characters */
+      if (!visible) {
+        p = run_end;
+      } else if (!one_by_one) {
+        width += mbc_measure(p, run_end - p, &st, &nchars);
+        chars   += nchars;
+        memcpy(copy + nbytes, p, run_end - p);
+        nbytes  += run_end - p;
+        p        = run_end;
+      } else {
+        char_starts[chars++] = nbytes;
+        width += mbc_columns(p, mbc_copystate(st, &scrap));
+        for (next = min(mbc_next(p, &st), run_end); p < next; p++)
+          copy[nbytes++] = *p;
+      }
+      continue;
+    }
+    switch (*p++) {
+    case ESCAPE:                      /* only special when str is not marked */
+      if (*p == '[' || *p == ']') {   /* ESC[ or ESC] sequence: skip it */
+        p++;
+        p += strspn(p, ";0123456789");
+        if (*p == 'm')
+          p++;
+      } else {                        /* an ordinary (visible, but zero-width) ESC */
+        if (one_by_one)
+          char_starts[chars] = nbytes;
+        chars++;
+        copy[nbytes++] = ESCAPE;
+      }
+      break;
     case RL_PROMPT_START_IGNORE:
       visible = FALSE;
       break;
     case RL_PROMPT_END_IGNORE:
       visible = TRUE;
       break;
-    case '\r':
-      if (visible) {                  /* only ever interpret CR (and Backspace) when visible (i.e. outside control sequences) */
-        for ( ; cellptr > copied_cells; cellptr--)  
-          free((cellptr-1)->bytes);   /* free all cells            */
-        mbc_initstate(&st);           /* restart with virgin state */
-        colourless_bytes = 0;
-      }
-      break;
-    case '\b':
-      if ((visible && cellptr > copied_cells)) {     /* except when invisible, or at beginning of copy ... */
-        cellptr -= 1;                                /* ... reset cellptr to previous (multibyte) char     */
-        colourless_bytes -= strlen(cellptr->bytes);  
-        free(cellptr->bytes);
-        if (cellptr > copied_cells)
-          st = (cellptr -1) -> state;                /* restore corresponding shift state                  */
-        else
-          mbc_initstate(&st);                        /* or initial state, if at start of line              */
+    case CARRIAGE_RETURN:
+      if (visible) {
+        nbytes = chars = width = 0;
+        mbc_initstate(&st);
       }
       break;
-    default:
-      if (visible) {
-        MBSTATE st_copy   = st;
-        int nbytes        = mbc_charwidth(str_ptr, &st_copy);
-        char *q           = cellptr -> bytes = mymalloc(1 + nbytes);
-
-        colourless_bytes += nbytes;
-        mbc_copy(str_ptr,&q, &st); /* copy the possibly multi-byte character at str_ptr to cellptr -> bytes , incrementing q to just past the copy */
-        *q                = '\0';
-        cellptr -> state  = st; /* remember shift state after reading str_ptr, just in case a backspace comes along later */
-        cellptr           += 1;
+    case BACKSPACE:
+      if (visible && chars > 0) {
+        old_nbytes = nbytes;
+        nbytes = char_starts[--chars];
+        copy[old_nbytes] = '\0';
+        width -= mbc_columns(copy + nbytes, mbc_initstate(&scrap));
       }
       break;
     }
-    colourless_length = cellptr - copied_cells;
-  } /* end of for loop */
+  }
+  copy[nbytes] = '\0';
+  if (char_starts)
+    free(char_starts);
+  layout->colourless = copy;
+  layout->chars      = chars;
+  layout->width      = width;
+  DPRINTF4(DEBUG_READLINE, "laid out \"%s\" as \"%s\": %d chars, %d columns", M(str), M(copy), chars, width);
+  return stopped_at;
+}
 
-  
-  copy_without_ignore_markers = mymalloc(colourless_bytes + 1);
-  for (cellptr = copied_cells, copy_ptr = copy_without_ignore_markers, i = 0; i < colourless_length; i++, cellptr++) {
-    for(p = cellptr->bytes; *p; p++, copy_ptr++) 
-      *copy_ptr = *p;
-    free(cellptr->bytes);
+
+/* find the last screen row of layout->colourless on a terminal of width termwidth. A (wide) character that doesn't fit
+   on a row anymore is put on the next one, as the terminal would do */
+static void
+find_last_row(struct prompt_layout *layout, int termwidth)
+{
+  const char *p, *colourless = layout->colourless;
+  int row_width = 0, char_width;
+  MBSTATE st;
+
+  layout->rows = 1;
+  layout->last_row = 0;
+  if (termwidth <= 0 || layout->width <= termwidth)
+    return;
+  for (mbc_initstate(&st), p = colourless; *p; mbc_inc(&p, &st)) {
+    char_width = mbc_columns(p, &st);
+    if (row_width + char_width > termwidth) {
+      layout->rows++;
+      layout->last_row = p - colourless;
+      row_width = 0;
+    }
+    row_width += char_width;
   }
-  *copy_ptr = '\0';
-  free(copied_cells);
+}
 
 
-  DPRINTF4(DEBUG_READLINE, "colourless_strlen(\"%s\", \"%s\") = %d  chars, %d  bytes",
-           M(str), copy_without_ignore_markers, colourless_length, colourless_bytes);
+/* prompt_layout(str, termwidth) returns the layout of str (see above) on a terminal of width termwidth (0 if we don't
+   care). The same prompt will be laid out many times (every time that it is re-displayed, and with the homegrown
+   redisplay on every keypress) so the last few layouts are cached. The result is only valid until the next call */
 
-  if (pcopy_without_ignore_markers)
-    *pcopy_without_ignore_markers = copy_without_ignore_markers;
-  else
-    free(copy_without_ignore_markers);
-  
+#define PROMPT_LAYOUT_CACHE_SIZE 4
 
-  return colourless_length;
+const struct prompt_layout *
+prompt_layout(const char *str, int termwidth)
+{
+  static struct prompt_layout cache[PROMPT_LAYOUT_CACHE_SIZE];
+  static int oldest = 0;
+  struct prompt_layout *layout;
+  int i;
+
+  for (i = 0; i < PROMPT_LAYOUT_CACHE_SIZE; i++)
+    if (cache[i].string && cache[i].termwidth == termwidth && strcmp(cache[i].string, str) == 0)
+      return &cache[i];
+  layout = &cache[oldest];
+  oldest = (oldest + 1) % PROMPT_LAYOUT_CACHE_SIZE;
+  if (layout->string) {
+    free(layout->string);
+    free(layout->colourless);
+  }
+  layout->string = mysavestring(str);
+  layout->termwidth = termwidth;
+  lay_out(str, 0, layout);
+  find_last_row(layout, termwidth);
+  return layout;
+}
+
+
+/* helper function: returns the number of displayed characters (the "colourless length") of str (cf. lay_out() above)
+   Points copy_without_ignore_markers  (if  != NULL) to a copy of str without its invisible parts.
+   If stop_at != 0, it will stop counting as soon as stop_at characters have been seen, and point stopptr (if != NULL)
+   at a copy of str beginning at the first (visible, multibyte) character past the stop position (or at NULL if str
+   has fewer than stop_at characters).
+
+   This can be used to determine where a (possibly multibyte, coloured) prompt moves to a new line on a narrow terminal.
+*/
+
+int
+colourless_strlen(const char *str, char ** pcopy_without_ignore_markers, int termwidth, int stop_at, char **stopptr)
+{
+  struct prompt_layout uncached;
+  const struct prompt_layout *layout;
+  const char *stopped_at;
+
+  if (stop_at) {
+    stopped_at = lay_out(str, stop_at, &uncached);
+    if (stopptr)
+      *stopptr = stopped_at ? mysavestring(stopped_at) : NULL;
+    layout = &uncached;
+  } else {
+    layout = prompt_layout(str, termwidth);
+  }
+  if (pcopy_without_ignore_markers)
+    *pcopy_without_ignore_markers = mysavestring(layout->colourless);
+  if (layout == &uncached)
+    free(uncached.colourless);
+  return layout->chars;
 }
 
 
@@ -889,16 +970,16 @@ DEF_UNIT_TEST(test_colourless_strlen) {
   MAYBE_UNUSED(argv); MAYBE_UNUSED(argc);
   if (STAGE(TEST_AT_PROGRAM_START))   {
     char test[] = "\033[0;31mblא\033[0m bla \033[0;33mblא\033[0m";
-    char *result, *copy;
+    char *result = NULL, *copy;
     int len = colourless_strlen(mark_invisible(test), &copy, 0, 2,  &result);  
-    printf("origineel = '%s', len = %d, copy = '%s', result = '%s'\n", test, len, copy, result);
+    printf("origineel = '%s', len = %d, copy = '%s', result = '%s'\n", test, len, copy, result ? result : "(none)");
     exit(0);
   }
 }
 
-              
+
 /* helper function: returns the number of displayed characters (the
-   "colourless length") of str (which has its unprintable sequences
+   "colourless length") of str (which may have its unprintable sequences
    marked with RL_PROMPT_*_IGNORE).
 
    Until rlwrap 0.44, this function didn't take wide characters into 
@@ -910,43 +991,20 @@ DEF_UNIT_TEST(test_colourless_strlen) {
 int
 colourless_strlen_unmarked (const char *str, int termwidth)
 {
-  char *marked_str = mark_invisible(str);
-  int colourless_length = colourless_strlen(marked_str, NULL, termwidth, 0, NULL);
-  free(marked_str);
-  return colourless_length;
+  return prompt_layout(str, termwidth)->chars;
 }
 
 
 /* skip a maximal number (possibly zero) of termwidth-wide
-   initial segments of long_line and return the remainder
-   (i.e. the last line of long_line on screen)
-   if long_line contains an ESC character, return "" (signaling
-   "don't touch") */   
+   initial segments of long_line and return the (colourless) remainder
+   (i.e. the last line of long_line on screen) */
 
 
 char *
 get_last_screenline(char *long_line, int termwidth)
 {
-  int line_length, removed;
-  char *line_copy, *last_screenline;
-
-  line_copy = mysavestring(long_line);
-  line_length = strlen(line_copy);
-  
-  if (termwidth == 0 ||              /* this may be the case on some weird systems */
-      line_length <=  termwidth)  {  /* line doesn't extend beyond right margin
-                                        @@@ are there terminals that put the cursor on the
-                                        next line if line_length == termwidth?? */
-    return line_copy; 
-  } else if (strchr(long_line, '\033')) { /* <ESC> found, give up */
-    free (line_copy);
-    return mysavestring("Ehhmm..? > ");
-  } else {      
-    removed = (line_length / termwidth) * termwidth;   /* integer arithmetic: 33/10 = 3 */
-    last_screenline  = mysavestring(line_copy + removed);
-    free(line_copy);
-    return last_screenline;
-  }
+  const struct prompt_layout *layout = prompt_layout(long_line, termwidth);
+  return mysavestring(layout->colourless + layout->last_row);
 }
 
 
@@ -1176,12 +1234,7 @@ split_filter_message(char *message, int *counter)
 
 
 
-#ifndef HAVE_REGEX_H
-char *protect_or_cleanup(const char *prompt) {
-  return mysavestring(prompt); /*essentially a NOP */
-}       
-
-#else
+#ifdef HAVE_REGEX_H
 
 /* regcomp with error checking (and simpler signature) */
 static regex_t *my_regcomp(const char*regex, int flags) {
@@ -1272,77 +1325,37 @@ char *replace_special(const char *source, regex_t *compiled_pattern, const char*
 }
       
 
-/* All the codes we want to preserve (i.e. keep and put between RL_PROMPT_{START,END}_IGNORE )    */
-static
-char *protected_codes[]  = { "\x1B\x1B", NULL};
-
-/* As we don't protect (and hence will get rid of) ANSI colour codes when "bleaching" the prompt, */
-/* specify separately:                                                                            */ 
-static char *ansi_colour_code_regexp = "(\x1B\\[[0-9;]*m)";          /* colour codes              */
-
-                                      
-
-/* All the codes we want to get rid of. cf.                                                                        */
-/* https://stackoverflow.com/questions/14693701/how-can-i-remove-the-ansi-escape-sequences-from-a-string-in-python */
-/* We only cover 7-bit C1 ANSI sequences; the 8-bit are not much used as they interfere with UTF-8, and we         */
-/* don't need to absolutely catch everything anyway                                                                */
-static
-char *unwanted_codes[] = { "(\x1B[ -/]*[0-Z\\\\-~])"           /* ANSI X3.41: ESC + I-pattern + F-pattern (except [, which is covered below) */
-                           ,"(\x1B[@-Z\\]-_])"                 /* C1_Fe */
-                           ,"(\x1B\\[[0-9:;<>=?]*[-/]*[@-~])"  /* CSI   (overlaps with "protected" codes!) (is the meaning of [@-~] locale-dependent?) */
-                           ,"(\x1B\\[?1h\x1B=)"                /* smkx keypad            */
-                           ,"(\x1B\\]0;[[:print:]]*\x07)"      /* tsl <window title> fsl */
-
-                         ,NULL};
-
-
-
-
-/* mark protected codes between RL_PROMPT_{START,END}_IGNORE and erase unwanted codes */
-char *protect_or_cleanup(char *prompt, bool free_prompt) {
-  char *result1, *result;
-  static char *protected_codes_regexp ;
-  static regex_t *compiled_and_protected_protected_codes_regexp;
-  static char *protected_token;
-  static char *unwanted_codes_regexp;
-  static regex_t *compiled_and_protected_unwanted_codes_regexp;
-  
-  /* protect stuff we want to keep: */
-  
-  /* (once)construct the regexp for the protected codes: */
-  if (!protected_codes_regexp) {
-    protected_codes_regexp = unsplit_with(-1, &protected_codes[0], "|");
-    if (!bleach_the_prompt)
-      protected_codes_regexp = add3strings(protected_codes_regexp, "|", ansi_colour_code_regexp);
-    compiled_and_protected_protected_codes_regexp = my_regcomp(protect(protected_codes_regexp, RL_PROMPT_START_IGNORE, RL_PROMPT_END_IGNORE), REG_EXTENDED);
-  }
-  /* (once) construct the replacement pattern */
-  if (!protected_token) {
-     protected_token = mymalloc(4); /* "\x01@\x02" */
-     sprintf(protected_token,"%c%c%c",RL_PROMPT_START_IGNORE, TOKEN, RL_PROMPT_END_IGNORE);
-  }
-  result1 = replace_special(prompt, compiled_and_protected_protected_codes_regexp, protected_token);
-  
-  if (!unwanted_codes_regexp) {
-    unwanted_codes_regexp = unsplit_with(-1, &unwanted_codes[0], "|");
-    compiled_and_protected_unwanted_codes_regexp =  my_regcomp(protect(unwanted_codes_regexp, RL_PROMPT_START_IGNORE, RL_PROMPT_END_IGNORE), REG_EXTENDED);
-  }
-  result = replace_special(result1, compiled_and_protected_unwanted_codes_regexp, "");
-   DPRINTF2(DEBUG_READLINE, "protect_or_cleanup(%s) = %s", M(prompt), M(result)); 
-  free(result1);
-  
-  if (free_prompt)
-    free(prompt);
+/* The user's regexps (there are only a few) are compiled only once, when they are first used (i.e. when
+   the options are parsed, as main.c checks them right away), and kept in a registry */
+static struct registered_regexp {
+  char *regexp;
+  int flags;
+  regex_t *compiled;    /* NULL for the empty regexp */
+} *registry = NULL;
+static int nregistered = 0;
+
+static regex_t *
+registered_regexp(const char *regexp, int flags)
+{
+  struct registered_regexp *entry;
+  int i;
 
-  return result;
+  for (i = 0; i < nregistered; i++)
+    if (registry[i].flags == flags && strcmp(registry[i].regexp, regexp) == 0)
+      return registry[i].compiled;
+  registry = myrealloc(registry, nregistered * sizeof(struct registered_regexp), (nregistered + 1) * sizeof(struct registered_regexp));
+  entry = &registry[nregistered++];
+  entry->regexp = mysavestring(regexp);
+  entry->flags = flags;
+  entry->compiled = my_regcomp(regexp, flags);
+  return entry->compiled;
 }
 
 
 /*
   returns TRUE if 'string' matches the 'regexp' (or is a superstring
-  of it, when we don't HAVE_REGEX_H). The regexp is recompiled with
-  every call, which doesn't really hurt as this function is not called
-  often: at most twice for every prompt.  'string' and 'regexp' may be
+  of it, when we don't HAVE_REGEX_H). The regexp is compiled only
+  once (cf. registered_regexp() above). 'string' and 'regexp' may be
   NULL (in which case FALSE is returned)
 
   Only used for the --forget-regexp and the --prompt-regexp options
@@ -1370,11 +1383,9 @@ int match_regexp (const char *string, const char *regexp, int case_insensitive)
   }
 #else
   {
-    regex_t *compiled_regexp = my_regcomp(regexp, REG_EXTENDED|REG_NOSUB|(case_insensitive ? REG_ICASE : 0));
-    result = !regexec(compiled_regexp, string, 0, NULL, 0);
+    regex_t *compiled_regexp = registered_regexp(regexp, REG_EXTENDED|REG_NOSUB|(case_insensitive ? REG_ICASE : 0));
+    result = !compiled_regexp || !regexec(compiled_regexp, string, 0, NULL, 0); /* the empty regexp matches anything */
     DPRINTF3(DEBUG_READLINE, "matching %s with regex %s: result %d", M(string), M(regexp), result);
-
-    regfree(compiled_regexp);
   }
 #endif
 
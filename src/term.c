@@ -56,6 +56,10 @@ struct winsize winsize; /* current window size */
 
 static char *term_cr;           /* carriage return (or 0, if none defined in terminfo) */
 static char *term_clear_line;
+static char *term_insert_char;  /* insert one blank at the cursor position, shifting the rest of the line to the right */
+static char *term_insert_chars; /* ... or a given number of them */
+static char *term_delete_char;  /* delete the character under the cursor, shifting the rest of the line to the left */
+static char *term_delete_chars; /* ... or a given number of them */
 char *term_name;
 
 
@@ -169,6 +173,10 @@ init_terminal(void)
     term_cursor_right   = tigetstr_or_else_tgetstr("cuf1",   "nd", "move cursor right");
     term_cursor_up      = tigetstr_or_else_tgetstr("cuu1",   "up", "move cursor up");
     term_cursor_down    = tigetstr_or_else_tgetstr("cud1",   "do", "move cursor down");
+    term_insert_char    = tigetstr_or_else_tgetstr("ich1",   "ic", "insert character");
+    term_insert_chars   = tigetstr_or_else_tgetstr("ich",    "IC", "insert characters");
+    term_delete_char    = tigetstr_or_else_tgetstr("dch1",   "dc", "delete character");
+    term_delete_chars   = tigetstr_or_else_tgetstr("dch",    "DC", "delete characters");
     term_has_colours    = tigetstr_or_else_tgetstr("initc", "Ic",  "initialise colour") ? TRUE : FALSE; 
     
     /* the following codes are never output by rlwrap, but used to recognize the use of the the alternate screen by the client, and 
@@ -283,9 +291,68 @@ clear_line(void)
     free((void *)spaces);
   }
   cr();
+  forget_displayed_line();
 }
 
 
+/* clear from the cursor to the end of the line, or (if the terminal cannot do that) the next count columns.
+   Returns the number of columns that the cursor has moved */
+int
+clear_to_eol(int count)
+{
+  int i;
+
+  if (term_clear_line) {
+    tputs(term_clear_line, 1, my_putchar);
+    return 0;
+  }
+  for (i = 0; i < count; i++)
+    my_putchar(' ');
+  return count;
+}
+
+
+/* the control sequence to insert (or delete) count characters at the cursor position (using the parametrised
+   capability, or else by repeating the single-character one), as a freshly allocated string. NULL if the terminal
+   doesn't have either */
+static char *
+insert_or_delete_code(char *parametrised, char *single, int count)
+{
+  char *code;
+  int i, length;
+
+  if (parametrised)
+    return mysavestring(tgoto(parametrised, 0, count)); /* cf. cursor_hpos() */
+  if (!single)
+    return NULL;
+  length = strlen(single);
+  code = mymalloc(count * length + 1);
+  for (i = 0; i < count; i++)
+    memcpy(code + i * length, single, length);
+  code[count * length] = '\0';
+  return code;
+}
+
+char *
+insert_chars_code(int count)
+{
+  return insert_or_delete_code(term_insert_chars, term_insert_char, count);
+}
+
+char *
+delete_chars_code(int count)
+{
+  return insert_or_delete_code(term_delete_chars, term_delete_char, count);
+}
+
+
+/* the length of the sequence written by clear_to_eol(count) */
+int
+clear_to_eol_length(int count)
+{
+  return term_clear_line ? strlen(term_clear_line) : count;
+}
+
 
 void
 backspace(int count)
@@ -421,6 +421,25 @@ void my_fopen(FILE  **pfp, const char *path, const char *mode, const char *descr
 }
 
 
+/* read a line (of any length) from fp, without its newline. Returns NULL at EOF */
+char *
+read_line(FILE *fp)
+{
+  char buffer[BUFFSIZE], *line = NULL;
+  size_t length;
+
+  while (fgets(buffer, sizeof(buffer), fp)) {
+    length = strlen(buffer);
+    if (length > 0 && buffer[length - 1] == '\n') {
+      buffer[length - 1] = '\0';
+      return line ? append_and_free_old(line, buffer) : mysavestring(buffer);
+    }
+    line = line ? append_and_free_old(line, buffer) : mysavestring(buffer);
+  }
+  return line; /* the last line may have no newline */
+}
+
+
 void
 open_logfile(const char *filename)
 {
@@ -543,8 +562,11 @@ get_new_slave_cwd(char **cwd)
     proc_pid_cwd = add3strings(PROC_MOUNTPOINT, "/", add2strings(as_string(command_pid), "/cwd"));
 
 # if HAVE_DECL_READLINK
-  if  (readlink(proc_pid_cwd, readlink_buffer, MAXPATHLEN) > 0)
+  ssize_t length;
+  if  ((length = readlink(proc_pid_cwd, readlink_buffer, MAXPATHLEN)) > 0) {
+    readlink_buffer[length] = '\0'; /* readlink() doesn't do this for us */
     possibly_new_cwd = mysavestring(readlink_buffer);
+  }
 # else
   /* readlink unavailable, use /proc/nnn/cwd ... */
   possibly_new_cwd = mysavestring(proc_pid_cwd);
@@ -595,6 +617,19 @@ get_new_slave_cwd(char **cwd)
  
 
 
+/* The rlwrapped command's current working directory (as a malloc()ed string), or NULL if we cannot find out */
+char *
+command_working_directory(void)
+{
+  char *cwd = mysavestring("");
+
+  if (command_pid > 0 && get_new_slave_cwd(&cwd))
+    return cwd;
+  free(cwd);
+  return NULL;
+}
+
+
 /* change_working_directory() tries to change rlwrap's working directory to the rlwrapped command's current working directory   */
 void
 change_working_directory(void)
@@ -714,17 +749,23 @@ usage(int status)
   print_option('a', "always-readline", "password prompt", TRUE, NULL);
   print_option('A', "ansi-colour-aware", NULL, FALSE, NULL);
   print_option('b', "break-chars", "chars", FALSE, NULL);
+  print_option('B', "binary-history", NULL, FALSE, NULL);
   print_option('c', "complete-filenames", NULL, FALSE, NULL);
   print_option('C', "command-name", "name|N", FALSE, NULL);
   print_option('D', "history-no-dupes", "0|1|2", FALSE, NULL);
   print_option('e', "extra-char-after-completion", "char|''", FALSE, NULL);   
   print_option('f', "file", "completion list", FALSE,NULL);
   print_option('g', "forget-matching", "regexp", FALSE,NULL);
+  print_option('G', "share-history", NULL, FALSE, NULL);
   print_option('h', "help", NULL, FALSE, NULL);
   print_option('H', "history-filename", "file", FALSE, NULL);
   print_option('i', "case-insensitive", NULL, FALSE, NULL);
   print_option('I', "pass-sigint-as-sigterm", NULL, FALSE, NULL);
+  print_option('J', "append-history", NULL, FALSE, NULL);
+  print_option('k', "compile-completions", NULL, FALSE, "(rlwrap -k file ... compiles completion lists)");
+  print_option('K', "known-prompts", "file", FALSE, NULL);
   print_option('l', "logfile", "file", FALSE, NULL);
+  print_option('L', "completion-limit", "N", FALSE, "(0: no limit)");
   print_option('m', "multi-line", "newline substitute", TRUE, NULL);
   print_option('M', "multi-line-ext", ".ext", FALSE, NULL);
   print_option('n', "no-warnings", NULL, FALSE, NULL);
@@ -741,10 +782,14 @@ usage(int status)
   print_option('t', "set-term-name", "name", FALSE, NULL);
   print_option('U', "mirror-arguments", NULL, FALSE, NULL);
   print_option('v', "version", NULL, FALSE, NULL);
-  print_option('w', "wait-before-prompt", "N", FALSE, "(msec, <0  : patient mode)");
+  print_option('w', "wait-before-prompt", "N", FALSE, "(msec or auto, <0  : patient mode)");
   print_option('W', "polling", NULL, FALSE, NULL);
+  print_option('x', "highlight", "file", FALSE, NULL);
   print_option('X', "skip-setctty", NULL, FALSE, NULL);
+  print_option('y', "fuzzy-completion", NULL, FALSE, NULL);
+  print_option('Y', "history-tool", "dedupe|trim|merge", FALSE, "(rlwrap -Y tool file ... edits history files)");
   print_option('z', "filter", "filter command", FALSE, "('rlwrap -z listing' writes a list of installed filters)");  
+  print_option('Z', "resize-delay", "N", FALSE, "(msec, 0: act on every resize at once)");
   
  
 #ifdef DEBUG
@@ -784,6 +829,20 @@ usage(int status)
 }           
   
 
+/* realloc() that plays nice with mymalloc() (and hence with malloc_debug.c, that doesn't know about realloc()). 
+   The caller has to remember the old size. As with realloc(), ptr may be NULL */
+void *
+myrealloc(void *ptr, size_t old_size, size_t new_size)
+{
+  void *new_ptr = mymalloc(new_size);
+  if (ptr) {
+    memcpy(new_ptr, ptr, min(old_size, new_size));
+    free(ptr);
+  }
+  return new_ptr;
+}
+
+
 #ifdef DEBUG
 #undef mymalloc
 #endif
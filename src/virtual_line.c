@@ -0,0 +1,433 @@
+/*  virtual_line.c: the current line of command's output, as it looks on the terminal
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License , or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; see the file COPYING.  If not, write to
+    the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+
+    You may contact the author by:
+       e-mail:  hanslub42@gmail.com
+*/
+
+
+/* The raw prompt is everything that command has written after its last newline. Commands that show a running
+   counter ("  1%\r  2%\r ...") or that move the cursor around make that quite different from what the user sees.
+   To find the prompt that is actually on the screen, we keep a small model of the current output line, which
+   interprets the bytes as they arrive (in process_new_output()):
+
+   - the line is a list of items: characters, and (zero-width) control codes. A cursor points at the item where the
+     next character will go. If that is an existing character, it is overwritten, as on a terminal
+   - CR, Backspace, TAB, ESC[nC, ESC[nD, ESC[nG (cursor forward, backward, to column n) and ESC[nK (erase in line)
+     move the cursor, or erase characters
+   - with -A (ansi_colour_aware), colour codes (ESC[..m) and ESC ESC are kept (between RL_PROMPT_START_IGNORE and
+     RL_PROMPT_END_IGNORE), and all other escape sequences are removed (with -A! colour codes are removed as well).
+     Without -A, escape sequences that we don't interpret are kept as they are.
+
+   Columns are counted in characters, not in screen columns (a Backspace after a wide character erases it).
+   This replaces protect_or_cleanup() and unbackspace() for prompts, in one pass over the newly arrived bytes   */
+
+
+#include "rlwrap.h"
+#include <limits.h>
+
+#define ESCAPE '\033'
+#define MAX_PENDING 256         /* longer unfinished escape sequences are taken at face value */
+#define TABSTOP 8
+
+enum item_kind { CHARACTER, PROTECTED_CODE, RAW_CODE };
+
+struct item {
+  enum item_kind kind;
+  char *bytes;
+};
+
+struct virtual_line {
+  struct item *items;
+  int nitems, size;
+  int cursor;                   /* the index of the item where the next character goes */
+  char *pending;                /* an unfinished escape sequence or multi-byte character, waiting for more bytes */
+  size_t fed;                   /* the number of bytes fed since the line was started */
+};
+
+static struct virtual_line current_line = { NULL, 0, 0, 0, NULL, 0 };
+
+
+static void
+empty_line(struct virtual_line *line)
+{
+  int i;
+  for (i = 0; i < line->nitems; i++)
+    free(line->items[i].bytes);
+  line->nitems = line->cursor = 0;
+  if (line->pending)
+    free(line->pending);
+  line->pending = NULL;
+  line->fed = 0;
+}
+
+
+static void
+insert_item(struct virtual_line *line, int at, enum item_kind kind, const char *bytes, size_t length)
+{
+  struct item *item;
+
+  if (line->nitems == line->size) {
+    int new_size = line->size ? 2 * line->size : 64;
+    line->items = myrealloc(line->items, line->size * sizeof(struct item), new_size * sizeof(struct item));
+    line->size = new_size;
+  }
+  memmove(line->items + at + 1, line->items + at, (line->nitems - at) * sizeof(struct item));
+  line->nitems++;
+  item = &line->items[at];
+  item->kind = kind;
+  item->bytes = mymalloc(length + 1);
+  memcpy(item->bytes, bytes, length);
+  item->bytes[length] = '\0';
+}
+
+
+static void
+remove_item(struct virtual_line *line, int at)
+{
+  free(line->items[at].bytes);
+  memmove(line->items + at, line->items + at + 1, (line->nitems - at - 1) * sizeof(struct item));
+  line->nitems--;
+}
+
+
+/* the index of the first character at or after the cursor (or nitems, if there is none) */
+static int
+character_under_cursor(struct virtual_line *line)
+{
+  int i;
+  for (i = line->cursor; i < line->nitems && line->items[i].kind != CHARACTER; i++)
+    ;
+  return i;
+}
+
+
+static void
+put_character(struct virtual_line *line, const char *bytes, size_t length)
+{
+  int at = character_under_cursor(line);
+
+  if (at < line->nitems) { /* overwrite */
+    free(line->items[at].bytes);
+    line->items[at].bytes = mymalloc(length + 1);
+    memcpy(line->items[at].bytes, bytes, length);
+    line->items[at].bytes[length] = '\0';
+  } else {
+    insert_item(line, at, CHARACTER, bytes, length);
+  }
+  line->cursor = at + 1;
+}
+
+
+static void
+put_code(struct virtual_line *line, enum item_kind kind, const char *bytes, size_t length)
+{
+  insert_item(line, line->cursor, kind, bytes, length);
+  line->cursor++;
+}
+
+
+static void
+cursor_forward(struct virtual_line *line, int n)
+{
+  int at;
+  for ( ; n > 0; n--) {
+    if ((at = character_under_cursor(line)) < line->nitems)
+      line->cursor = at + 1;
+    else
+      put_character(line, " ", 1); /* moving past the end of the line leaves blank space */
+  }
+}
+
+
+static void
+cursor_backward(struct virtual_line *line, int n)
+{
+  int at;
+  for ( ; n > 0; n--) {
+    for (at = line->cursor - 1; at >= 0 && line->items[at].kind != CHARACTER; at--)
+      ;
+    if (at < 0) {               /* cannot move past the start of the line */
+      line->cursor = 0;
+      return;
+    }
+    line->cursor = at;
+  }
+}
+
+
+static int
+cursor_column(struct virtual_line *line)
+{
+  int i, column = 0;
+  for (i = 0; i < line->cursor; i++)
+    if (line->items[i].kind == CHARACTER)
+      column++;
+  return column;
+}
+
+
+/* ESC[nK: erase from the cursor to the end of the line (n = 0), from the start to the cursor (n = 1) or the whole line.
+   Codes are left alone, as they may be needed for the characters that come after them */
+static void
+erase_in_line(struct virtual_line *line, int n)
+{
+  int i, under_cursor = character_under_cursor(line);
+
+  for (i = line->nitems - 1; i >= 0; i--) {
+    if (line->items[i].kind != CHARACTER || (n == 0 && i < under_cursor) || (n == 1 && i > under_cursor))
+      continue;
+    if (i >= under_cursor && n != 1) {   /* at the end of the line, blank space is no space */
+      remove_item(line, i);
+    } else {
+      free(line->items[i].bytes);
+      line->items[i].bytes = mysavestring(" ");
+    }
+  }
+}
+
+
+/* the length of the escape sequence at s (which starts with ESC), or 0 if it isn't finished yet. Sets *pfinal to the
+   final byte of a CSI sequence without private parameters or intermediate bytes (so one that we may interpret) */
+static size_t
+escape_sequence_length(const char *s, char *pfinal)
+{
+  const char *p = s + 2, *q;
+
+  *pfinal = '\0';
+  switch (s[1]) {
+  case '\0':
+    return 0;
+  case '[':                     /* CSI: ESC [ parameters intermediates final */
+    p += strspn(p, "0123456789:;<=>?");
+    q = p + strspn(p, " !\"#$%&'()*+,-./");
+    if (!*q)
+      return 0;
+    if (*q < '@' || *q > '~')   /* malformed: the sequence ends before the offending byte */
+      return q - s;
+    if (q == p && !strchr("<=>?", s[2]))
+      *pfinal = *q;
+    return q + 1 - s;
+  case ']':                     /* OSC: ESC ] ... BEL, or ESC ] ... ESC \ */
+    for ( ; *p; p++)
+      if (*p == '\007')
+        return p + 1 - s;
+      else if (*p == ESCAPE && p[1] == '\\')
+        return p + 2 - s;
+      else if (*p == ESCAPE && p[1])
+        return p - s;
+    return 0;
+  default:                      /* ESC intermediates final (including ESC ESC) */
+    p = s + 1 + strspn(s + 1, " !\"#$%&'()*+,-./");
+    if (!*p)
+      return 0;
+    return (*p == ESCAPE || (*p >= '0' && *p <= '~')) ? p + 1 - s : 1; /* if malformed, ESC is just ESC */
+  }
+}
+
+
+static void
+interpret_escape_sequence(struct virtual_line *line, const char *s, size_t length, char final)
+{
+  int n = atoi(s + 2);
+
+  switch (final) {
+  case 'C':
+    cursor_forward(line, max(n, 1));
+    return;
+  case 'D':
+    cursor_backward(line, max(n, 1));
+    return;
+  case 'G':
+    line->cursor = 0;
+    cursor_forward(line, max(n, 1) - 1);
+    return;
+  case 'K':
+    erase_in_line(line, n);
+    return;
+  case 'm':
+    if (!bleach_the_prompt)
+      put_code(line, ansi_colour_aware ? PROTECTED_CODE : RAW_CODE, s, length);
+    return;
+  default:
+    if (s[1] == ESCAPE)         /* ESC ESC is kept, even with -A */
+      put_code(line, ansi_colour_aware ? PROTECTED_CODE : RAW_CODE, s, length);
+    else if (!ansi_colour_aware)
+      put_code(line, RAW_CODE, s, length);
+    return;
+  }
+}
+
+
+static void
+feed_line(struct virtual_line *line, const char *output)
+{
+  char *buffer = line->pending ? add2strings(line->pending, output) : mysavestring(output);
+  const char *p = buffer, *next;
+  size_t length;
+  char final;
+  MBSTATE st;
+
+  line->fed += strlen(output);
+  if (line->pending)
+    free(line->pending);
+  line->pending = NULL;
+
+  while (*p) {
+    switch (*p) {
+    case '\r':
+      line->cursor = 0;
+      p++;
+      break;
+    case '\b':
+      cursor_backward(line, 1);
+      p++;
+      break;
+    case '\t':
+      cursor_forward(line, TABSTOP - cursor_column(line) % TABSTOP);
+      p++;
+      break;
+    case ESCAPE:
+      if (!(length = escape_sequence_length(p, &final))) {
+        if (strlen(p) < MAX_PENDING) {
+          line->pending = mysavestring(p);
+          p += strlen(p);
+          break;
+        }
+        length = 1;           /* give up, and take ESC as an ordinary control character */
+        final = '\0';
+      }
+      if (length == 1)
+        put_code(line, RAW_CODE, p, 1);
+      else
+        interpret_escape_sequence(line, p, length, final);
+      p += length;
+      break;
+    default:
+      if ((unsigned char) *p < ' ' || *p == '\177') {     /* other control characters (like BEL) are kept, but take no space */
+        put_code(line, RAW_CODE, p, 1);
+        p++;
+        break;
+      }
+      next = mbc_next(p, mbc_initstate(&st));
+      if (!mbc_is_valid(p, mbc_initstate(&st)) && strlen(p) < MB_LEN_MAX) { /* may be the start of a multibyte character */
+        line->pending = mysavestring(p);
+        p += strlen(p);
+        break;
+      }
+      put_character(line, p, next - p);
+      p = next;
+      break;
+    }
+  }
+  free(buffer);
+}
+
+
+static char *
+render_line(struct virtual_line *line)
+{
+  size_t length = 1;
+  char *result, *q;
+  int i;
+
+  for (i = 0; i < line->nitems; i++)
+    length += strlen(line->items[i].bytes) + 2;
+  if (line->pending)
+    length += strlen(line->pending);
+  result = q = mymalloc(length);
+  for (i = 0; i < line->nitems; i++) {
+    struct item *item = &line->items[i];
+    if (item->kind == PROTECTED_CODE)
+      *q++ = RL_PROMPT_START_IGNORE;
+    q += strlen(strcpy(q, item->bytes));
+    if (item->kind == PROTECTED_CODE)
+      *q++ = RL_PROMPT_END_IGNORE;
+  }
+  *q = '\0';
+  if (line->pending)            /* an unfinished escape sequence or character: leave it as it is */
+    strcpy(q, line->pending);
+  return result;
+}
+
+
+/* command's output has just started a new line */
+void
+start_virtual_line(void)
+{
+  empty_line(&current_line);
+}
+
+
+/* command has written output (which doesn't contain a newline) to the current line */
+void
+feed_virtual_line(const char *output)
+{
+  feed_line(&current_line, output);
+}
+
+
+/* the current line, as it looks on the screen. If the raw prompt has been changed behind our back, we start afresh */
+char *
+virtual_line_as_prompt(const char *raw_prompt)
+{
+  char *result;
+
+  if (current_line.fed != strlen(raw_prompt)) {
+    DPRINTF2(DEBUG_READLINE, "re-interpreting raw prompt <%s> (%d bytes seen)", M(raw_prompt), (int) current_line.fed);
+    empty_line(&current_line);
+    feed_line(&current_line, raw_prompt);
+  }
+  result = render_line(&current_line);
+  DPRINTF2(DEBUG_READLINE, "raw prompt <%s> looks like <%s>", M(raw_prompt), M(result));
+  return result;
+}
+
+
+/* how a (newline-free) line would look on the screen */
+char *
+interpret_line(const char *raw)
+{
+  struct virtual_line line = { NULL, 0, 0, 0, NULL, 0 };
+  char *result;
+
+  feed_line(&line, raw);
+  result = render_line(&line);
+  empty_line(&line);
+  if (line.items)
+    free(line.items);
+  return result;
+}
+
+
+#ifdef UNIT_TEST
+
+/* make clean; make CFLAGS='-g -DUNIT_TEST=test_virtual_line'; ./rlwrap [-A] cat <line> <line> ... */
+TESTFUNC(test_virtual_line, argc, argv, stage) {
+  char **line;
+
+  ONLY_AT_STAGE(TEST_AFTER_OPTION_PARSING);
+  for (line = argv + 1; line < argv + argc; line++) {
+    char *raw = search_and_replace("ESC", "\033", *line, 0, NULL, NULL);
+    raw = search_and_replace("\\r", "\r", raw, 0, NULL, NULL);
+    raw = search_and_replace("\\b", "\b", raw, 0, NULL, NULL);
+    raw = search_and_replace("\\t", "\t", raw, 0, NULL, NULL);
+    printf("%-30s -> <%s>\n", *line, mangle_string_for_debug_log(interpret_line(raw), 0));
+  }
+  exit(0);
+}
+
+#endif /* UNIT_TEST */
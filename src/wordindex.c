@@ -0,0 +1,369 @@
+/*  wordindex.c: compiled (sorted, de-duplicated, memory-mappable) completion word lists
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License , or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; see the file COPYING.  If not, write to
+    the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+
+    You may contact the author by:
+       e-mail:  hanslub42@gmail.com
+*/
+
+
+/* Splitting a huge completion file into words and inserting these into the completion tree one by one
+   can take seconds, at every start of rlwrap. "rlwrap --compile-completions <file>" does this once, and
+   writes the resulting (sorted, de-duplicated) word list to <file>.compiled in a format that can be
+   mmap()ed and used as is:
+
+     header  (struct word_index_header, 64 bytes)
+     masks   (nwords uint64_t's, the character masks used by fuzzy.c, 0 for a word that has been removed)
+     offsets (nwords uint64_t's, offsets of the words within the strings section)
+     strings (the words, each terminated by a '\0', in the same order as the completion tree would have them)
+
+   When rlwrap reads a completion file, it first looks for <file>.compiled. That will only be used if
+   it is newer than <file> (or <file> has gone), and if it was compiled with the same word-breaking
+   characters and case-sensitivity as rlwrap now uses. Otherwise, <file> is parsed as before.
+
+   The file is mapped privately and writably: removing a word (which the filter may do) will mark it as
+   dead by zeroing its mask, which only touches our own copy-on-write page
+
+   The format is "native": no attempt is made to make compiled lists portable between machines.             */
+
+
+#include "rlwrap.h"
+
+#define COMPILED_SUFFIX ".compiled"
+#define WORD_INDEX_MAGIC "rlwrap wordidx\n"   /* 15 chars + '\0' */
+#define WORD_INDEX_VERSION 1
+#define BYTE_ORDER_MARK 0x01020304
+
+struct word_index_header {
+  char     magic[16];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t case_sensitive;
+  uint32_t break_chars_hash;
+  uint64_t source_size;
+  int64_t  source_mtime;
+  uint64_t nwords;
+  uint64_t strings_size;
+};
+
+
+static struct word_index {
+  char *filename;
+  uint64_t *masks;
+  const uint64_t *offsets;
+  const char *strings;
+  long nwords;
+} *indexes = NULL;
+static int nindexes = 0;
+static int bktree_index = 0;    /* all (live) words before word bktree_word of indexes[bktree_index] have been added to the BK-tree */
+static long bktree_word = 0;
+
+
+static uint32_t
+break_chars_hash(void)
+{
+  return (uint32_t) hash_multiple(1, rl_basic_word_break_characters);
+}
+
+
+static char *
+compiled_name(const char *source)
+{
+  return add2strings(source, COMPILED_SUFFIX);
+}
+
+
+/* Write the nwords (sorted, unique) words to <source>.compiled. Exits when anything goes wrong */
+void
+write_word_index(const char *source, const char **words, long nwords)
+{
+  struct word_index_header header;
+  struct stat source_stat;
+  char *target = compiled_name(source);
+  char *tmpname = add2strings(target, ".tmp");
+  uint64_t *masks = mymalloc(max(nwords, 1) * sizeof(uint64_t));
+  uint64_t *offsets = mymalloc(max(nwords, 1) * sizeof(uint64_t));
+  uint64_t strings_size = 0;
+  long i;
+  int fd;
+
+  if (stat(source, &source_stat))
+    myerror(FATAL|USE_ERRNO, "cannot stat %s", source);
+  for (i = 0; i < nwords; i++) {
+    masks[i] = fuzzy_charmask(words[i]);
+    offsets[i] = strings_size;
+    strings_size += strlen(words[i]) + 1;
+  }
+
+  memset(&header, 0, sizeof(header));
+  mystrlcpy(header.magic, WORD_INDEX_MAGIC, sizeof(header.magic));
+  header.version          = WORD_INDEX_VERSION;
+  header.byte_order       = BYTE_ORDER_MARK;
+  header.case_sensitive   = completion_is_case_sensitive;
+  header.break_chars_hash = break_chars_hash();
+  header.source_size      = source_stat.st_size;
+  header.source_mtime     = source_stat.st_mtime;
+  header.nwords           = nwords;
+  header.strings_size     = strings_size;
+
+  /* write to a temporary file first, so that a running rlwrap never sees a half-written index */
+  if ((fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+    myerror(FATAL|USE_ERRNO, "cannot create %s", tmpname);
+  write_patiently(fd, &header, sizeof(header), tmpname);
+  write_patiently(fd, masks, nwords * sizeof(uint64_t), tmpname);
+  write_patiently(fd, offsets, nwords * sizeof(uint64_t), tmpname);
+  for (i = 0; i < nwords; i++)
+    write_patiently(fd, words[i], strlen(words[i]) + 1, tmpname);
+  if (close(fd) || rename(tmpname, target))
+    myerror(FATAL|USE_ERRNO, "cannot write %s", target);
+  printf("%s: %ld words\n", target, nwords);
+  free_multiple(target, tmpname, masks, offsets, FMEND);
+}
+
+
+/* map (or, if we cannot mmap(), read) the whole of file into memory. Returns NULL on failure */
+static void *
+map_file(const char *filename, size_t *psize)
+{
+  struct stat buf;
+  void *contents;
+  int fd = open(filename, O_RDONLY);
+
+  if (fd < 0)
+    return NULL;
+  if (fstat(fd, &buf) || buf.st_size < (off_t) sizeof(struct word_index_header)) {
+    close(fd);
+    return NULL;
+  }
+  *psize = buf.st_size;
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+  contents = mmap(NULL, *psize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (contents == MAP_FAILED)
+    contents = NULL;
+#else
+  contents = mymalloc(*psize);
+  if (read(fd, contents, *psize) != (ssize_t) *psize) {
+    free(contents);
+    contents = NULL;
+  }
+#endif
+  close(fd);
+  return contents;
+}
+
+
+static void
+unmap_file(void *contents, size_t size)
+{
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+  munmap(contents, size);
+#else
+  MAYBE_UNUSED(size);
+  free(contents);
+#endif
+}
+
+
+/* A damaged index would make us read beyond its end: check that every word starts within the strings section,
+   and that this section ends with a '\0' (so that every word ends within it, too) */
+static bool
+offsets_are_sane(const uint64_t *offsets, uint64_t nwords, const char *strings, uint64_t strings_size)
+{
+  uint64_t i;
+
+  if (nwords > 0 && (strings_size == 0 || strings[strings_size - 1] != '\0'))
+    return FALSE;
+  for (i = 0; i < nwords; i++)
+    if (offsets[i] >= strings_size)
+      return FALSE;
+  return TRUE;
+}
+
+
+/* Try to use <source>.compiled instead of source. Returns FALSE if there is no (usable) compiled list,
+   in which case the caller should parse source itself                                                 */
+bool
+load_word_index(const char *source, bool warn_if_stale)
+{
+  char *filename = compiled_name(source);
+  struct word_index_header *header;
+  struct stat source_stat;
+  struct word_index *index;
+  const char *complaint = NULL;
+  size_t size;
+  char *contents = map_file(filename, &size);
+
+  if (!contents) {
+    free(filename);
+    return FALSE;
+  }
+  header = (struct word_index_header *) contents;
+  if (strncmp(header->magic, WORD_INDEX_MAGIC, sizeof(header->magic)) || header->version != WORD_INDEX_VERSION || header->byte_order != BYTE_ORDER_MARK)
+    complaint = "is not a compiled completion list (or compiled by an incompatible rlwrap)";
+  else if (header->nwords > (size - sizeof(*header)) / (2 * sizeof(uint64_t)) /* (also guards against overflow on the next line) */
+           || size != sizeof(*header) + 2 * header->nwords * sizeof(uint64_t) + header->strings_size)
+    complaint = "is truncated";
+  else if (!offsets_are_sane((uint64_t *) (contents + sizeof(*header)) + header->nwords, header->nwords,
+                             contents + sizeof(*header) + 2 * header->nwords * sizeof(uint64_t), header->strings_size))
+    complaint = "is damaged";
+  else if (stat(source, &source_stat) == 0 && (source_stat.st_mtime != header->source_mtime || (uint64_t) source_stat.st_size != header->source_size))
+    complaint = "is older than the completion list it was compiled from";
+  else if (header->case_sensitive != (uint32_t) completion_is_case_sensitive || header->break_chars_hash != break_chars_hash())
+    complaint = "was compiled with different --break-chars, --case-insensitive or --complete-filenames options";
+
+  if (complaint) {
+    if (warn_if_stale)
+      myerror(WARNING|NOERRNO, "%s %s, using %s instead (re-compile with %s --compile-completions)", filename, complaint, source, program_name);
+    DPRINTF2(DEBUG_COMPLETION, "not using %s: %s", filename, complaint);
+    unmap_file(contents, size);
+    free(filename);
+    return FALSE;
+  }
+
+  indexes = myrealloc(indexes, nindexes * sizeof(struct word_index), (nindexes + 1) * sizeof(struct word_index));
+  index = &indexes[nindexes++];
+  index->filename = filename;
+  index->nwords   = header->nwords;
+  index->masks    = (uint64_t *) (contents + sizeof(*header));
+  index->offsets  = index->masks + index->nwords;
+  index->strings  = (const char *) (index->offsets + index->nwords);
+  if (fuzzy_completion)
+    fuzzy_add_segment(index->masks, index->offsets, index->strings, index->nwords);
+  DPRINTF2(DEBUG_COMPLETION, "using %s (%ld words)", filename, index->nwords);
+  return TRUE;
+}
+
+
+/* find the first word >= word in index (or index->nwords, if there is none) */
+static long
+first_not_less_than(const struct word_index *index, const char *word)
+{
+  long low = 0, high = index->nwords;
+  while (low < high) {
+    long middle = low + (high - low) / 2;
+    if (compare(index->strings + index->offsets[middle], word) < 0)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  return low;
+}
+
+
+static int
+starts_with(const char *word, const char *prefix)
+{
+  for (; *prefix; prefix++, word++)
+    if (completion_is_case_sensitive ? *word != *prefix : tolower(*word) != tolower(*prefix))
+      return FALSE;
+  return TRUE;
+}
+
+
+/* All live words starting with prefix in all compiled lists, as a NULL-terminated list of pointers into those lists
+   (so the caller should only free() the list itself). Words from different lists are not merged: use compare() to sort them.
+   If after is not NULL, start with the first word after it (to fetch the next page of a long list). If max_per_list > 0,
+   take at most that many words from every list                                                                             */
+const char **
+indexed_words_with_prefix(const char *prefix, const char *after, int max_per_list)
+{
+  const char **result = NULL;
+  int count = 0, allocated = 0, i;
+
+  for (i = 0; i < nindexes; i++) {
+    const struct word_index *index = &indexes[i];
+    long n = first_not_less_than(index, after ? after : prefix);
+    int taken = 0;
+    if (after && n < index->nwords && compare(index->strings + index->offsets[n], after) == 0)
+      n++;
+    for (; n < index->nwords && (max_per_list <= 0 || taken < max_per_list); n++) {
+      const char *word = index->strings + index->offsets[n];
+      if (!starts_with(word, prefix))
+        break;
+      if (!index->masks[n])
+        continue;
+      taken++;
+      if (count + 1 >= allocated) {
+        int new_allocated = max(2 * allocated, 64);
+        result = myrealloc(result, allocated * sizeof(char *), new_allocated * sizeof(char *));
+        allocated = new_allocated;
+      }
+      result[count++] = word;
+    }
+  }
+  if (!result)
+    result = mymalloc(sizeof(char *));
+  result[count] = NULL;
+  return result;
+}
+
+
+/* find a live word in the compiled lists, returning a pointer to its mask (or NULL if not found) */
+static uint64_t *
+find_indexed_word(const char *word)
+{
+  int i;
+  for (i = 0; i < nindexes; i++) {
+    struct word_index *index = &indexes[i];
+    long n = first_not_less_than(index, word);
+    if (n < index->nwords && index->masks[n] && compare(index->strings + index->offsets[n], word) == 0)
+      return &index->masks[n];
+  }
+  return NULL;
+}
+
+
+bool
+word_is_indexed(const char *word)
+{
+  return nindexes > 0 && find_indexed_word(word) != NULL;
+}
+
+
+/* remove word from the compiled lists (by marking it as dead), returning TRUE if it was there */
+bool
+unindex_word(const char *word)
+{
+  bool found = FALSE;
+  uint64_t *mask;
+  while (nindexes > 0 && (mask = find_indexed_word(word))) { /* word may occur in more than one list */
+    *mask = 0;
+    found = TRUE;
+  }
+  return found;
+}
+
+
+/* The BK-tree that is used to find corrections (cf. bktree.c) should contain the words on the compiled lists as well. Adding
+   millions of them at once would take a while, so this is done a chunk of at most max_words at a time, while rlwrap is idle
+   (cf. lazyload.c). Returns TRUE when all words have been added                                                                */
+bool
+add_indexed_words_to_bktree(int max_words)
+{
+  int count;
+
+  for (count = 0; bktree_index < nindexes && count < max_words; count++) {
+    const struct word_index *index = &indexes[bktree_index];
+    if (bktree_word >= index->nwords) {
+      bktree_index++;
+      bktree_word = 0;
+      continue;
+    }
+    if (index->masks[bktree_word]) /* removed words are skipped */
+      bktree_add(index->strings + index->offsets[bktree_word]);
+    bktree_word++;
+  }
+  return bktree_index >= nindexes;
+}